@@ -6,26 +6,40 @@
 #include "sha2.h"
 #include "salsa20.h"
 #include "hmac.h"
+#include "probes.h"
 
 
 #define NONCE_SZ    8
 
+/*
+ * Generate a nonce into the provided buffer of NONCE_SZ bytes.
+ * Thread-safe. Returns 0 on success, -1 if no random source is available.
+ */
+int get_nonce_r(uint8_t * nonce)
+{
+    FILE * ran ;
+    size_t n ;
+
+    if ((ran=fopen("/dev/urandom", "r"))==NULL) {
+        return -1 ;
+    }
+    n = fread(nonce, sizeof(uint8_t), NONCE_SZ, ran);
+    fclose(ran);
+    return n==NONCE_SZ ? 0 : -1 ;
+}
+
 /*
  * Generate a nonce and return a pointer to it.
  * The pointer is statically allocated inside this function, do not free or
- * modify it! This is not thread-safe.
+ * modify it! This is not thread-safe, use get_nonce_r() in threads.
  */
 uint8_t * get_nonce(void)
 {
     static uint8_t  nonce[NONCE_SZ];
-    FILE * ran ;
-    int i ;
 
-    if ((ran=fopen("/dev/urandom", "r"))==NULL) {
+    if (get_nonce_r(nonce)!=0) {
         return NULL ;
     }
-    fread(nonce, sizeof(uint8_t), NONCE_SZ, ran);
-    fclose(ran);
     return nonce ;
 }
 
@@ -89,10 +103,14 @@ int stream_cipher(
     uint8_t * nonce)
 {
     sha256_ctx  sctx ;
+    int         ret ;
 
     if (!buf || !key || (sz<1) || !nonce) {
         return -1 ;
     }
-    return s20_crypt(key, S20_KEYLEN_256, nonce, offset, buf, sz);
+    PROBE2(cipher__entry, sz, offset);
+    ret = s20_crypt(key, S20_KEYLEN_256, nonce, offset, buf, sz);
+    PROBE2(cipher__return, sz, ret);
+    return ret ;
 }
 
@@ -6,6 +6,7 @@
 #define NONCE_SZ    8
 
 uint8_t * get_nonce(void);
+int get_nonce_r(uint8_t * nonce);
 
 void bin2hex(uint8_t * b, size_t sz, char * hex);
 void hex2bin(char * hex, uint8_t * b, size_t sz);
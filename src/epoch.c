@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+/*
+ * The global epoch moves forward by one every time an object is retired.
+ * A reader publishes the epoch it entered in, 0 when it is outside. An
+ * object retired in epoch t can be released once all active readers
+ * entered in a later epoch: they started after the object was
+ * unpublished and cannot have seen it.
+ * Reader slots sit on their own cache line so that readers never write
+ * to a line shared with another thread.
+ */
+static uint64_t epoch_now = 1 ;
+
+static struct {
+    uint64_t    epoch ;
+    int         used ;
+} __attribute__((aligned(64))) epoch_reader[EPOCH_MAXREADERS] ;
+
+static __thread int     epoch_self = -1 ;
+static pthread_key_t    epoch_key ;
+static pthread_once_t   epoch_once = PTHREAD_ONCE_INIT ;
+
+/* Objects waiting for their grace period, guarded by epoch_lock */
+typedef struct __epoch_limbo__ {
+    void *      p ;
+    void        (*release)(void *) ;
+    uint64_t    epoch ;
+    struct __epoch_limbo__ * next ;
+} epoch_limbo ;
+
+static epoch_limbo *    limbo ;
+static pthread_mutex_t  epoch_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+/* Give the reader slot back when its thread exits */
+static void epoch_unregister(void * arg)
+{
+    int i = (int)(intptr_t)arg - 1 ;
+
+    __atomic_store_n(&epoch_reader[i].epoch, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&epoch_reader[i].used, 0, __ATOMIC_RELEASE);
+    return ;
+}
+
+static void epoch_key_init(void)
+{
+    pthread_key_create(&epoch_key, epoch_unregister);
+}
+
+static int epoch_register(void)
+{
+    int i, unused ;
+
+    pthread_once(&epoch_once, epoch_key_init);
+    for (i=0 ; i<EPOCH_MAXREADERS ; i++) {
+        unused = 0 ;
+        if (__atomic_compare_exchange_n(&epoch_reader[i].used, &unused, 1,
+                                        0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            epoch_self = i ;
+            pthread_setspecific(epoch_key, (void*)(intptr_t)(i+1));
+            return 0 ;
+        }
+    }
+    return -1 ;
+}
+
+/*
+ * Start a lock-free read section.
+ * Returns 0, or -1 if no reader slot is available.
+ */
+int epoch_enter(void)
+{
+    uint64_t e ;
+
+    if (epoch_self<0 && epoch_register()!=0) {
+        return -1 ;
+    }
+    e = __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&epoch_reader[epoch_self].epoch, e, __ATOMIC_SEQ_CST);
+    /* Pairs with the fence in epoch_retire() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0 ;
+}
+
+void epoch_exit(void)
+{
+    __atomic_store_n(&epoch_reader[epoch_self].epoch, 0, __ATOMIC_RELEASE);
+    return ;
+}
+
+/* Oldest epoch a reader is still in, or UINT64_MAX if none */
+static uint64_t epoch_oldest(void)
+{
+    uint64_t    e, oldest = UINT64_MAX ;
+    int         i ;
+
+    for (i=0 ; i<EPOCH_MAXREADERS ; i++) {
+        e = __atomic_load_n(&epoch_reader[i].epoch, __ATOMIC_SEQ_CST);
+        if (e && e<oldest) {
+            oldest = e ;
+        }
+    }
+    return oldest ;
+}
+
+/*
+ * Release p with release(p) once no reader can see it any more. The
+ * caller must have unpublished p already. Objects whose grace period is
+ * over are released on the way.
+ */
+void epoch_retire(void * p, void (*release)(void *))
+{
+    epoch_limbo *   node ;
+    epoch_limbo **  link ;
+    uint64_t        oldest ;
+
+    if (!p) {
+        return ;
+    }
+    /* Pairs with the fence in epoch_enter() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&epoch_lock);
+    if ((node = malloc(sizeof(epoch_limbo)))==NULL) {
+        /* Cannot defer: leak rather than risk a use after free */
+        pthread_mutex_unlock(&epoch_lock);
+        return ;
+    }
+    node->p       = p ;
+    node->release = release ;
+    node->epoch   = __atomic_fetch_add(&epoch_now, 1, __ATOMIC_SEQ_CST);
+    node->next    = limbo ;
+    limbo = node ;
+
+    oldest = epoch_oldest();
+    link = &limbo ;
+    while ((node = *link)!=NULL) {
+        if (node->epoch < oldest) {
+            *link = node->next ;
+            node->release(node->p);
+            free(node);
+        } else {
+            link = &node->next ;
+        }
+    }
+    pthread_mutex_unlock(&epoch_lock);
+    return ;
+}
+
+void epoch_barrier(void)
+{
+    epoch_limbo *   node ;
+
+    pthread_mutex_lock(&epoch_lock);
+    while ((node = limbo)!=NULL) {
+        limbo = node->next ;
+        node->release(node->p);
+        free(node);
+    }
+    pthread_mutex_unlock(&epoch_lock);
+    return ;
+}
+
+/* vim: set ts=4 et sw=4 tw=75 */
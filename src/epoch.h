@@ -0,0 +1,25 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+/*
+ * Epoch-based reclamation for data read without locks.
+ * A reader brackets its lock-free section with epoch_enter() and
+ * epoch_exit(). A writer that unpublished an object hands it over to
+ * epoch_retire() instead of releasing it: the object is released once
+ * every reader that could still hold a pointer to it has left.
+ *
+ * Each thread takes one reader slot on first use and gives it back when
+ * it exits. epoch_enter() fails when all slots are taken, the caller
+ * must then fall back to locking.
+ */
+#define EPOCH_MAXREADERS    64
+
+int  epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void * p, void (*release)(void *));
+
+/* Release all retired objects now. No reader may be active. */
+void epoch_barrier(void);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
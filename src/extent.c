@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "extent.h"
+
+/* Holes are mapped to this page, see extmap_map() */
+static const uint8_t extmap_zero[EXTENTSZ] ;
+
+/*
+ * Pages shared between files by extmap_share() are reference counted in
+ * a hash table keyed by page address, with linear probing. A page that
+ * is not in the table has a single owner, which is the common case: as
+ * long as nothing is shared the table is never looked at.
+ * A page is only made shared by a caller holding its file locked, and
+ * only written to by a caller holding its file locked for writing, so
+ * writers may check shared_cnt without taking shared_lock.
+ */
+typedef struct {
+    uint8_t *   page ;
+    size_t      refs ;
+} shared_page ;
+
+static shared_page *    shared_tab ;
+static size_t           shared_cap ;    /* Power of two */
+static size_t           shared_cnt ;    /* Pages in the table */
+static size_t           shared_dup ;    /* Sum of refs-1 over the table */
+static pthread_mutex_t  shared_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+/* Memory held over all maps, updated atomically, see extmap_held() */
+static size_t           held_pages ;    /* Shared pages counted once */
+static size_t           held_slots ;    /* Page table slots */
+static size_t           held_tables ;
+
+static size_t shared_hash(const uint8_t * page)
+{
+    return (size_t)(((uint64_t)(uintptr_t)page * 0x9e3779b97f4a7c15ULL)
+                    >> 32) & (shared_cap - 1) ;
+}
+
+/* Table entry for page, or NULL if it has a single owner */
+static shared_page * shared_find(const uint8_t * page)
+{
+    size_t  i ;
+
+    if (shared_cap==0) {
+        return NULL ;
+    }
+    for (i=shared_hash(page) ; shared_tab[i].page ;
+         i=(i+1) & (shared_cap-1)) {
+        if (shared_tab[i].page==page) {
+            return shared_tab+i ;
+        }
+    }
+    return NULL ;
+}
+
+static void shared_put(uint8_t * page, size_t refs)
+{
+    size_t  i ;
+
+    for (i=shared_hash(page) ; shared_tab[i].page ;
+         i=(i+1) & (shared_cap-1)) ;
+    shared_tab[i].page = page ;
+    shared_tab[i].refs = refs ;
+    return ;
+}
+
+/* Add an owner to page. Returns 0, or -1 if the table cannot grow. */
+static int shared_ref(uint8_t * page)
+{
+    shared_page *   e ;
+    shared_page *   old ;
+    size_t          oldcap, i ;
+
+    if ((e = shared_find(page))!=NULL) {
+        e->refs++ ;
+        __atomic_add_fetch(&shared_dup, 1, __ATOMIC_RELAXED);
+        return 0 ;
+    }
+    if ((shared_cnt+1)*2 > shared_cap) {
+        old    = shared_tab ;
+        oldcap = shared_cap ;
+        shared_cap = oldcap ? oldcap*2 : 64 ;
+        if ((shared_tab = calloc(shared_cap, sizeof(shared_page)))==NULL) {
+            shared_tab = old ;
+            shared_cap = oldcap ;
+            return -1 ;
+        }
+        for (i=0 ; i<oldcap ; i++) {
+            if (old[i].page) {
+                shared_put(old[i].page, old[i].refs);
+            }
+        }
+        free(old);
+    }
+    shared_put(page, 2);
+    __atomic_add_fetch(&shared_cnt, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared_dup, 1, __ATOMIC_RELAXED);
+    return 0 ;
+}
+
+/*
+ * Drop an owner from page. Returns 1 if the caller was the last owner
+ * and must free the page.
+ */
+static int shared_unref(uint8_t * page)
+{
+    shared_page *   e ;
+    size_t          i, j, k ;
+
+    if ((e = shared_find(page))==NULL) {
+        return 1 ;
+    }
+    __atomic_sub_fetch(&shared_dup, 1, __ATOMIC_RELAXED);
+    if (--e->refs > 1) {
+        return 0 ;
+    }
+    /* Single owner left: remove the entry, shifting its followers */
+    i = e - shared_tab ;
+    for (j=(i+1) & (shared_cap-1) ; shared_tab[j].page ;
+         j=(j+1) & (shared_cap-1)) {
+        k = shared_hash(shared_tab[j].page) ;
+        if ((j > i && (k <= i || k > j)) ||
+            (j < i && (k <= i && k > j))) {
+            shared_tab[i] = shared_tab[j] ;
+            i = j ;
+        }
+    }
+    shared_tab[i].page = NULL ;
+    __atomic_sub_fetch(&shared_cnt, 1, __ATOMIC_RELAXED);
+    return 0 ;
+}
+
+static int shared_any(void)
+{
+    return __atomic_load_n(&shared_cnt, __ATOMIC_RELAXED)>0 ;
+}
+
+/* New page of zeros, or NULL if out of memory */
+static uint8_t * extmap_page(void)
+{
+    uint8_t * page ;
+
+    if ((page = calloc(EXTENTSZ, sizeof(uint8_t)))!=NULL) {
+        __atomic_add_fetch(&held_pages, 1, __ATOMIC_RELAXED);
+    }
+    return page ;
+}
+
+static void extmap_page_free(uint8_t * page)
+{
+    free(page);
+    __atomic_sub_fetch(&held_pages, 1, __ATOMIC_RELAXED);
+}
+
+/* Release a page owned by the caller */
+static void extmap_release(uint8_t * page)
+{
+    int last = 1 ;
+
+    if (shared_any()) {
+        pthread_mutex_lock(&shared_lock);
+        last = shared_unref(page);
+        pthread_mutex_unlock(&shared_lock);
+    }
+    if (last) {
+        extmap_page_free(page);
+    }
+    return ;
+}
+
+/*
+ * Make page i private before writing to it: a shared page is copied
+ * and the copy replaces it in this map only.
+ * Returns 0, or -1 if memory could not be allocated.
+ */
+static int extmap_own(extmap * em, size_t i)
+{
+    uint8_t *   copy ;
+    int         ret = 0 ;
+
+    if (!shared_any() || em->page[i]==NULL) {
+        return 0 ;
+    }
+    pthread_mutex_lock(&shared_lock);
+    if (shared_find(em->page[i])) {
+        if ((copy = malloc(EXTENTSZ))==NULL) {
+            ret = -1 ;
+        } else {
+            __atomic_add_fetch(&held_pages, 1, __ATOMIC_RELAXED);
+            memcpy(copy, em->page[i], EXTENTSZ);
+            shared_unref(em->page[i]);
+            em->page[i] = copy ;
+        }
+    }
+    pthread_mutex_unlock(&shared_lock);
+    return ret ;
+}
+
+/* Number of maps holding page, 1 unless it was shared by extmap_share() */
+size_t extmap_refs(const uint8_t * page)
+{
+    shared_page *   e ;
+    size_t          refs = 1 ;
+
+    if (!shared_any()) {
+        return 1 ;
+    }
+    pthread_mutex_lock(&shared_lock);
+    if ((e = shared_find(page))!=NULL) {
+        refs = e->refs ;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    return refs ;
+}
+
+/* Make sure the page table has at least 'n' slots */
+static int extmap_grow(extmap * em, size_t n)
+{
+    uint8_t **  newtab ;
+    size_t      newsz ;
+
+    if (n <= em->nslots) {
+        return 0 ;
+    }
+    newsz = em->nslots * 2 ;
+    if (newsz < n) {
+        newsz = n ;
+    }
+    newtab = realloc(em->page, newsz * sizeof(uint8_t*));
+    if (!newtab) {
+        return -1 ;
+    }
+    memset(newtab + em->nslots, 0, (newsz - em->nslots) * sizeof(uint8_t*));
+    if (em->page==NULL) {
+        __atomic_add_fetch(&held_tables, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&held_slots, newsz - em->nslots, __ATOMIC_RELAXED);
+    em->page   = newtab ;
+    em->nslots = newsz ;
+    return 0 ;
+}
+
+/*
+ * Initialize an empty extent map: no pages, the whole file is a hole
+ */
+void extmap_init(extmap * em)
+{
+    if (!em) {
+        return ;
+    }
+    memset(em, 0, sizeof(extmap));
+    return ;
+}
+
+/*
+ * Release all pages and the page table
+ */
+void extmap_free(extmap * em)
+{
+    size_t i ;
+
+    if (!em) {
+        return ;
+    }
+    for (i=0 ; i<em->nslots ; i++) {
+        if (em->page[i]) {
+            extmap_release(em->page[i]);
+        }
+    }
+    if (em->page) {
+        __atomic_sub_fetch(&held_tables, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&held_slots, em->nslots, __ATOMIC_RELAXED);
+    }
+    free(em->page);
+    memset(em, 0, sizeof(extmap));
+    return ;
+}
+
+/*
+ * Write sz bytes at offset off. Pages are allocated on demand, only for
+ * the range actually written to.
+ * Returns 0 on success, -1 if memory could not be allocated.
+ */
+int extmap_write(extmap * em, const uint8_t * buf, size_t sz, off_t off)
+{
+    size_t  i, pos, chunk ;
+
+    if (!em || !buf || sz<1) {
+        return 0 ;
+    }
+    if (extmap_grow(em, (off + sz - 1) / EXTENTSZ + 1)!=0) {
+        return -1 ;
+    }
+    while (sz>0) {
+        i     = off / EXTENTSZ ;
+        pos   = off % EXTENTSZ ;
+        chunk = EXTENTSZ - pos ;
+        if (chunk > sz) {
+            chunk = sz ;
+        }
+        if (em->page[i]==NULL) {
+            if ((em->page[i] = extmap_page())==NULL) {
+                return -1 ;
+            }
+            em->npages++ ;
+        } else if (extmap_own(em, i)!=0) {
+            return -1 ;
+        }
+        memcpy(em->page[i] + pos, buf, chunk);
+        buf += chunk ;
+        off += chunk ;
+        sz  -= chunk ;
+    }
+    return 0 ;
+}
+
+/*
+ * Read sz bytes from offset off. Holes read back as zeros.
+ * The caller is responsible for clamping the request to the file size.
+ */
+void extmap_read(extmap * em, uint8_t * buf, size_t sz, off_t off)
+{
+    size_t  i, pos, chunk ;
+
+    if (!em || !buf) {
+        return ;
+    }
+    while (sz>0) {
+        i     = off / EXTENTSZ ;
+        pos   = off % EXTENTSZ ;
+        chunk = EXTENTSZ - pos ;
+        if (chunk > sz) {
+            chunk = sz ;
+        }
+        if (i < em->nslots && em->page[i]) {
+            memcpy(buf, em->page[i] + pos, chunk);
+        } else {
+            memset(buf, 0, chunk);
+        }
+        buf += chunk ;
+        off += chunk ;
+        sz  -= chunk ;
+    }
+    return ;
+}
+
+/*
+ * Describe sz bytes at offset off as memory segments, one per page, so
+ * that they can be accessed in place. With alloc set, missing pages are
+ * allocated and the segments may be written to. Otherwise holes map to
+ * a shared page of zeros and must only be read.
+ * iov must have room for EXTMAP_MAXIOV(sz) segments.
+ * Returns the number of segments, or -1 if memory could not be
+ * allocated.
+ */
+int extmap_map(extmap * em, struct iovec * iov, size_t sz, off_t off,
+               int alloc)
+{
+    size_t  i, pos, chunk ;
+    int     n = 0 ;
+
+    if (!em || !iov) {
+        return 0 ;
+    }
+    if (alloc && sz>0 &&
+        extmap_grow(em, (off + sz - 1) / EXTENTSZ + 1)!=0) {
+        return -1 ;
+    }
+    while (sz>0) {
+        i     = off / EXTENTSZ ;
+        pos   = off % EXTENTSZ ;
+        chunk = EXTENTSZ - pos ;
+        if (chunk > sz) {
+            chunk = sz ;
+        }
+        if (alloc && em->page[i]==NULL) {
+            if ((em->page[i] = extmap_page())==NULL) {
+                return -1 ;
+            }
+            em->npages++ ;
+        } else if (alloc && extmap_own(em, i)!=0) {
+            return -1 ;
+        }
+        if (i < em->nslots && em->page[i]) {
+            iov[n].iov_base = em->page[i] + pos ;
+        } else {
+            iov[n].iov_base = (void*)(extmap_zero + pos) ;
+        }
+        iov[n].iov_len = chunk ;
+        n++ ;
+        off += chunk ;
+        sz  -= chunk ;
+    }
+    return n ;
+}
+
+/*
+ * Set the logical size of the file. Extending a file only creates a hole
+ * at the end and allocates nothing. Shrinking releases the pages past the
+ * new end along with their page table slots, so that the cost is in the
+ * number of slots released, and zeroes the tail of the last page to keep
+ * the invariant.
+ * Returns 0, or -1 if a shared last page could not be copied, in which
+ * case nothing has changed.
+ */
+int extmap_truncate(extmap * em, off_t size)
+{
+    uint8_t **  newtab ;
+    size_t      keep, i ;
+
+    if (!em) {
+        return 0 ;
+    }
+    keep = (size + EXTENTSZ - 1) / EXTENTSZ ;
+    if (keep > em->nslots) {
+        return 0 ;
+    }
+    if ((size % EXTENTSZ) && extmap_own(em, keep-1)!=0) {
+        return -1 ;
+    }
+    for (i=keep ; i<em->nslots && em->npages>0 ; i++) {
+        if (em->page[i]) {
+            extmap_release(em->page[i]);
+            em->page[i] = NULL ;
+            em->npages-- ;
+        }
+    }
+    if (keep==0 && em->page) {
+        __atomic_sub_fetch(&held_tables, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&held_slots, em->nslots, __ATOMIC_RELAXED);
+        free(em->page);
+        em->page   = NULL ;
+        em->nslots = 0 ;
+        return 0 ;
+    }
+    /* If the table cannot shrink, it keeps its slots, all NULL past keep */
+    if (keep < em->nslots &&
+        (newtab = realloc(em->page, keep * sizeof(uint8_t*)))!=NULL) {
+        __atomic_sub_fetch(&held_slots, em->nslots - keep,
+                           __ATOMIC_RELAXED);
+        em->page   = newtab ;
+        em->nslots = keep ;
+    }
+    if ((size % EXTENTSZ) && em->page[keep-1]) {
+        memset(em->page[keep-1] + size % EXTENTSZ,
+               0,
+               EXTENTSZ - size % EXTENTSZ);
+    }
+    return 0 ;
+}
+
+/*
+ * Allocate the pages covering sz bytes at offset off, so that writing
+ * there later allocates nothing. Existing pages are left alone.
+ * Returns 0, or -1 if memory could not be allocated. Pages allocated
+ * before the failure are kept.
+ */
+int extmap_alloc(extmap * em, off_t off, size_t sz)
+{
+    size_t  i, last ;
+
+    if (!em || sz<1) {
+        return 0 ;
+    }
+    last = (off + sz - 1) / EXTENTSZ ;
+    if (extmap_grow(em, last + 1)!=0) {
+        return -1 ;
+    }
+    for (i=off / EXTENTSZ ; i<=last ; i++) {
+        if (em->page[i]==NULL) {
+            if ((em->page[i] = extmap_page())==NULL) {
+                return -1 ;
+            }
+            em->npages++ ;
+        }
+    }
+    return 0 ;
+}
+
+/*
+ * Zero sz bytes at offset off. Pages entirely inside the range are
+ * released and become holes, unless keep is set: they are then zeroed
+ * in place, or allocated if they were holes.
+ * Returns 0, or -1 if memory could not be allocated.
+ */
+int extmap_clear(extmap * em, off_t off, size_t sz, int keep)
+{
+    size_t  i, pos, chunk ;
+
+    if (!em || sz<1) {
+        return 0 ;
+    }
+    if (keep && extmap_grow(em, (off + sz - 1) / EXTENTSZ + 1)!=0) {
+        return -1 ;
+    }
+    while (sz>0) {
+        i     = off / EXTENTSZ ;
+        pos   = off % EXTENTSZ ;
+        chunk = EXTENTSZ - pos ;
+        if (chunk > sz) {
+            chunk = sz ;
+        }
+        if (i >= em->nslots) {
+            break ;
+        }
+        if (chunk==EXTENTSZ && em->page[i] &&
+            (!keep || extmap_refs(em->page[i])>1)) {
+            extmap_release(em->page[i]);
+            em->page[i] = NULL ;
+            em->npages-- ;
+        }
+        if (em->page[i]) {
+            if (extmap_own(em, i)!=0) {
+                return -1 ;
+            }
+            memset(em->page[i] + pos, 0, chunk);
+        } else if (keep) {
+            if ((em->page[i] = extmap_page())==NULL) {
+                return -1 ;
+            }
+            em->npages++ ;
+        }
+        off += chunk ;
+        sz  -= chunk ;
+    }
+    return 0 ;
+}
+
+/*
+ * Make sz bytes at offset doff in dst share the pages of src at offset
+ * soff, copy-on-write: whichever file writes to a shared page first gets
+ * its own copy. Offsets and sz must be multiples of EXTENTSZ. Holes in
+ * src become holes in dst.
+ * Returns 0, or -1 if memory could not be allocated. Pages shared before
+ * the failure stay shared.
+ */
+int extmap_share(extmap * dst, off_t doff, extmap * src, off_t soff,
+                 size_t sz)
+{
+    size_t      di, si, n ;
+    uint8_t *   sp ;
+    uint8_t *   dp ;
+    int         ret = 0 ;
+
+    if (!dst || !src || sz<1) {
+        return 0 ;
+    }
+    n  = sz / EXTENTSZ ;
+    di = doff / EXTENTSZ ;
+    si = soff / EXTENTSZ ;
+    if (extmap_grow(dst, di + n)!=0) {
+        return -1 ;
+    }
+    pthread_mutex_lock(&shared_lock);
+    for ( ; n>0 ; n--, di++, si++) {
+        sp = si < src->nslots ? src->page[si] : NULL ;
+        dp = dst->page[di] ;
+        if (sp==dp) {
+            continue ;
+        }
+        if (sp && shared_ref(sp)!=0) {
+            ret = -1 ;
+            break ;
+        }
+        if (dp) {
+            if (shared_unref(dp)) {
+                extmap_page_free(dp);
+            }
+            dst->npages-- ;
+        }
+        dst->page[di] = sp ;
+        if (sp) {
+            dst->npages++ ;
+        }
+    }
+    pthread_mutex_unlock(&shared_lock);
+    return ret ;
+}
+
+size_t extmap_allocated(extmap * em)
+{
+    return em ? em->npages * EXTENTSZ : 0 ;
+}
+
+size_t extmap_shared(void)
+{
+    return __atomic_load_n(&shared_dup, __ATOMIC_RELAXED) * EXTENTSZ ;
+}
+
+size_t extmap_held(size_t * npages, size_t * ntables)
+{
+    size_t pages = __atomic_load_n(&held_pages, __ATOMIC_RELAXED) ;
+
+    if (npages) {
+        *npages = pages ;
+    }
+    if (ntables) {
+        *ntables = __atomic_load_n(&held_tables, __ATOMIC_RELAXED);
+    }
+    return pages * EXTENTSZ ;
+}
+
+/*
+ * Pages in the range that are holes, or shared and copied on write.
+ * Growing the page table is not counted.
+ */
+size_t extmap_missing(extmap * em, off_t off, size_t sz)
+{
+    size_t  i, last, n=0 ;
+
+    if (!em || sz<1) {
+        return 0 ;
+    }
+    last = (off + sz - 1) / EXTENTSZ ;
+    for (i=off / EXTENTSZ ; i<=last ; i++) {
+        if (i >= em->nslots) {
+            n += last - i + 1 ;
+            break ;
+        }
+        if (em->page[i]==NULL || extmap_refs(em->page[i])>1) {
+            n++ ;
+        }
+    }
+    return n * EXTENTSZ ;
+}
+
+size_t extmap_table_bytes(void)
+{
+    return __atomic_load_n(&held_slots, __ATOMIC_RELAXED) *
+           sizeof(uint8_t*) ;
+}
+
+/*
+ * Return the offset of the first data byte at or after off, or -1 if
+ * there is only a hole left until the end of file.
+ */
+off_t extmap_seek_data(extmap * em, off_t off, off_t size)
+{
+    size_t  i ;
+    off_t   pos ;
+
+    if (!em || off<0 || off>=size) {
+        return -1 ;
+    }
+    i = off / EXTENTSZ ;
+    while (i < em->nslots && em->page[i]==NULL) {
+        i++ ;
+    }
+    if (i >= em->nslots) {
+        return -1 ;
+    }
+    pos = (off_t)i * EXTENTSZ ;
+    if (pos < off) {
+        pos = off ;
+    }
+    return pos < size ? pos : -1 ;
+}
+
+/*
+ * Return the offset of the first hole byte at or after off. There is
+ * always an implicit hole at end of file. Returns -1 if off is past the
+ * end of file.
+ */
+off_t extmap_seek_hole(extmap * em, off_t off, off_t size)
+{
+    size_t  i ;
+    off_t   pos ;
+
+    if (!em || off<0 || off>=size) {
+        return -1 ;
+    }
+    i = off / EXTENTSZ ;
+    while (i < em->nslots && em->page[i]!=NULL) {
+        i++ ;
+    }
+    pos = (off_t)i * EXTENTSZ ;
+    if (pos < off) {
+        pos = off ;
+    }
+    return pos < size ? pos : size ;
+}
+
+off_t extmap_next_run(extmap * em, off_t off, off_t size, size_t * len)
+{
+    off_t   start ;
+
+    if ((start = extmap_seek_data(em, off, size))<0) {
+        return -1 ;
+    }
+    *len = extmap_seek_hole(em, start, size) - start ;
+    return start ;
+}
+
+/* vim: set ts=4 et sw=4 tw=75 */
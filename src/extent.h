@@ -0,0 +1,69 @@
+#ifndef _EXTENT_H_
+#define _EXTENT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "fslimits.h"
+
+/*
+ * File contents are stored as a table of fixed-size pages of EXTENTSZ
+ * bytes. A NULL entry in the table is a hole: it takes no memory and
+ * reads back as zeros. Bytes beyond the logical file size inside an
+ * allocated page are always kept at zero, so that growing a file never
+ * needs to touch existing pages.
+ */
+typedef struct __extmap__ {
+    uint8_t **  page ;      /* Page table, NULL for holes */
+    size_t      nslots ;    /* Number of slots in page table */
+    size_t      npages ;    /* Number of allocated pages */
+} extmap ;
+
+void    extmap_init(extmap * em);
+void    extmap_free(extmap * em);
+
+int     extmap_write(extmap * em, const uint8_t * buf, size_t sz, off_t off);
+void    extmap_read(extmap * em, uint8_t * buf, size_t sz, off_t off);
+int     extmap_truncate(extmap * em, off_t size);
+int     extmap_alloc(extmap * em, off_t off, size_t sz);
+int     extmap_clear(extmap * em, off_t off, size_t sz, int keep);
+
+/* Map a range to memory segments for in-place access, see extent.c */
+#define EXTMAP_MAXIOV(sz)   ((sz) / EXTENTSZ + 2)
+int     extmap_map(extmap * em, struct iovec * iov, size_t sz, off_t off,
+                   int alloc);
+
+/* Share whole pages between two maps, copy-on-write, see extent.c */
+int     extmap_share(extmap * dst, off_t doff, extmap * src, off_t soff,
+                     size_t sz);
+size_t  extmap_refs(const uint8_t * page);
+
+/* Bytes of memory held by allocated pages, shared pages included */
+size_t  extmap_allocated(extmap * em);
+/* Bytes counted more than once by extmap_allocated() over all maps */
+size_t  extmap_shared(void);
+/*
+ * Bytes held by pages over all maps, shared pages counted once. Sets
+ * the number of pages and of page tables if not NULL.
+ */
+size_t  extmap_held(size_t * npages, size_t * ntables);
+/* Bytes held by page tables over all maps */
+size_t  extmap_table_bytes(void);
+/* Bytes of pages that writing sz bytes at offset off would allocate */
+size_t  extmap_missing(extmap * em, off_t off, size_t sz);
+
+/*
+ * Find the next run of allocated pages starting at or after offset
+ * 'off', limited to 'size'. Returns the run offset and sets *len, or
+ * returns -1 when there is no more data.
+ */
+off_t   extmap_next_run(extmap * em, off_t off, off_t size, size_t * len);
+
+/* lseek(2) SEEK_DATA / SEEK_HOLE semantics over a file of 'size' bytes */
+off_t   extmap_seek_data(extmap * em, off_t off, off_t size);
+off_t   extmap_seek_hole(extmap * em, off_t off, off_t size);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
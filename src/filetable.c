@@ -0,0 +1,1025 @@
+/* For FALLOC_FL_KEEP_SIZE */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "filetable.h"
+#include "inode.h"
+#include "epoch.h"
+#include "slab.h"
+#include "probes.h"
+
+/* Fields read by lock-free lookups are accessed atomically */
+#define SLOT_GET(f)     __atomic_load_n(&(f), __ATOMIC_RELAXED)
+#define SLOT_SET(f, v)  __atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+
+/* Open and close a change to the metadata of slot i */
+static void slot_begin(filetable * ft, int i)
+{
+    __atomic_store_n(ft->seq+i, ft->seq[i]+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_end(filetable * ft, int i)
+{
+    __atomic_store_n(ft->seq+i, ft->seq[i]+1, __ATOMIC_RELEASE);
+}
+
+/* Open and close a change to the table layout */
+static void gen_begin(filetable * ft)
+{
+    __atomic_store_n(&ft->gen, ft->gen+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void gen_end(filetable * ft)
+{
+    __atomic_store_n(&ft->gen, ft->gen+1, __ATOMIC_RELEASE);
+}
+
+static void release_name(void * name)
+{
+    slab_strfree(name);
+}
+
+/* Count the memory held by a name in, or out if add is zero */
+static void account_name(filetable * ft, const char * name, int add)
+{
+    uint64_t sz ;
+
+    if (!name) {
+        return ;
+    }
+    sz = slab_size(strlen(name) + 1) ;
+    if (add) {
+        __atomic_add_fetch(&ft->names, sz, __ATOMIC_RELAXED);
+    } else {
+        __atomic_sub_fetch(&ft->names, sz, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Publish size and allocation of file i after its contents changed and
+ * update counters. mtime is set too if touch is not zero.
+ */
+static void filetable_account(filetable * ft, int i, int touch)
+{
+    int64_t ds, da ;
+    size_t  alloc = memfile_allocated(ft->rec+i) ;
+
+    ds = (int64_t)ft->rec[i].size - (int64_t)ft->size[i] ;
+    da = (int64_t)alloc - (int64_t)ft->alloc[i] ;
+    if (!ds && !da && !touch) {
+        return ;
+    }
+    slot_begin(ft, i);
+    SLOT_SET(ft->size[i], ft->rec[i].size);
+    SLOT_SET(ft->alloc[i], alloc);
+    if (touch) {
+        SLOT_SET(ft->mtime[i], time(NULL));
+    }
+    slot_end(ft, i);
+    if (ds) {
+        __atomic_add_fetch(&ft->bytes, ds, __ATOMIC_RELAXED);
+    }
+    if (da) {
+        __atomic_add_fetch(&ft->allocated, da, __ATOMIC_RELAXED);
+    }
+    return ;
+}
+
+/*
+ * Initialize an empty file table
+ */
+void filetable_init(filetable * ft)
+{
+    int i ;
+
+    if (!ft) {
+        return ;
+    }
+    memset(ft, 0, sizeof(filetable));
+    ft->maxsize = MAXFILESZ ;
+    pthread_rwlock_init(&ft->lock, NULL);
+    for (i=0 ; i<MAXFILES ; i++) {
+        pthread_rwlock_init(ft->flock+i, NULL);
+    }
+    return ;
+}
+
+/*
+ * Release all files
+ */
+void filetable_free(filetable * ft)
+{
+    int i ;
+
+    if (!ft) {
+        return ;
+    }
+    epoch_barrier();
+    for (i=0 ; i<MAXFILES ; i++) {
+        if (ft->ino[i]) {
+            slab_strfree(ft->name[i]);
+            memfile_free(ft->rec+i);
+        }
+        pthread_rwlock_destroy(ft->flock+i);
+    }
+    pthread_rwlock_destroy(&ft->lock);
+    memset(ft, 0, sizeof(filetable));
+    return ;
+}
+
+/*
+ * FNV-1a hash of a file name. 0 is reserved for free slots.
+ */
+uint32_t filetable_hash(const char * name)
+{
+    uint32_t h = 2166136261u ;
+
+    while (*name) {
+        h ^= (uint8_t)*name++ ;
+        h *= 16777619u ;
+    }
+    return h ? h : 1 ;
+}
+
+/*
+ * Find file called 'name'. Only the hash array is scanned, names are
+ * compared on hash match only.
+ * Returns a slot number or -1.
+ */
+int filetable_find(filetable * ft, const char * name)
+{
+    uint32_t    h ;
+    int         i ;
+
+    if (!ft || !name) {
+        return -1 ;
+    }
+    PROBE1(find__entry, name);
+    h = filetable_hash(name);
+    for (i=0 ; i<MAXFILES ; i++) {
+        if (ft->hash[i]==h && !strcmp(ft->name[i], name)) {
+            PROBE2(find__return, name, i);
+            return i ;
+        }
+    }
+    PROBE2(find__return, name, -1);
+    return -1 ;
+}
+
+/*
+ * Return the first slot in use at or after slot i, or -1
+ */
+int filetable_next(filetable * ft, int i)
+{
+    if (i<0) {
+        return -1 ;
+    }
+    for ( ; i<MAXFILES ; i++) {
+        if (ft->hash[i]) {
+            return i ;
+        }
+    }
+    return -1 ;
+}
+
+/*
+ * Create an empty file in the first free slot. A slot is free when it
+ * holds no file at all, named or not. If ino is 0 a new inode number is
+ * allocated. Names, leading slash included, must fit a container
+ * record: MAXNAMESZ bytes with the terminating zero.
+ * Returns a slot number, -ENAMETOOLONG, -ENOSPC if the table is full or
+ * -ENOMEM.
+ */
+int filetable_slot_create(filetable * ft,
+                          const char * name,
+                          mode_t mode,
+                          ino_t ino)
+{
+    int     i ;
+    char *  newname ;
+    time_t  now ;
+
+    if (strlen(name) >= MAXNAMESZ) {
+        return -ENAMETOOLONG ;
+    }
+    for (i=0 ; i<MAXFILES ; i++) {
+        if (ft->ino[i]==0) {
+            break ;
+        }
+    }
+    if (i>=MAXFILES) {
+        return -ENOSPC ;
+    }
+    if ((newname = slab_strdup(name))==NULL) {
+        return -ENOMEM ;
+    }
+    if (ino) {
+        inode_seen(ino);
+    } else {
+        ino = inode_next();
+    }
+    time(&now);
+    memfile_init(ft->rec+i);
+    slot_begin(ft, i);
+    __atomic_store_n(ft->name+i, newname, __ATOMIC_RELEASE);
+    SLOT_SET(ft->size[i], 0);
+    SLOT_SET(ft->alloc[i], 0);
+    SLOT_SET(ft->mtime[i], now);
+    SLOT_SET(ft->ctime[i], now);
+    SLOT_SET(ft->ino[i], ino);
+    SLOT_SET(ft->mode[i], S_IFREG | mode | 0600);
+    SLOT_SET(ft->hash[i], filetable_hash(name));
+    slot_end(ft, i);
+    __atomic_add_fetch(&ft->nfiles, 1, __ATOMIC_RELAXED);
+    account_name(ft, newname, 1);
+    return i ;
+}
+
+/* Release contents and slot of a file that has no name left */
+static void filetable_slot_release(filetable * ft, int i)
+{
+    __atomic_sub_fetch(&ft->nfiles, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ft->bytes, ft->size[i], __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ft->allocated, ft->alloc[i], __ATOMIC_RELAXED);
+    slot_begin(ft, i);
+    SLOT_SET(ft->size[i], 0);
+    SLOT_SET(ft->alloc[i], 0);
+    SLOT_SET(ft->mtime[i], 0);
+    SLOT_SET(ft->ctime[i], 0);
+    SLOT_SET(ft->ino[i], 0);
+    SLOT_SET(ft->mode[i], 0);
+    slot_end(ft, i);
+    memfile_free(ft->rec+i);
+    return ;
+}
+
+/*
+ * Delete the name of a file. The file itself is released with it,
+ * unless it is still pinned by lookups or open handles: then it lives
+ * on without a name until the last filetable_unpin().
+ */
+void filetable_slot_remove(filetable * ft, int i)
+{
+    char *  oldname = ft->name[i] ;
+
+    pthread_rwlock_wrlock(ft->flock+i);
+    slot_begin(ft, i);
+    SLOT_SET(ft->hash[i], 0);
+    SLOT_SET(ft->name[i], NULL);
+    slot_end(ft, i);
+    if (__atomic_load_n(ft->nref+i, __ATOMIC_SEQ_CST)==0) {
+        filetable_slot_release(ft, i);
+    }
+    pthread_rwlock_unlock(ft->flock+i);
+    account_name(ft, oldname, 0);
+    /* Lock-free readers may still be looking at the name */
+    epoch_retire(oldname, release_name);
+    return ;
+}
+
+/*
+ * Fill in a struct stat for a file. All files belong to the user who
+ * mounted the filesystem. st_blocks counts 512-byte units actually held
+ * in memory.
+ * Only reads the dense arrays, so it can run without locks as long as
+ * the caller checks seq[i] afterwards.
+ */
+void filetable_slot_stat(filetable * ft, int i, struct stat * st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode    = SLOT_GET(ft->mode[i]) ;
+    st->st_ino     = SLOT_GET(ft->ino[i]) ;
+    st->st_nlink   = SLOT_GET(ft->hash[i]) ? 1 : 0 ;
+    st->st_uid     = getuid() ;
+    st->st_gid     = getgid() ;
+    st->st_size    = SLOT_GET(ft->size[i]) ;
+    st->st_blksize = BLOCKSZ ;
+    st->st_blocks  = (SLOT_GET(ft->alloc[i]) + 511) / 512 ;
+    st->st_ctime   = SLOT_GET(ft->ctime[i]) ;
+    st->st_mtime   = SLOT_GET(ft->mtime[i]) ;
+    st->st_atime   = st->st_mtime ;
+    return ;
+}
+
+void filetable_limit(filetable * ft, uint64_t budget, off_t maxsize)
+{
+    ft->budget  = budget ;
+    ft->maxsize = maxsize ;
+    return ;
+}
+
+/* -ENOSPC if need more bytes of memory would go over budget */
+static int filetable_budget(filetable * ft, size_t need)
+{
+    if (ft->budget && need && filetable_used(ft) + need > ft->budget) {
+        return -ENOSPC ;
+    }
+    return 0 ;
+}
+
+/*
+ * Check that slot i may hold size bytes at offset, cutting size short
+ * at the largest file size. A size of 0 checks a truncate to offset.
+ * Negative offsets are left for the memfile functions to refuse.
+ * Call with flock[i] held. Returns 0, -EFBIG or -ENOSPC.
+ */
+static int filetable_room(filetable * ft, int i, off_t offset,
+                          size_t * size)
+{
+    if (offset<0) {
+        return 0 ;
+    }
+    if (offset > ft->maxsize || (*size>0 && offset==ft->maxsize)) {
+        return -EFBIG ;
+    }
+    if (*size > (size_t)(ft->maxsize - offset)) {
+        *size = ft->maxsize - offset ;
+    }
+    if (!ft->budget) {
+        return 0 ;
+    }
+    return filetable_budget(ft, memfile_need(ft->rec+i, offset, *size));
+}
+
+ssize_t filetable_slot_write(filetable * ft, int i, const char * buf,
+                             size_t size, off_t offset)
+{
+    ssize_t ret ;
+
+    ret = memfile_pwrite(ft->rec+i, buf, size, offset);
+    filetable_account(ft, i, ret>=0);
+    return ret ;
+}
+
+ssize_t filetable_slot_copy(filetable * ft, int dst, off_t doff,
+                            int src, off_t soff, size_t size)
+{
+    ssize_t ret ;
+
+    ret = memfile_copy(ft->rec+dst, doff, ft->rec+src, soff, size);
+    filetable_account(ft, dst, ret>0);
+    return ret ;
+}
+
+int filetable_slot_truncate(filetable * ft, int i, off_t size)
+{
+    int ret ;
+
+    ret = memfile_truncate(ft->rec+i, size);
+    filetable_account(ft, i, ret>=0);
+    return ret<0 ? ret : 0 ;
+}
+
+/*
+ * Look up a file without taking any lock. Must run between
+ * epoch_enter() and epoch_exit(). Fills st if not NULL.
+ * Returns 0, -ENOENT, or -EAGAIN if a writer got in the way.
+ */
+static int filetable_peek(filetable * ft, const char * name, struct stat * st)
+{
+    uint32_t    h, g, s ;
+    char *      found ;
+    int         i ;
+
+    h = filetable_hash(name);
+    g = __atomic_load_n(&ft->gen, __ATOMIC_ACQUIRE);
+    if (g & 1) {
+        return -EAGAIN ;
+    }
+    for (i=0 ; i<MAXFILES ; i++) {
+        if (SLOT_GET(ft->hash[i])!=h) {
+            continue ;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s = __atomic_load_n(ft->seq+i, __ATOMIC_ACQUIRE);
+        if (s & 1) {
+            return -EAGAIN ;
+        }
+        found = __atomic_load_n(ft->name+i, __ATOMIC_ACQUIRE);
+        if (found==NULL || strcmp(found, name)) {
+            continue ;
+        }
+        if (st) {
+            filetable_slot_stat(ft, i, st);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return SLOT_GET(ft->seq[i])==s ? 0 : -EAGAIN ;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return SLOT_GET(ft->gen)==g ? -ENOENT : -EAGAIN ;
+}
+
+/*
+ * Path-based operations
+ */
+
+void filetable_rdlock(filetable * ft)
+{
+    pthread_rwlock_rdlock(&ft->lock);
+}
+
+void filetable_unlock(filetable * ft)
+{
+    pthread_rwlock_unlock(&ft->lock);
+}
+
+int filetable_getattr(filetable * ft, const char * name, struct stat * st)
+{
+    int i, ret = -EAGAIN ;
+
+    if (epoch_enter()==0) {
+        ret = filetable_peek(ft, name, st);
+        epoch_exit();
+    }
+    if (ret!=-EAGAIN) {
+        return ret ;
+    }
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    pthread_rwlock_rdlock(ft->flock+i);
+    filetable_slot_stat(ft, i, st);
+    pthread_rwlock_unlock(ft->flock+i);
+    pthread_rwlock_unlock(&ft->lock);
+    return 0 ;
+}
+
+int filetable_exists(filetable * ft, const char * name)
+{
+    int i, ret = -EAGAIN ;
+
+    if (epoch_enter()==0) {
+        ret = filetable_peek(ft, name, NULL);
+        epoch_exit();
+    }
+    if (ret!=-EAGAIN) {
+        return ret ;
+    }
+    pthread_rwlock_rdlock(&ft->lock);
+    i = filetable_find(ft, name);
+    pthread_rwlock_unlock(&ft->lock);
+    return i<0 ? -ENOENT : 0 ;
+}
+
+/*
+ * Create an empty file, replacing any file with the same name. The new
+ * file is pinned if st is not NULL, and st filled in.
+ * Returns a slot number or a negated errno.
+ */
+static int filetable_do_create(filetable * ft,
+                               const char * name,
+                               mode_t mode,
+                               struct stat * st)
+{
+    int i ;
+
+    if (ft->budget && filetable_used(ft) >= ft->budget) {
+        return -ENOSPC ;
+    }
+    pthread_rwlock_wrlock(&ft->lock);
+    gen_begin(ft);
+    if ((i = filetable_find(ft, name))>=0) {
+        filetable_slot_remove(ft, i);
+    }
+    i = filetable_slot_create(ft, name, mode, 0);
+    if (i>=0 && st) {
+        __atomic_add_fetch(ft->nref+i, 1, __ATOMIC_SEQ_CST);
+        filetable_slot_stat(ft, i, st);
+    }
+    gen_end(ft);
+    pthread_rwlock_unlock(&ft->lock);
+    return i ;
+}
+
+int filetable_create(filetable * ft, const char * name, mode_t mode)
+{
+    int i ;
+
+    i = filetable_do_create(ft, name, mode, NULL);
+    return i<0 ? i : 0 ;
+}
+
+int filetable_unlink(filetable * ft, const char * name)
+{
+    int i ;
+
+    pthread_rwlock_wrlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    gen_begin(ft);
+    filetable_slot_remove(ft, i);
+    gen_end(ft);
+    pthread_rwlock_unlock(&ft->lock);
+    return 0 ;
+}
+
+/*
+ * Rename a file, replacing the target if it exists. See rename(2)
+ */
+int filetable_rename(filetable * ft, const char * from, const char * to)
+{
+    int     i, j ;
+    char *  oldname ;
+    char *  newname ;
+
+    if (strlen(to) >= MAXNAMESZ) {
+        return -ENAMETOOLONG ;
+    }
+    pthread_rwlock_wrlock(&ft->lock);
+    if ((i = filetable_find(ft, from))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    if ((j = filetable_find(ft, to))==i) {
+        pthread_rwlock_unlock(&ft->lock);
+        return 0 ;
+    }
+    if ((newname = slab_strdup(to))==NULL) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOMEM ;
+    }
+    gen_begin(ft);
+    oldname = ft->name[i] ;
+    pthread_rwlock_wrlock(ft->flock+i);
+    slot_begin(ft, i);
+    __atomic_store_n(ft->name+i, newname, __ATOMIC_RELEASE);
+    SLOT_SET(ft->hash[i], filetable_hash(to));
+    SLOT_SET(ft->mtime[i], time(NULL));
+    slot_end(ft, i);
+    pthread_rwlock_unlock(ft->flock+i);
+    if (j>=0) {
+        filetable_slot_remove(ft, j);
+    }
+    gen_end(ft);
+    pthread_rwlock_unlock(&ft->lock);
+    account_name(ft, newname, 1);
+    account_name(ft, oldname, 0);
+    epoch_retire(oldname, release_name);
+    return 0 ;
+}
+
+int filetable_touch(filetable * ft, const char * name, time_t mtime)
+{
+    int i ;
+
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    pthread_rwlock_wrlock(ft->flock+i);
+    slot_begin(ft, i);
+    SLOT_SET(ft->mtime[i], mtime);
+    slot_end(ft, i);
+    pthread_rwlock_unlock(ft->flock+i);
+    pthread_rwlock_unlock(&ft->lock);
+    return 0 ;
+}
+
+int filetable_read(filetable * ft, const char * name, char * buf,
+                   size_t size, off_t offset)
+{
+    int i, ret ;
+
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    pthread_rwlock_rdlock(ft->flock+i);
+    ret = memfile_pread(ft->rec+i, buf, size, offset);
+    pthread_rwlock_unlock(ft->flock+i);
+    pthread_rwlock_unlock(&ft->lock);
+    return ret ;
+}
+
+/*
+ * Write to a file, creating it if it does not exist. Creating takes the
+ * same room in the budget as filetable_create(), and a file created
+ * here is removed again if the write is refused.
+ */
+int filetable_write(filetable * ft, const char * name, const char * buf,
+                    size_t size, off_t offset)
+{
+    int i, ret ;
+    int created = 0 ;
+
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        /* Creating a file needs the table for ourselves */
+        pthread_rwlock_unlock(&ft->lock);
+        if (ft->budget && filetable_used(ft) >= ft->budget) {
+            return -ENOSPC ;
+        }
+        pthread_rwlock_wrlock(&ft->lock);
+        if ((i = filetable_find(ft, name))<0) {
+            gen_begin(ft);
+            i = filetable_slot_create(ft, name, 0, 0);
+            gen_end(ft);
+            if (i<0) {
+                pthread_rwlock_unlock(&ft->lock);
+                return i ;
+            }
+            created = 1 ;
+        }
+    }
+    pthread_rwlock_wrlock(ft->flock+i);
+    if ((ret = filetable_room(ft, i, offset, &size))==0) {
+        ret = filetable_slot_write(ft, i, buf, size, offset);
+    }
+    pthread_rwlock_unlock(ft->flock+i);
+    if (created && ret<0) {
+        gen_begin(ft);
+        filetable_slot_remove(ft, i);
+        gen_end(ft);
+    }
+    pthread_rwlock_unlock(&ft->lock);
+    return ret ;
+}
+
+int filetable_truncate(filetable * ft, const char * name, off_t size)
+{
+    size_t  none = 0 ;
+    int     i, ret ;
+
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    pthread_rwlock_wrlock(ft->flock+i);
+    if ((ret = filetable_room(ft, i, size, &none))==0) {
+        ret = filetable_slot_truncate(ft, i, size);
+    }
+    pthread_rwlock_unlock(ft->flock+i);
+    pthread_rwlock_unlock(&ft->lock);
+    return ret ;
+}
+
+/*
+ * Inode-addressed operations
+ */
+
+/*
+ * Copy the attributes of slot i without locks, falling back to its lock
+ * if writers keep getting in the way
+ */
+static void filetable_read_stat(filetable * ft, int i, struct stat * st)
+{
+    uint32_t    s ;
+    int         tries ;
+
+    for (tries=0 ; tries<4 ; tries++) {
+        s = __atomic_load_n(ft->seq+i, __ATOMIC_ACQUIRE);
+        if (s & 1) {
+            continue ;
+        }
+        filetable_slot_stat(ft, i, st);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (SLOT_GET(ft->seq[i])==s) {
+            return ;
+        }
+    }
+    pthread_rwlock_rdlock(ft->flock+i);
+    filetable_slot_stat(ft, i, st);
+    pthread_rwlock_unlock(ft->flock+i);
+    return ;
+}
+
+/*
+ * Find a file by name and pin it for the kernel.
+ * Returns its slot number or -ENOENT.
+ */
+int filetable_lookup(filetable * ft, const char * name, struct stat * st)
+{
+    int i ;
+
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))<0) {
+        pthread_rwlock_unlock(&ft->lock);
+        return -ENOENT ;
+    }
+    __atomic_add_fetch(ft->nref+i, 1, __ATOMIC_SEQ_CST);
+    filetable_read_stat(ft, i, st);
+    pthread_rwlock_unlock(&ft->lock);
+    return i ;
+}
+
+/*
+ * Find a file by name and pin it for an open file handle.
+ * Returns its slot number or -ENOENT.
+ */
+int filetable_open(filetable * ft, const char * name)
+{
+    int i ;
+
+    pthread_rwlock_rdlock(&ft->lock);
+    if ((i = filetable_find(ft, name))>=0) {
+        __atomic_add_fetch(ft->nref+i, 1, __ATOMIC_SEQ_CST);
+    } else {
+        i = -ENOENT ;
+    }
+    pthread_rwlock_unlock(&ft->lock);
+    return i ;
+}
+
+/*
+ * Create a file like filetable_create() and pin it.
+ * Returns its slot number or a negated errno.
+ */
+int filetable_icreate(filetable * ft,
+                      const char * name,
+                      mode_t mode,
+                      struct stat * st)
+{
+    return filetable_do_create(ft, name, mode, st);
+}
+
+/*
+ * Drop n references on slot i. A file deleted while pinned is released
+ * with its last reference.
+ */
+void filetable_unpin(filetable * ft, int i, uint64_t n)
+{
+    if (__atomic_sub_fetch(ft->nref+i, n, __ATOMIC_SEQ_CST)>0) {
+        return ;
+    }
+    pthread_rwlock_wrlock(&ft->lock);
+    if (ft->nref[i]==0 && ft->hash[i]==0 && ft->ino[i]) {
+        filetable_slot_release(ft, i);
+    }
+    pthread_rwlock_unlock(&ft->lock);
+    return ;
+}
+
+void filetable_igetattr(filetable * ft, int i, struct stat * st)
+{
+    filetable_read_stat(ft, i, st);
+}
+
+int filetable_iread(filetable * ft, int i, char * buf,
+                    size_t size, off_t offset)
+{
+    int ret ;
+
+    pthread_rwlock_rdlock(ft->flock+i);
+    ret = memfile_pread(ft->rec+i, buf, size, offset);
+    pthread_rwlock_unlock(ft->flock+i);
+    return ret ;
+}
+
+int filetable_iwrite(filetable * ft, int i, const char * buf,
+                     size_t size, off_t offset)
+{
+    int ret ;
+
+    pthread_rwlock_wrlock(ft->flock+i);
+    if ((ret = filetable_room(ft, i, offset, &size))==0) {
+        ret = filetable_slot_write(ft, i, buf, size, offset);
+    }
+    pthread_rwlock_unlock(ft->flock+i);
+    return ret ;
+}
+
+int filetable_itruncate(filetable * ft, int i, off_t size)
+{
+    size_t  none = 0 ;
+    int     ret ;
+
+    pthread_rwlock_wrlock(ft->flock+i);
+    if ((ret = filetable_room(ft, i, size, &none))==0) {
+        ret = filetable_slot_truncate(ft, i, size);
+    }
+    pthread_rwlock_unlock(ft->flock+i);
+    return ret ;
+}
+
+/*
+ * Zero-copy reads: map size bytes from offset of slot i to memory
+ * segments, see memfile_map_read(). The contents stay locked for
+ * reading until filetable_iread_unmap().
+ * Returns the number of segments.
+ */
+int filetable_iread_map(filetable * ft, int i, struct iovec * iov,
+                        size_t size, off_t offset)
+{
+    int n ;
+
+    pthread_rwlock_rdlock(ft->flock+i);
+    if ((n = memfile_map_read(ft->rec+i, iov, size, offset))<0) {
+        pthread_rwlock_unlock(ft->flock+i);
+    }
+    return n ;
+}
+
+void filetable_iread_unmap(filetable * ft, int i)
+{
+    pthread_rwlock_unlock(ft->flock+i);
+    return ;
+}
+
+/*
+ * Zero-copy writes: make room for size bytes at offset of slot i and map
+ * them to memory segments, see memfile_map_write(). The contents stay
+ * locked for writing until filetable_iwrite_unmap() is told how many
+ * bytes were written. Segments may cover less than size at the largest
+ * file size.
+ * Returns the number of segments or a negated errno, nothing is locked
+ * then.
+ */
+int filetable_iwrite_map(filetable * ft, int i, struct iovec * iov,
+                         size_t size, off_t offset)
+{
+    int n ;
+
+    pthread_rwlock_wrlock(ft->flock+i);
+    if ((n = filetable_room(ft, i, offset, &size))<0 ||
+        (n = memfile_map_write(ft->rec+i, iov, size, offset))<0) {
+        filetable_account(ft, i, 0);
+        pthread_rwlock_unlock(ft->flock+i);
+    }
+    return n ;
+}
+
+void filetable_iwrite_unmap(filetable * ft, int i, off_t offset,
+                            size_t written)
+{
+    if (written>0) {
+        memfile_map_done(ft->rec+i, offset + written);
+    }
+    filetable_account(ft, i, written>0);
+    pthread_rwlock_unlock(ft->flock+i);
+    return ;
+}
+
+/*
+ * fallocate(2) on slot i, see memfile_fallocate(). mtime changes when
+ * contents are zeroed or the size grows, as with other filesystems.
+ * Returns 0 or a negated errno.
+ */
+int filetable_ifallocate(filetable * ft, int i, int mode,
+                         off_t offset, off_t len)
+{
+    off_t   size ;
+    int     ret ;
+
+    pthread_rwlock_wrlock(ft->flock+i);
+    size = ft->rec[i].size ;
+    ret  = 0 ;
+    if (!(mode & FALLOC_FL_PUNCH_HOLE) && offset>=0 && len>0) {
+        ret = offset + len > ft->maxsize ? -EFBIG :
+              filetable_budget(ft, memfile_need(ft->rec+i, offset, len));
+    }
+    if (ret<0) {
+        pthread_rwlock_unlock(ft->flock+i);
+        return ret ;
+    }
+    ret  = memfile_fallocate(ft->rec+i, mode, offset, len);
+    filetable_account(ft, i, ret==0 &&
+                             ((mode & ~FALLOC_FL_KEEP_SIZE) ||
+                              ft->rec[i].size!=size));
+    pthread_rwlock_unlock(ft->flock+i);
+    return ret ;
+}
+
+/*
+ * lseek(2) on slot i, see memfile_lseek().
+ * Returns the new offset or a negated errno.
+ */
+off_t filetable_ilseek(filetable * ft, int i, off_t offset, int whence)
+{
+    off_t pos ;
+
+    pthread_rwlock_rdlock(ft->flock+i);
+    pos = memfile_lseek(ft->rec+i, offset, whence);
+    pthread_rwlock_unlock(ft->flock+i);
+    return pos ;
+}
+
+/*
+ * copy_file_range(2): copy size bytes from offset off_in of slot in to
+ * offset off_out of slot out. Whole pages are shared copy-on-write when
+ * both offsets agree within a page, see memfile_copy(). Both files are
+ * locked, the lower slot first.
+ * Returns the number of bytes copied or a negated errno.
+ */
+ssize_t filetable_icopy(filetable * ft, int in, off_t off_in,
+                        int out, off_t off_out, size_t size)
+{
+    ssize_t ret ;
+
+    if (in==out) {
+        if (off_in < off_out + (off_t)size &&
+            off_out < off_in + (off_t)size) {
+            return -EINVAL ;
+        }
+        pthread_rwlock_wrlock(ft->flock+out);
+    } else if (in < out) {
+        pthread_rwlock_rdlock(ft->flock+in);
+        pthread_rwlock_wrlock(ft->flock+out);
+    } else {
+        pthread_rwlock_wrlock(ft->flock+out);
+        pthread_rwlock_rdlock(ft->flock+in);
+    }
+    /* Only what the source holds is copied */
+    if (off_in<0 || off_in >= ft->rec[in].size) {
+        size = 0 ;
+    } else if (size > (size_t)(ft->rec[in].size - off_in)) {
+        size = ft->rec[in].size - off_in ;
+    }
+    ret = size>0 ? filetable_room(ft, out, off_out, &size) : 0 ;
+    if (ret==0) {
+        ret = filetable_slot_copy(ft, out, off_out, in, off_in, size);
+    }
+    pthread_rwlock_unlock(ft->flock+out);
+    if (in!=out) {
+        pthread_rwlock_unlock(ft->flock+in);
+    }
+    return ret ;
+}
+
+/*
+ * Memory held for contents. Pages shared between files are counted in
+ * the allocation of each file, but only once here.
+ */
+uint64_t filetable_allocated(filetable * ft)
+{
+    uint64_t    allocated ;
+    uint64_t    shared ;
+
+    allocated = __atomic_load_n(&ft->allocated, __ATOMIC_RELAXED);
+    shared    = extmap_shared();
+    return allocated > shared ? allocated - shared : 0 ;
+}
+
+uint64_t filetable_used(filetable * ft)
+{
+    return filetable_allocated(ft) +
+           __atomic_load_n(&ft->names, __ATOMIC_RELAXED) +
+           extmap_table_bytes() ;
+}
+
+/*
+ * Page and slab counters are global: they cover all tables, there is
+ * only ever one in a mount. Names and bodies share the slab arena.
+ * Inline files are the only thing not counted as they change: a scan
+ * of the records finds them, without locks, so a file moving between
+ * tiers meanwhile may be missed.
+ */
+void filetable_memory(filetable * ft, stats_memory * m)
+{
+    size_t  npages, ntables ;
+    size_t  slot = (sizeof(filetable) - offsetof(filetable, seq)) /
+                   MAXFILES ;
+    int     i ;
+
+    memset(m, 0, sizeof(stats_memory));
+    for (i=0 ; i<MAXFILES ; i++) {
+        if (__atomic_load_n(ft->ino+i, __ATOMIC_RELAXED) &&
+            __atomic_load_n(&ft->rec[i].store, __ATOMIC_RELAXED)==
+            MF_INLINE) {
+            m->inlined += __atomic_load_n(ft->size+i, __ATOMIC_RELAXED);
+        }
+    }
+    m->files     = __atomic_load_n(&ft->nfiles, __ATOMIC_RELAXED);
+    m->size      = __atomic_load_n(&ft->bytes, __ATOMIC_RELAXED);
+    m->names     = __atomic_load_n(&ft->names, __ATOMIC_RELAXED);
+    m->pages     = extmap_held(&npages, &ntables);
+    m->shared    = extmap_shared();
+    m->tables    = extmap_table_bytes();
+    m->slab_held = slab_held();
+    m->slab_used = slab_used();
+    m->bodies    = m->slab_used > m->names ? m->slab_used - m->names : 0 ;
+    m->records   = m->files * slot ;
+    m->table     = sizeof(filetable) ;
+    m->nobjects  = slab_objects();
+    m->nchunks   = slab_chunks();
+    m->npages    = npages ;
+    m->ntables   = ntables ;
+    return ;
+}
+
+void filetable_itouch(filetable * ft, int i, time_t mtime)
+{
+    pthread_rwlock_wrlock(ft->flock+i);
+    slot_begin(ft, i);
+    SLOT_SET(ft->mtime[i], mtime);
+    slot_end(ft, i);
+    pthread_rwlock_unlock(ft->flock+i);
+    return ;
+}
+
+/* vim: set ts=4 et sw=4 tw=75 */
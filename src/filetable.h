@@ -0,0 +1,157 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fslimits.h"
+#include "memfile.h"
+#include "stats.h"
+
+/*
+ * Table of all files in the root directory.
+ * Fields read by full-table scans (lookup, readdir, statfs) and by
+ * getattr are kept in dense arrays, one per field, so that a scan only
+ * pulls the bytes it looks at. The memfile records only hold contents.
+ * A slot without a name has a hash of 0.
+ * The size array mirrors rec[i].size, alloc mirrors what the contents
+ * of rec[i] hold in memory.
+ * Filesystem-wide counters are updated atomically on every change so
+ * that statfs never has to scan the table.
+ * Writes, truncates, preallocation and copies that would take a file
+ * past maxsize fail with -EFBIG, or are cut short for writes. Those that
+ * would take the memory used past the budget fail with -ENOSPC, and so
+ * does creating a file once the budget is used up. The check is made
+ * before allocating, so concurrent requests may each pass it and go
+ * over by what they allocate. Loading a container is not limited.
+ *
+ * Locking:
+ * - lock protects the table layout. It is taken shared to look up a
+ *   file and work on it, exclusive to create, delete or rename files.
+ * - flock[i] protects contents, size and mtime of file i. It is taken
+ *   shared to read, exclusive to modify, always after lock.
+ * - Layout changes to a slot that may be pinned (see below) take
+ *   flock[i] too.
+ * The path-based functions take all locks they need. The slot-based
+ *   functions (filetable_find, filetable_next, filetable_slot_*) expect
+ *   the caller to hold the right locks, or to be the only thread around.
+ *
+ * Inode-addressed functions (filetable_i*) serve the low-level FUSE API.
+ * The kernel holds lookups on every file it addresses by inode, counted
+ * in nref[i]. A pinned slot cannot be reused: a file deleted while
+ * pinned loses its name but keeps its contents until the last
+ * filetable_unpin(). Slots are free when ino[i] is 0. Inode-addressed
+ * functions only take flock[i].
+ *
+ * Lookups and getattr take no lock at all. Writers, on top of the locks
+ * above, make their changes visible through two sequence counters that
+ * are odd while a change is in progress:
+ * - gen is bumped around every layout change, a lookup that found
+ *   nothing checks it to make sure it did not miss a file on the move.
+ * - seq[i] is bumped around every change to the metadata of slot i, a
+ *   lookup checks it to make sure it copied a consistent set of fields.
+ * Readers that see a change in progress fall back to locking. Names
+ * replaced or removed are released through epoch_retire(), so a reader
+ * may always compare the name it found in a slot.
+ */
+typedef struct __filetable__ {
+    pthread_rwlock_t lock ;
+    uint64_t    nfiles ;        /* Number of files */
+    uint64_t    bytes ;         /* Sum of file sizes */
+    uint64_t    allocated ;     /* Memory held for contents */
+    uint64_t    names ;         /* Memory held for names */
+    uint64_t    budget ;        /* Memory allowed for files, 0: no limit */
+    off_t       maxsize ;       /* Largest file size allowed */
+    uint32_t    gen ;
+    uint32_t    seq[MAXFILES] ;
+    uint32_t    hash[MAXFILES] ;
+    char *      name[MAXFILES] ;
+    off_t       size[MAXFILES] ;
+    size_t      alloc[MAXFILES] ;
+    time_t      mtime[MAXFILES] ;
+    time_t      ctime[MAXFILES] ;
+    ino_t       ino[MAXFILES] ;
+    mode_t      mode[MAXFILES] ;
+    uint64_t    nref[MAXFILES] ;
+    pthread_rwlock_t flock[MAXFILES] ;
+    memfile     rec[MAXFILES] ;
+} filetable ;
+
+void filetable_init(filetable * ft);
+void filetable_free(filetable * ft);
+
+uint32_t filetable_hash(const char * name);
+
+/* Path-based operations, thread-safe. Return 0 or a negated errno. */
+int  filetable_getattr(filetable * ft, const char * name, struct stat * st);
+int  filetable_exists(filetable * ft, const char * name);
+int  filetable_create(filetable * ft, const char * name, mode_t mode);
+int  filetable_unlink(filetable * ft, const char * name);
+int  filetable_rename(filetable * ft, const char * from, const char * to);
+int  filetable_touch(filetable * ft, const char * name, time_t mtime);
+int  filetable_read(filetable * ft, const char * name, char * buf,
+                    size_t size, off_t offset);
+int  filetable_write(filetable * ft, const char * name, const char * buf,
+                     size_t size, off_t offset);
+int  filetable_truncate(filetable * ft, const char * name, off_t size);
+
+/* Inode-addressed operations, thread-safe. See locking rules above. */
+int  filetable_lookup(filetable * ft, const char * name, struct stat * st);
+int  filetable_open(filetable * ft, const char * name);
+int  filetable_icreate(filetable * ft, const char * name, mode_t mode,
+                       struct stat * st);
+void filetable_unpin(filetable * ft, int i, uint64_t n);
+void filetable_igetattr(filetable * ft, int i, struct stat * st);
+int  filetable_iread(filetable * ft, int i, char * buf,
+                     size_t size, off_t offset);
+int  filetable_iwrite(filetable * ft, int i, const char * buf,
+                      size_t size, off_t offset);
+int  filetable_itruncate(filetable * ft, int i, off_t size);
+off_t filetable_ilseek(filetable * ft, int i, off_t offset, int whence);
+int  filetable_ifallocate(filetable * ft, int i, int mode,
+                          off_t offset, off_t len);
+int  filetable_iread_map(filetable * ft, int i, struct iovec * iov,
+                         size_t size, off_t offset);
+void filetable_iread_unmap(filetable * ft, int i);
+int  filetable_iwrite_map(filetable * ft, int i, struct iovec * iov,
+                          size_t size, off_t offset);
+void filetable_iwrite_unmap(filetable * ft, int i, off_t offset,
+                            size_t written);
+ssize_t filetable_icopy(filetable * ft, int in, off_t off_in,
+                        int out, off_t off_out, size_t size);
+void filetable_itouch(filetable * ft, int i, time_t mtime);
+
+/* Memory held for contents, shared pages counted once */
+uint64_t filetable_allocated(filetable * ft);
+
+/* Memory charged to the budget: contents, names and page tables */
+uint64_t filetable_used(filetable * ft);
+
+/* Set the memory budget, 0 for none, and the largest file size */
+void filetable_limit(filetable * ft, uint64_t budget, off_t maxsize);
+
+/* Memory held for the whole table, see stats_memory */
+void filetable_memory(filetable * ft, stats_memory * m);
+
+/* Take or release the table lock for a scan, e.g. readdir */
+void filetable_rdlock(filetable * ft);
+void filetable_unlock(filetable * ft);
+
+/* Slot-based operations, see locking rules above */
+int  filetable_find(filetable * ft, const char * name);
+int  filetable_next(filetable * ft, int i);
+int  filetable_slot_create(filetable * ft, const char * name, mode_t mode,
+                           ino_t ino);
+void filetable_slot_remove(filetable * ft, int i);
+void filetable_slot_stat(filetable * ft, int i, struct stat * st);
+ssize_t filetable_slot_write(filetable * ft, int i, const char * buf,
+                             size_t size, off_t offset);
+int  filetable_slot_truncate(filetable * ft, int i, off_t size);
+ssize_t filetable_slot_copy(filetable * ft, int dst, off_t doff,
+                            int src, off_t soff, size_t size);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -5,6 +5,12 @@
 #define MAXFILES    1024
 #define MAXFILESZ   (100*1024*1024)
 #define MAXNAMESZ   128
+/* Allocation unit for file contents, see extent.h */
+#define EXTENTSZ    BLOCKSZ
+/* Files up to this size are stored inside their record */
+#define INLINESZ    112
+/* Files up to this size live in a slab object instead of pages */
+#define SMALLFILESZ 2048
 
 #define NONCE_SZ    8
 #define KEY_SZ      32
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "sha2.h"
+#include "probes.h"
 
 #define SHA2_BYTESZ     32
 #define SHA2_BLOCKSZ    64
@@ -74,8 +75,11 @@ int derive_key(
     int       count ;
     size_t    r ;
 
-    if (!password || plen<1 || !salt || slen<1 || !key || klen<1 || iter<1)
+    PROBE1(derive__entry, iter);
+    if (!password || plen<1 || !salt || slen<1 || !key || klen<1 || iter<1) {
+        PROBE1(derive__return, -1);
         return -1 ;
+    }
 
     asalt = malloc(slen+4);
     memcpy(asalt, salt, slen);
@@ -106,6 +110,7 @@ int derive_key(
     memset(d1, 0, SHA2_BYTESZ);
     memset(d2, 0, SHA2_BYTESZ);
     memset(obuf, 0, SHA2_BYTESZ);
+    PROBE1(derive__return, 0);
     return 0 ;
 
 }
@@ -1,8 +1,19 @@
-/* Return a valid inode for a new file */
+static int inode_seq=2 ;
+
+/* Return a valid inode for a new file. Thread-safe. */
 int inode_next(void)
 {
-    static int inode_seq=2 ;
-    inode_seq++ ;
-    return inode_seq ;
+    return __atomic_add_fetch(&inode_seq, 1, __ATOMIC_RELAXED);
+}
+
+/* Make sure inode_next() never hands out an inode already in use */
+void inode_seen(int ino)
+{
+    int cur = __atomic_load_n(&inode_seq, __ATOMIC_RELAXED);
+
+    while (cur<ino &&
+           !__atomic_compare_exchange_n(&inode_seq, &cur, ino, 0,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) ;
 }
 
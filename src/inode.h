@@ -1,4 +1,5 @@
 #ifndef _INODE_H_
 #define _INODE_H_
 int inode_next(void);
+void inode_seen(int ino);
 #endif
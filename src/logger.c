@@ -6,6 +6,13 @@
 
    Logging routines: allow to simultaneously output messages to console
    and to logfile.
+
+   Messages are not formatted by the caller. logger() stores the format
+   string, a timestamp and the raw arguments in a fixed-size record of a
+   lock-free ring buffer, and a background thread formats records and
+   writes them out in batches to file descriptors kept open. Any number
+   of threads may log at once. When the ring is full, messages are
+   dropped and counted rather than making the caller wait.
 */
 /*--------------------------------------------------------------------------*/
 
@@ -15,9 +22,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "logger.h"
 
 /*---------------------------------------------------------------------------
                             Constants & Defines
@@ -26,30 +40,408 @@
 #define LOGFILENAME_SZ  1024
 /** Maximum size of a single log message */
 #define LOGSZ   1024
+/** Size of a record in the ring buffer */
+#define LOG_RECSZ   256
+/** Number of records in the ring buffer, a power of two */
+#define LOG_NREC    4096
+/** Bytes available for arguments in a record */
+#define LOG_ARGSZ   (LOG_RECSZ - 2 * sizeof(uint64_t) - sizeof(char*))
+/** Bytes formatted before they are written out */
+#define LOG_OUTSZ   (64 * 1024)
+/** Longest wait for new records, in milliseconds */
+#define LOG_MAXWAIT 32
 
 /** Default log file name */
 char logger_filename[LOGFILENAME_SZ] = {"/tmp/mefs.log"} ;
 
+/** Current level of each subsystem */
+volatile int logger_level[LOG_NSUBSYS] = {
+    LVL_INFO, LVL_INFO, LVL_INFO, LVL_INFO
+} ;
+
 /*---------------------------------------------------------------------------
 							Private to this module
  ---------------------------------------------------------------------------*/
 
+/* Names for logger_configure(), indexed by subsystem and level */
+static const char * log_subsys[LOG_NSUBSYS] = {
+    "fuse", "container", "crypto", "cache"
+} ;
+static const char * log_levels[] = {
+    "error", "warn", "info", "debug", "trace"
+} ;
+#define LOG_NLEVELS (int)(sizeof(log_levels) / sizeof(log_levels[0]))
+
+/* Levels set by logger_configure(), restored on SIGUSR2 */
+static int log_configured[LOG_NSUBSYS] = {
+    LVL_INFO, LVL_INFO, LVL_INFO, LVL_INFO
+} ;
+
+/*
+ * A record is free for the producer at position pos when its sequence
+ * number is pos, and ready for the consumer when it is pos+1. The
+ * consumer hands it back for the next round with pos+LOG_NREC.
+ * A NULL format means args holds the message already formatted.
+ */
+typedef struct {
+    uint64_t        seq ;
+    const char *    fmt ;
+    uint64_t        ns ;        /* CLOCK_REALTIME */
+    char            args[LOG_ARGSZ] ;
+} __attribute__((aligned(64))) log_record ;
+
+static log_record   log_ring[LOG_NREC] ;
+static uint64_t     log_head __attribute__((aligned(64))) ;
+static uint64_t     log_tail __attribute__((aligned(64))) ;
+static uint64_t     log_drops ;
+
+/* Consumer thread state */
+#define LOG_IDLE     0
+#define LOG_RUNNING  1
+#define LOG_STOPPED  2
+static int              log_state ;
+static int              log_ready ;
+static int              log_reopen ;
+static int              log_fd = -1 ;
+static pthread_t        log_thread ;
+static pthread_mutex_t  log_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+/* Argument types, from the length modifier and conversion */
+#define ARG_NONE    0   /* %% */
+#define ARG_INT     1
+#define ARG_LONG    2
+#define ARG_LLONG   3
+#define ARG_SIZE    4
+#define ARG_DOUBLE  5
+#define ARG_PTR     6
+#define ARG_STR     7
+#define ARG_BAD     8   /* Not supported, formatted by the caller */
+
+/*
+ * Parse the conversion at p, which points to a '%'. Sets *type and
+ * returns a pointer past the conversion.
+ */
+static const char * log_conv(const char * p, int * type)
+{
+    int len = 0 ;
+
+    p++ ;
+    if (*p=='%') {
+        *type = ARG_NONE ;
+        return p+1 ;
+    }
+    while (*p && strchr("-+ #0'", *p)) p++ ;
+    while (*p>='0' && *p<='9') p++ ;
+    if (*p=='.') {
+        p++ ;
+        while (*p>='0' && *p<='9') p++ ;
+    }
+    if (*p=='h') {
+        p += p[1]=='h' ? 2 : 1 ;
+    } else if (*p=='l') {
+        len = p[1]=='l' ? ARG_LLONG : ARG_LONG ;
+        p += p[1]=='l' ? 2 : 1 ;
+    } else if (*p=='z') {
+        len = ARG_SIZE ;
+        p++ ;
+    }
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'o':
+        case 'x': case 'X': case 'c':
+        *type = len ? len : ARG_INT ;
+        break ;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+        *type = ARG_DOUBLE ;
+        break ;
+        case 'p':
+        *type = len ? ARG_BAD : ARG_PTR ;
+        break ;
+        case 's':
+        *type = len ? ARG_BAD : ARG_STR ;
+        break ;
+        default:
+        *type = ARG_BAD ;
+        return *p ? p+1 : p ;
+    }
+    return p+1 ;
+}
+
+/*
+ * Copy the arguments of fmt to rec, numbers on 8 bytes and strings with
+ * their terminating zero, truncated to what fits.
+ * Returns 0, or -1 if fmt has a conversion that is not supported.
+ */
+static int log_pack(log_record * rec, const char * fmt, va_list ap)
+{
+    char *      out = rec->args ;
+    char *      end = rec->args + LOG_ARGSZ ;
+    const char * s ;
+    int64_t     v ;
+    double      d ;
+    size_t      n ;
+    int         type ;
+
+    while ((fmt = strchr(fmt, '%'))!=NULL) {
+        fmt = log_conv(fmt, &type);
+        if (type==ARG_NONE) {
+            continue ;
+        }
+        if (type==ARG_BAD || (type!=ARG_STR && end-out < 8)) {
+            return -1 ;
+        }
+        switch (type) {
+            case ARG_INT:   v = va_arg(ap, int) ; break ;
+            case ARG_LONG:  v = va_arg(ap, long) ; break ;
+            case ARG_LLONG: v = va_arg(ap, long long) ; break ;
+            case ARG_SIZE:  v = va_arg(ap, size_t) ; break ;
+            case ARG_PTR:   v = (intptr_t)va_arg(ap, void*) ; break ;
+            case ARG_DOUBLE:
+            d = va_arg(ap, double) ;
+            memcpy(out, &d, 8);
+            out += 8 ;
+            continue ;
+            default:
+            if ((s = va_arg(ap, const char*))==NULL) {
+                s = "(null)" ;
+            }
+            if (end-out < 1) {
+                return -1 ;
+            }
+            n = strnlen(s, end-out-1) ;
+            memcpy(out, s, n);
+            out[n] = 0 ;
+            out += n+1 ;
+            continue ;
+        }
+        memcpy(out, &v, 8);
+        out += 8 ;
+    }
+    return 0 ;
+}
+
+/* Format a packed record, see log_pack(). Returns the length. */
+static size_t log_unpack(log_record * rec, char * out, size_t size)
+{
+    const char *    fmt = rec->fmt ;
+    const char *    p ;
+    const char *    arg = rec->args ;
+    char            spec[32] ;
+    size_t          n = 0 ;
+    int64_t         v ;
+    double          d ;
+    int             type, k ;
+
+    if (fmt==NULL) {
+        return snprintf(out, size, "%s", rec->args) ;
+    }
+    while (*fmt && n < size-1) {
+        if (*fmt!='%') {
+            out[n++] = *fmt++ ;
+            continue ;
+        }
+        p = log_conv(fmt, &type);
+        if (type==ARG_NONE) {
+            out[n++] = '%' ;
+            fmt = p ;
+            continue ;
+        }
+        snprintf(spec, sizeof(spec), "%.*s", (int)(p-fmt), fmt);
+        fmt = p ;
+        if (type==ARG_STR) {
+            k = snprintf(out+n, size-n, spec, arg);
+            arg += strlen(arg)+1 ;
+        } else if (type==ARG_DOUBLE) {
+            memcpy(&d, arg, 8);
+            arg += 8 ;
+            k = snprintf(out+n, size-n, spec, d);
+        } else {
+            memcpy(&v, arg, 8);
+            arg += 8 ;
+            switch (type) {
+                case ARG_LONG:  k = snprintf(out+n, size-n, spec, (long)v) ; break ;
+                case ARG_LLONG: k = snprintf(out+n, size-n, spec, (long long)v) ; break ;
+                case ARG_SIZE:  k = snprintf(out+n, size-n, spec, (size_t)v) ; break ;
+                case ARG_PTR:   k = snprintf(out+n, size-n, spec, (void*)(intptr_t)v) ; break ;
+                default:        k = snprintf(out+n, size-n, spec, (int)v) ; break ;
+            }
+        }
+        n += k < (int)(size-n) ? (size_t)k : size-n-1 ;
+    }
+    out[n] = 0 ;
+    return n ;
+}
+
+/* Date and time at ns, cached for the current second */
 #define DATETIME_SZ 64
-static char * datetime_now(void)
-{
-    static char datetime[DATETIME_SZ] ;
-    time_t      t ;
-    struct tm * tmp ;
-
-    t = time(NULL);
-    tmp = localtime(&t);
-    strftime(datetime,
-             DATETIME_SZ,
-             "%Y-%m-%d %T",
-             tmp);
+static const char * datetime_at(uint64_t ns)
+{
+    static char     datetime[DATETIME_SZ] ;
+    static time_t   last = -1 ;
+    time_t          t = ns / 1000000000 ;
+    struct tm       tmv ;
+
+    if (t!=last) {
+        localtime_r(&t, &tmv);
+        strftime(datetime,
+                 DATETIME_SZ,
+                 "%Y-%m-%d %T",
+                 &tmv);
+        last = t ;
+    }
     return datetime ;
 }
 
+static uint64_t now_ns(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec ;
+}
+
+/* Write a batch of formatted lines to the console and the log file */
+static void log_output(const char * buf, size_t n)
+{
+    if (__atomic_exchange_n(&log_reopen, 0, __ATOMIC_ACQUIRE) ||
+        log_fd<0) {
+        if (log_fd>=0) {
+            close(log_fd);
+        }
+        log_fd = open(logger_filename,
+                      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      0644);
+    }
+    if (write(2, buf, n)<0) {
+        /* Nowhere to report it */
+    }
+    if (log_fd>=0 && write(log_fd, buf, n)<0) {
+        /* Same */
+    }
+    return ;
+}
+
+/*
+ * Format ready records into out, at most LOG_OUTSZ bytes.
+ * Returns the number of bytes formatted.
+ */
+static size_t log_drain(char * out)
+{
+    static uint64_t reported ;
+    log_record *    rec ;
+    uint64_t        drops ;
+    size_t          n = 0 ;
+
+    while (n < LOG_OUTSZ - LOGSZ - DATETIME_SZ) {
+        rec = log_ring + (log_tail & (LOG_NREC-1)) ;
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE)!=log_tail+1) {
+            break ;
+        }
+        n += sprintf(out+n, "%s ", datetime_at(rec->ns));
+        n += log_unpack(rec, out+n, LOGSZ);
+        out[n++] = '\n' ;
+        __atomic_store_n(&rec->seq, log_tail + LOG_NREC, __ATOMIC_RELEASE);
+        log_tail++ ;
+    }
+    drops = __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+    if (drops!=reported && n < LOG_OUTSZ - LOGSZ) {
+        n += sprintf(out+n, "%s logger: %llu messages dropped\n",
+                     datetime_at(now_ns()),
+                     (unsigned long long)(drops - reported));
+        reported = drops ;
+    }
+    return n ;
+}
+
+/* Background thread: format and write records until stopped */
+static void * log_main(void * arg)
+{
+    static char     out[LOG_OUTSZ] ;
+    struct timespec ts ;
+    size_t          n ;
+    int             wait = 1 ;
+
+    for (;;) {
+        if ((n = log_drain(out))>0) {
+            log_output(out, n);
+            wait = 1 ;
+            continue ;
+        }
+        if (__atomic_load_n(&log_state, __ATOMIC_ACQUIRE)==LOG_STOPPED) {
+            break ;
+        }
+        /* Nothing to do: back off, producers never wake us up */
+        ts.tv_sec  = 0 ;
+        ts.tv_nsec = wait * 1000000L ;
+        nanosleep(&ts, NULL);
+        if (wait < LOG_MAXWAIT) {
+            wait *= 2 ;
+        }
+    }
+    return NULL ;
+}
+
+/* After fork() only the calling thread survives: start a new consumer */
+static void log_atfork_child(void)
+{
+    pthread_mutex_init(&log_lock, NULL);
+    if (log_state==LOG_RUNNING) {
+        log_state = LOG_IDLE ;
+    }
+    return ;
+}
+
+/*
+ * Start the background thread if it is not running.
+ * Returns 0 if records may be pushed, -1 if messages must be written
+ * synchronously.
+ */
+static int log_start(void)
+{
+    int i ;
+
+    pthread_mutex_lock(&log_lock);
+    if (!log_ready) {
+        for (i=0 ; i<LOG_NREC ; i++) {
+            log_ring[i].seq = i ;
+        }
+        pthread_atfork(NULL, NULL, log_atfork_child);
+        atexit(logger_stop);
+        log_ready = 1 ;
+    }
+    if (log_state==LOG_IDLE) {
+        if (pthread_create(&log_thread, NULL, log_main, NULL)==0) {
+            __atomic_store_n(&log_state, LOG_RUNNING, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return log_state==LOG_RUNNING ? 0 : -1 ;
+}
+
+/* Claim a free record, NULL if the ring is full */
+static log_record * log_claim(uint64_t * pos)
+{
+    log_record *    rec ;
+    uint64_t        seq ;
+
+    *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = log_ring + (*pos & (LOG_NREC-1)) ;
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq==*pos) {
+            if (__atomic_compare_exchange_n(&log_head, pos, *pos+1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                return rec ;
+            }
+        } else if ((int64_t)(seq - *pos) < 0) {
+            return NULL ;
+        } else {
+            *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
 
 /*---------------------------------------------------------------------------
   							Function codes
@@ -68,7 +460,10 @@ void logger_setname(char * filename)
 {
     /* Set new log file name if non-NULL */
     if (filename && filename[0]) {
-        strcpy(logger_filename, filename) ;
+        pthread_mutex_lock(&log_lock);
+        snprintf(logger_filename, LOGFILENAME_SZ, "%s", filename);
+        __atomic_store_n(&log_reopen, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&log_lock);
     }
     return ;
 }
@@ -81,34 +476,184 @@ void logger_setname(char * filename)
   @return   void
 
   Use this function as a printf. Your message will be printed out to
-  stderr and logged to a file.
+  stderr and logged to a file. Thread-safe.
+  fmt must stay valid until the message is written out, i.e. be a
+  string literal. Conversions with '*' or wide characters are formatted
+  by the caller. Strings are truncated to the room left in a record.
  */
 /*--------------------------------------------------------------------------*/
 void logger(char * fmt, ...)
 {
-    FILE *  lf ;
-    char *  now ;
-    char    logmsg[LOGSZ] ; 
-    va_list ap ; 
- 
-    va_start(ap, fmt); 
-    vsprintf(logmsg, fmt, ap) ; 
-    va_end(ap) ; 
+    log_record *    rec ;
+    uint64_t        pos ;
+    va_list         ap, aq ;
+    char            logmsg[DATETIME_SZ + LOGSZ + 1] ;
+    int             n ;
+
+    if (__builtin_expect(__atomic_load_n(&log_state, __ATOMIC_ACQUIRE)
+                         !=LOG_RUNNING, 0) && log_start()!=0) {
+        /* No background thread: write synchronously */
+        pthread_mutex_lock(&log_lock);
+        n = sprintf(logmsg, "%s ", datetime_at(now_ns()));
+        va_start(ap, fmt);
+        n += vsnprintf(logmsg+n, LOGSZ, fmt, ap);
+        va_end(ap);
+        n = n < DATETIME_SZ + LOGSZ ? n : DATETIME_SZ + LOGSZ - 1 ;
+        logmsg[n++] = '\n' ;
+        log_output(logmsg, n);
+        pthread_mutex_unlock(&log_lock);
+        return ;
+    }
+    if ((rec = log_claim(&pos))==NULL) {
+        __atomic_add_fetch(&log_drops, 1, __ATOMIC_RELAXED);
+        return ;
+    }
+    rec->ns  = now_ns() ;
+    rec->fmt = fmt ;
+    va_start(ap, fmt);
+    va_copy(aq, ap);
+    if (log_pack(rec, fmt, aq)!=0) {
+        vsnprintf(rec->args, LOG_ARGSZ, fmt, ap);
+        rec->fmt = NULL ;
+    }
+    va_end(aq);
+    va_end(ap);
+    __atomic_store_n(&rec->seq, pos+1, __ATOMIC_RELEASE);
+    return ;
+}
+
+/* Index of name among n names, -1 if missing */
+static int log_name(const char ** names, int n, const char * name,
+                    size_t len)
+{
+    int i ;
+
+    for (i=0 ; i<n ; i++) {
+        if (strlen(names[i])==len && !strncmp(names[i], name, len)) {
+            return i ;
+        }
+    }
+    return -1 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Set log levels
+  @param    spec    Levels, e.g. "debug" or "info+fuse:trace"
+  @return   0 if spec is valid, -1 otherwise
 
-    now = datetime_now() ;
-    fprintf(stderr, "%s %s\n", now, logmsg);
+  See logger.h for the syntax.
+ */
+/*--------------------------------------------------------------------------*/
+int logger_configure(const char * spec)
+{
+    int             level[LOG_NSUBSYS] ;
+    const char *    item ;
+    const char *    colon ;
+    size_t          len ;
+    int             i, sub, lvl ;
 
-    if ((lf=fopen(logger_filename, "a"))!=NULL) {
-        fprintf(lf, "%s %s\n", now, logmsg);
-        fclose(lf);
+    memcpy(level, log_configured, sizeof(level));
+    for (item=spec ; *item ; item+=len + (item[len]=='+')) {
+        len   = strcspn(item, "+");
+        colon = memchr(item, ':', len);
+        sub   = -1 ;
+        if (colon) {
+            if ((sub = log_name(log_subsys, LOG_NSUBSYS, item,
+                                colon-item))<0) {
+                return -1 ;
+            }
+            lvl = log_name(log_levels, LOG_NLEVELS, colon+1,
+                           item+len-colon-1);
+        } else {
+            lvl = log_name(log_levels, LOG_NLEVELS, item, len);
+        }
+        if (lvl<0) {
+            return -1 ;
+        }
+        for (i=0 ; i<LOG_NSUBSYS ; i++) {
+            if (sub<0 || sub==i) {
+                level[i] = lvl ;
+            }
+        }
     }
+    for (i=0 ; i<LOG_NSUBSYS ; i++) {
+        log_configured[i] = level[i] ;
+        logger_level[i]   = level[i] ;
+    }
+    return 0 ;
+}
+
+static void log_signal(int sig)
+{
+    int i ;
+
+    for (i=0 ; i<LOG_NSUBSYS ; i++) {
+        if (sig==SIGUSR2) {
+            logger_level[i] = log_configured[i] ;
+        } else if (logger_level[i] < LVL_TRACE) {
+            logger_level[i]++ ;
+        }
+    }
+    return ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Let signals change log levels at runtime
+  @return   void
+
+  SIGUSR1: one level more verbose, SIGUSR2: back to configured levels.
+ */
+/*--------------------------------------------------------------------------*/
+void logger_signals(void)
+{
+    struct sigaction sa ;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_signal ;
+    sa.sa_flags   = SA_RESTART ;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
     return ;
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Write out pending messages and stop the background thread
+  @return   void
+
+  Called at exit. Messages logged afterwards are written synchronously.
+ */
+/*--------------------------------------------------------------------------*/
+void logger_stop(void)
+{
+    pthread_mutex_lock(&log_lock);
+    if (log_state==LOG_RUNNING) {
+        __atomic_store_n(&log_state, LOG_STOPPED, __ATOMIC_RELEASE);
+        pthread_join(log_thread, NULL);
+    }
+    log_state = LOG_STOPPED ;
+    pthread_mutex_unlock(&log_lock);
+    return ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Number of messages dropped because the ring buffer was full
+  @return   Count since start
+ */
+/*--------------------------------------------------------------------------*/
+uint64_t logger_dropped(void)
+{
+    return __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+}
+
 #ifdef MAIN
 int main(int argc, char * argv[])
 {
-    logger("hello %s %d %g\n", "world", 42, 1.5);
+    logger("hello %s %d %g", "world", 42, 1.5);
 	return 0 ;
 }
 #endif
@@ -17,6 +17,41 @@
 #ifndef _LOGGER_H_
 #define _LOGGER_H_
 
+#include <stdint.h>
+
+/*
+ * Messages belong to a subsystem and have a level. Each subsystem logs
+ * messages up to its current level, set at mount time and changed at
+ * runtime with signals, see logger_configure() and logger_signals().
+ * Messages more verbose than LOG_FLOOR are removed at compile time.
+ */
+#define LOG_FUSE        0   /* FUSE requests */
+#define LOG_CONTAINER   1   /* Loading and saving the container */
+#define LOG_CRYPTO      2   /* Keys and passwords */
+#define LOG_CACHE       3   /* Kernel caching and memory use */
+#define LOG_NSUBSYS     4
+
+#define LVL_ERROR   0
+#define LVL_WARN    1
+#define LVL_INFO    2
+#define LVL_DEBUG   3
+#define LVL_TRACE   4
+
+#ifndef LOG_FLOOR
+#define LOG_FLOOR   LVL_DEBUG
+#endif
+
+extern volatile int logger_level[LOG_NSUBSYS] ;
+
+/* Log a message of subsystem sub at level lvl, a la printf */
+#define LOG(sub, lvl, ...) \
+    do { \
+        if ((lvl) <= LOG_FLOOR && \
+            __builtin_expect((lvl) <= logger_level[(sub)], 0)) { \
+            logger(__VA_ARGS__); \
+        } \
+    } while (0)
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Change default log file name
@@ -41,5 +76,48 @@ void logger_setname(char * filename);
 /*--------------------------------------------------------------------------*/
 void logger(char * fmt, ...);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Set log levels
+  @param    spec    Levels, e.g. "debug" or "info+fuse:trace"
+  @return   0 if spec is valid, -1 otherwise
+
+  spec is a list of items separated by '+'. An item is a level name for
+  all subsystems, or a subsystem name, a colon and a level name.
+  Subsystems are fuse, container, crypto and cache. Levels are error,
+  warn, info, debug and trace. Nothing changes if spec is not valid.
+ */
+/*--------------------------------------------------------------------------*/
+int logger_configure(const char * spec);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Let signals change log levels at runtime
+  @return   void
+
+  SIGUSR1 makes every subsystem one level more verbose, SIGUSR2 brings
+  levels back to what logger_configure() set.
+ */
+/*--------------------------------------------------------------------------*/
+void logger_signals(void);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Write out pending messages and stop the background thread
+  @return   void
+
+  Runs at exit. Messages logged afterwards are written synchronously.
+ */
+/*--------------------------------------------------------------------------*/
+void logger_stop(void);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Number of messages dropped because the ring buffer was full
+  @return   Count since start
+ */
+/*--------------------------------------------------------------------------*/
+uint64_t logger_dropped(void);
+
 #endif
 /* vim: set ts=4 et sw=4 tw=75 */
@@ -5,13 +5,21 @@
  * http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/
  */
 
+/* make FUSE=3 builds against libfuse 3, see the Makefile */
+#ifdef MEFS_FUSE3
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
+#endif
 
 #include <fuse.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -22,68 +30,108 @@
 
 #include "logger.h"
 #include "memfile.h"
+#include "filetable.h"
+#include "slab.h"
 #include "inode.h"
 #include "fslimits.h"
-
-#define DEBUG   1
-#if DEBUG<1
-#define logger(...)
-#endif
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "mefsopt.h"
 
 #define KEYSZ   32
 
-static struct {
-    char backup_filename[MAXNAMESZ] ;
-    char * password ;
-    int    err ;
-} config ;
+/*
+ * Mount options of mefs only, see mefsopt.c for the others
+ * trace=file       Record requests, container loading and saving, key
+ *                  derivation and encryption as spans, see trace.h.
+ *                  Written to file in Chrome trace format at unmount.
+ */
+static struct fuse_opt mefs_opts[] = {
+    MEFS_OPT("trace=%s", trace_opt),
+    FUSE_OPT_END
+};
+
+/*
+ * Default cache options, passed before user options so that any of them
+ * can be overridden with -o, as can max_write, max_read and
+ * max_readahead.
+ * Files can only be reached through the mount, so the kernel sees every
+ * change and keeps its caches up to date by itself: attributes, names,
+ * missing names and file pages can all be kept for long.
+ */
+#define MEFS_CACHE_OPTS "-oentry_timeout=60,attr_timeout=60," \
+                        "negative_timeout=60,kernel_cache"
 
 /*
  * For this version, all files are kept in the root directory
  * with a limited amount of files (MAXFILES).
  */
-static memfile rootdir[MAXFILES] ;
+static filetable rootdir ;
 /* The root node */
 static struct stat rootfs ;
 
-/* Find file called 'path' in rootdir */
-static int rootdir_find(const char * path)
+#ifdef FUSE_CAP_ASYNC_READ
+/* Ask for a kernel feature if the kernel has it */
+static void mefs_want(struct fuse_conn_info * conn, unsigned cap)
 {
-    int i ;
-
-    if (!path) {
-        return -1 ;
+    if (conn->capable & cap) {
+        conn->want |= cap ;
     }
-    for (i=0 ; i<MAXFILES ; i++) {
-        if (rootdir[i].name && (!strcmp(path, rootdir[i].name))) {
-            return i ;
-        }
-    }
-    return -1 ;
 }
+#endif
 
-/* Find first available slot in rootdir */
-static int rootdir_first(void)
+/* Memory accounting for /.mefs/stats */
+static void mefs_memory(stats_memory * m)
 {
-    int i ;
-    for (i=0 ; i<MAXFILES ; i++) {
-        if (rootdir[i].name == NULL) {
-            return i ;
-        }
-    }
-    return -1 ;
+    filetable_memory(&rootdir, m);
 }
 
 /*
  * Run only once at start
  */
+#ifdef MEFS_FUSE3
+static void * mefs_init(struct fuse_conn_info * conn,
+                        struct fuse_config * cfg)
+#else
 static void * mefs_init(struct fuse_conn_info * conn)
+#endif
 {
     time_t  now ;
-    int i, ret ;
-    memfile mf ;
-
-    logger("mefs_init");
+    int ret ;
+
+    LOG(LOG_FUSE, LVL_INFO, "mefs_init");
+#ifdef MEFS_FUSE3
+    fuse_apply_conn_info_opts(config.conn_opts, conn);
+    /* Open files are addressed by handle, see mefs_open() */
+    cfg->hard_remove = 1 ;
+    cfg->nullpath_ok = 1 ;
+    /* Requests on different files run in parallel, see filetable.h */
+    mefs_want(conn, FUSE_CAP_ASYNC_READ);
+    mefs_want(conn, FUSE_CAP_PARALLEL_DIROPS);
+    if (!config.nocache) {
+        /*
+         * Let the kernel gather small writes into large ones, and fill
+         * its attribute cache from directory listings.
+         */
+        mefs_want(conn, FUSE_CAP_WRITEBACK_CACHE);
+        mefs_want(conn, FUSE_CAP_READDIRPLUS);
+    }
+#endif
+    /* Have large writes sent in one request rather than 4 KiB pages */
+#ifdef FUSE_CAP_BIG_WRITES
+    if (!config.nocache) {
+        mefs_want(conn, FUSE_CAP_BIG_WRITES);
+    }
+#endif
+    /* Have write data spliced into a pipe, see mefs_write_buf() */
+#ifdef FUSE_CAP_SPLICE_READ
+    mefs_want(conn, FUSE_CAP_SPLICE_READ);
+#endif
+    LOG(LOG_CACHE, LVL_INFO,
+        "mefs_init: protocol %u.%u max_write %u max_readahead %u",
+        conn->proto_major, conn->proto_minor,
+        conn->max_write, conn->max_readahead);
     /* Setup root directory */
     rootfs.st_mode      = S_IFDIR | 0755 ;
     rootfs.st_ino       = 1 ;
@@ -98,18 +146,20 @@ static void * mefs_init(struct fuse_conn_info * conn)
     rootfs.st_ctime     = now ;
 
     /* Initialize list of files */
-    for (i=0 ; i<MAXFILES ; i++) {
-        memfile_init(rootdir+i, NULL, 0);
-    }
+    filetable_init(&rootdir);
+    filetable_limit(&rootdir, config.budget, config.maxfile);
+    stats_memory_source(mefs_memory);
 
     ret =
     memfile_readfiles(config.backup_filename,
                       config.password,
-                      rootdir);
+                      &rootdir);
     if (ret<0) {
         config.err++ ;
         fuse_exit(fuse_get_context()->fuse);
     }
+    memfile_report(&rootdir);
+    stats_phase_log(0);
     return NULL ;
 }
 
@@ -118,63 +168,259 @@ static void * mefs_init(struct fuse_conn_info * conn)
  */
 static void mefs_destroy(void * p)
 {
-    logger("mefs_destroy");
+    LOG(LOG_FUSE, LVL_INFO, "mefs_destroy");
+    memfile_report(&rootdir);
     if (config.err<1) {
         memfile_savefiles(config.backup_filename,
                           config.password,
-                          rootdir);
+                          &rootdir);
+        stats_phase_log(1);
     }
+    trace_stop();
     return ;
 }
 
+/*
+ * Virtual files under /.mefs, served from memory and never saved:
+ * stats        Request counts and latencies as text, see stats.h.
+ *              Writing to it or truncating it resets the counters.
+ * stats.json   The same in JSON, read-only.
+ * trace.json   Spans recorded so far in Chrome trace format, read-only.
+ *              Empty unless mounted with -o trace, see trace.h.
+ * The directory is not listed in / and hides any file of that name.
+ * Opening a virtual file takes a snapshot of its contents, read with
+ * direct I/O so that the kernel never serves a stale copy from its
+ * cache. Virtual handles have MEFS_VFH set, the other bits of fi->fh
+ * point to the snapshot.
+ * Requests on virtual files are not counted.
+ */
+#define MEFS_VDIR   "/.mefs"
+#define MEFS_VFH    (1ULL<<63)
+
+#define V_NONE      0   /* Not under /.mefs */
+#define V_DIR       1
+#define V_STATS     2
+#define V_JSON      3
+#define V_TRACE     4
+#define V_MISSING   5   /* Under /.mefs, no such file */
+
+typedef struct {
+    int     kind ;
+    size_t  len ;
+    char *  buf ;
+} mefs_vsnap ;
+
+#define VSNAP(fi)   ((mefs_vsnap*)(uintptr_t)((fi)->fh & ~MEFS_VFH))
+
+static int mefs_vpath(const char * path)
+{
+    if (!path || strncmp(path, MEFS_VDIR, sizeof(MEFS_VDIR)-1)) {
+        return V_NONE ;
+    }
+    path += sizeof(MEFS_VDIR)-1 ;
+    if (*path=='\0') {
+        return V_DIR ;
+    }
+    if (*path!='/') {
+        return V_NONE ;
+    }
+    if (!strcmp(path, "/stats")) {
+        return V_STATS ;
+    }
+    if (!strcmp(path, "/stats.json")) {
+        return V_JSON ;
+    }
+    if (!strcmp(path, "/trace.json")) {
+        return V_TRACE ;
+    }
+    return V_MISSING ;
+}
+
+static int mefs_vgetattr(int kind, struct stat * stbuf)
+{
+    memcpy(stbuf, &rootfs, sizeof(struct stat));
+    switch (kind) {
+        case V_DIR:
+        stbuf->st_mode  = S_IFDIR | 0555 ;
+        break ;
+        case V_STATS:
+        stbuf->st_mode  = S_IFREG | 0644 ;
+        stbuf->st_nlink = 1 ;
+        break ;
+        case V_JSON:
+        case V_TRACE:
+        stbuf->st_mode  = S_IFREG | 0444 ;
+        stbuf->st_nlink = 1 ;
+        break ;
+        default:
+        return -ENOENT ;
+    }
+    stbuf->st_ino = 0 ;
+    return 0 ;
+}
+
+static int mefs_vopen(int kind, struct fuse_file_info * fi)
+{
+    mefs_vsnap *    snap ;
+
+    if (kind==V_DIR || kind==V_MISSING) {
+        return kind==V_DIR ? -EISDIR : -ENOENT ;
+    }
+    if (kind!=V_STATS && (fi->flags & O_ACCMODE)!=O_RDONLY) {
+        return -EACCES ;
+    }
+    if ((snap = calloc(1, sizeof(mefs_vsnap)))==NULL) {
+        return -ENOMEM ;
+    }
+    snap->kind = kind ;
+    if ((fi->flags & O_ACCMODE)!=O_WRONLY) {
+        snap->buf = kind==V_TRACE ? trace_report(&snap->len) :
+                                    stats_report(kind==V_JSON, &snap->len);
+        if (snap->buf==NULL) {
+            free(snap);
+            return -ENOMEM ;
+        }
+    }
+    fi->fh        = MEFS_VFH | (uintptr_t)snap ;
+    fi->direct_io = 1 ;
+    return 0 ;
+}
+
+static int mefs_vread(struct fuse_file_info * fi, char * buf, size_t size,
+                      off_t offset)
+{
+    mefs_vsnap * snap = VSNAP(fi) ;
+
+    if (offset>=(off_t)snap->len) {
+        return 0 ;
+    }
+    if (size > snap->len - offset) {
+        size = snap->len - offset ;
+    }
+    memcpy(buf, snap->buf + offset, size);
+    return size ;
+}
+
+static int mefs_vrelease(struct fuse_file_info * fi)
+{
+    mefs_vsnap * snap = VSNAP(fi) ;
+
+    free(snap->buf);
+    free(snap);
+    return 0 ;
+}
+
+/* Anything written to stats resets the counters */
+static int mefs_vreset(int kind)
+{
+    if (kind!=V_STATS) {
+        return kind==V_MISSING ? -ENOENT : -EACCES ;
+    }
+    stats_reset();
+    return 0 ;
+}
+
 /*
  * Return file attributes. See stat(2)
  */
 static int mefs_getattr(const char *path, struct stat *stbuf)
 {
-    int i ;
+    uint64_t t0 ;
+    int v ;
 
     if (!path || ! stbuf) {
         return -ENOENT ;
     }
-    logger("mefs_getattr: %s", path);
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_getattr: %s", path);
+    if ((v = mefs_vpath(path))!=V_NONE) {
+        return mefs_vgetattr(v, stbuf);
+    }
+    t0 = stats_start();
     if (!strcmp(path, "/")) {
         memcpy(stbuf, &rootfs, sizeof(struct stat));
-        return 0 ;
+        return stats_done(STATS_GETATTR, t0, 0);
     }
-    /* Find name in rootdir */
-    if ((i=rootdir_find(path))<0) {
-        return -ENOENT ;
-    }
-    memcpy(stbuf, &(rootdir[i].sta), sizeof(struct stat));
-	return 0 ;
+    return stats_done(STATS_GETATTR, t0,
+                      filetable_getattr(&rootdir, path, stbuf));
 }
 
 /*
  * Since there is only one directory to take care of, everything
  * is hardcoded here for rootdir.
+ * Entries are listed with offset cookies so that the kernel can page
+ * through large directories, see mefsopt.h. Listing stops as soon as
+ * the reply buffer is full.
+ * With FUSE 3 readdirplus, entries carry full attributes so that the
+ * kernel does not have to look files up one by one afterwards.
  */
+
+#ifdef MEFS_FUSE3
+#define FILL(buf, name, st, off, plus) filler(buf, name, st, off, plus)
+
+static int mefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info *fi,
+                        enum fuse_readdir_flags flags)
+{
+    enum fuse_fill_dir_flags plus = flags & FUSE_READDIR_PLUS ?
+                                    FUSE_FILL_DIR_PLUS : 0 ;
+#else
+#define FILL(buf, name, st, off, plus) filler(buf, name, st, off)
+
 static int mefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
+    int plus = 0 ;
+#endif
     int i ;
+    struct stat sta ;
+    uint64_t t0 ;
 
     if (!path || !buf) {
         return -ENOENT ;
     }
-    logger("mefs_readdir");
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_readdir: off %d", (int)offset);
+    if (mefs_vpath(path)==V_DIR) {
+        /* Without offsets, libfuse pages through the listing itself */
+        FILL(buf, ".", NULL, 0, 0);
+        FILL(buf, "..", NULL, 0, 0);
+        FILL(buf, "stats", NULL, 0, 0);
+        FILL(buf, "stats.json", NULL, 0, 0);
+        FILL(buf, "trace.json", NULL, 0, 0);
+        return 0 ;
+    }
     if (strcmp(path, "/")) {
         return -ENOENT ;
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    for (i=0 ; i<MAXFILES ; i++) {
-        if (rootdir[i].name) {
-            filler(buf, rootdir[i].name+1, &(rootdir[i].sta), 0);
+    t0 = stats_start();
+    if (offset < COOKIE_DOT) {
+        if (FILL(buf, ".", NULL, COOKIE_DOT, 0)) {
+            return stats_done(STATS_READDIR, t0, 0);
+        }
+    }
+    if (offset < COOKIE_DOTDOT) {
+        if (FILL(buf, "..", NULL, COOKIE_DOTDOT, 0)) {
+            return stats_done(STATS_READDIR, t0, 0);
         }
     }
-	return 0;
+    /* Only mode and inode are used by FUSE here, unless plus is set */
+    memset(&sta, 0, sizeof(struct stat));
+    i = offset < COOKIE_SLOT(0) ? 0 : offset - COOKIE_SLOT(0) + 1 ;
+    filetable_rdlock(&rootdir);
+    while ((i = filetable_next(&rootdir, i))>=0) {
+        if (plus) {
+            filetable_igetattr(&rootdir, i, &sta);
+        } else {
+            sta.st_ino  = rootdir.ino[i] ;
+            sta.st_mode = rootdir.mode[i] ;
+        }
+        if (FILL(buf, rootdir.name[i]+1, &sta, COOKIE_SLOT(i), plus)) {
+            break ;
+        }
+        i++ ;
+    }
+    filetable_unlock(&rootdir);
+    return stats_done(STATS_READDIR, t0, 0);
 }
 
 
@@ -183,24 +429,17 @@ static int mefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  */
 static int mefs_unlink(const char *path)
 {
-    int i ;
+    uint64_t t0 ;
 
     if (!path) {
         return -ENOENT ;
     }
-    logger("mefs_unlink %s", path);
-    if ((i = rootdir_find(path))<0) {
-        return -ENOENT ;
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_unlink %s", path);
+    if (mefs_vpath(path)!=V_NONE) {
+        return -EACCES ;
     }
-    /* Clean up all data */
-    if (rootdir[i].sta.st_size>0 && rootdir[i].data!=NULL) {
-        free(rootdir[i].data);
-    }
-    if (rootdir[i].name != NULL) {
-        free(rootdir[i].name);
-    }
-    memset(&(rootdir[i]), 0, sizeof(memfile));
-	return 0;
+    t0 = stats_start();
+    return stats_done(STATS_UNLINK, t0, filetable_unlink(&rootdir, path));
 }
 
 /*
@@ -209,26 +448,19 @@ static int mefs_unlink(const char *path)
  */
 static int mefs_rename(const char *from, const char *to)
 {
-    int i;
-    time_t now ;
+    uint64_t t0 ;
 
     if (!from || !to) {
         return -ENOENT ;
     }
 
-    logger("mefs_rename %s %s", from, to);
-    i = rootdir_find(from);
-    if (i<0) {
-        return -ENOENT ;
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_rename %s %s", from, to);
+    if (mefs_vpath(from)!=V_NONE || mefs_vpath(to)!=V_NONE) {
+        return -EACCES ;
     }
-    if (rootdir[i].name != NULL) {
-        free(rootdir[i].name);
-    }
-    rootdir[i].name = strdup(to);
-    time(&now);
-    rootdir[i].sta.st_mtime = now ;
-
-	return 0;
+    t0 = stats_start();
+    return stats_done(STATS_RENAME, t0,
+                      filetable_rename(&rootdir, from, to));
 }
 
 /*
@@ -236,28 +468,16 @@ static int mefs_rename(const char *from, const char *to)
 */
 static int mefs_truncate(const char *path, off_t size)
 {
-    time_t now ;
-    int i ;
-    uint8_t * newbuf ;
-
-    logger("mefs_truncate: %s sz %d", path, (int)size);
+    uint64_t t0 ;
+    int v ;
 
-    i = rootdir_find(path);
-    if (i<0) {
-        return -ENOENT ;
-    }
-    newbuf = calloc(size, sizeof(uint8_t));
-    memcpy(newbuf, rootdir[i].data, size);
-    if (rootdir[i].data) {
-        free(rootdir[i].data);
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_truncate: %s sz %d", path, (int)size);
+    if ((v = mefs_vpath(path))!=V_NONE) {
+        return mefs_vreset(v);
     }
-    rootdir[i].data = newbuf ;
-    rootdir[i].sta.st_size = size ;
-    rootdir[i].sta.st_blocks = 1 + size / BLOCKSZ ;
-    time(&now);
-    rootdir[i].sta.st_mtime = now ;
-
-	return 0;
+    t0 = stats_start();
+    return stats_done(STATS_TRUNCATE, t0,
+                      filetable_truncate(&rootdir, path, size));
 }
 
 /*
@@ -265,61 +485,114 @@ static int mefs_truncate(const char *path, off_t size)
  */
 static int mefs_utimens(const char * path, const struct timespec ts[2])
 {
-    int i ;
+    uint64_t t0 ;
     time_t now ;
+    int v ;
 
-    if ((i=rootdir_find(path))<0) {
-        return -ENOENT ;
+    if ((v = mefs_vpath(path))!=V_NONE) {
+        return v==V_MISSING ? -ENOENT : 0 ;
     }
-
+    t0 = stats_start();
     time(&now);
-    rootdir[i].sta.st_mtime = now ;
-    return 0 ;
+    return stats_done(STATS_UTIMENS, t0,
+                      filetable_touch(&rootdir, path, now));
+}
+
+/*
+ * Get attributes of an open file through its handle
+ */
+static int mefs_fgetattr(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi)
+{
+    uint64_t t0 ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_fgetattr: fh %d", (int)fi->fh);
+    if (fi->fh & MEFS_VFH) {
+        return mefs_vgetattr(VSNAP(fi)->kind, stbuf);
+    }
+    t0 = stats_start();
+    filetable_igetattr(&rootdir, fi->fh, stbuf);
+    return stats_done(STATS_GETATTR, t0, 0);
+}
+
+/*
+ * Truncate an open file through its handle
+ */
+static int mefs_ftruncate(const char *path, off_t size,
+                          struct fuse_file_info *fi)
+{
+    uint64_t t0 ;
 
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_ftruncate: fh %d sz %d",
+        (int)fi->fh, (int)size);
+    if (fi->fh & MEFS_VFH) {
+        return mefs_vreset(VSNAP(fi)->kind);
+    }
+    t0 = stats_start();
+    return stats_done(STATS_TRUNCATE, t0,
+                      filetable_itruncate(&rootdir, fi->fh, size));
 }
 
 /*
- * Create a new file
+ * Create a new file and open it
  */
 static int mefs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+    struct stat st ;
+    uint64_t t0 ;
     int i ;
-    time_t now ;
 
     if (!path) {
         return -1 ;
     }
-    logger("mefs_create %s", path);
-    i = rootdir_find(path);
-    if (i<0) {
-        i = rootdir_first();
-        if (i<0) {
-            return -ENOSPC ;
-        }
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_create %s", path);
+    if (mefs_vpath(path)!=V_NONE) {
+        return -EACCES ;
+    }
+    t0 = stats_start();
+    if ((i = filetable_icreate(&rootdir, path, mode, &st))<0) {
+        return stats_done(STATS_CREATE, t0, i);
     }
+    fi->fh = i ;
+    return stats_done(STATS_CREATE, t0, 0);
+}
 
-    memfile_init(rootdir+i, path, mode);
-    time(&now);
-    rootdir[i].sta.st_ctime = now ;
-    rootdir[i].sta.st_ino = inode_next() ;
+/*
+ * Open a file. The file handle in fi->fh is its slot in the file table,
+ * pinned until release: reads and writes go straight to the file, and a
+ * file deleted while open keeps its contents until it is closed.
+ */
+static int mefs_open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t0 ;
+    int i, v ;
 
-    return 0;
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_open %s", path);
+    if ((v = mefs_vpath(path))!=V_NONE) {
+        return mefs_vopen(v, fi);
+    }
+    t0 = stats_start();
+    if ((i = filetable_open(&rootdir, path))<0) {
+        return stats_done(STATS_OPEN, t0, i);
+    }
+    fi->fh = i ;
+    return stats_done(STATS_OPEN, t0, 0);
 }
 
 /*
- * Open a file: check for existence, permissions, and return success or
- * error. If you use file handles, set fi->fh. See fuse_common.h for more
- * information about fi fields.
+ * Close a file: drop the reference taken by open or create
  */
-static int mefs_open(const char *path, struct fuse_file_info *fi)
+static int mefs_release(const char *path, struct fuse_file_info *fi)
 {
-    int i ;
+    uint64_t t0 ;
 
-    logger("mefs_open");
-    if ((i=rootdir_find(path))<0) {
-        return -ENOENT ;
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_release: fh %d", (int)fi->fh);
+    if (fi->fh & MEFS_VFH) {
+        return mefs_vrelease(fi);
     }
-    return 0 ;
+    t0 = stats_start();
+    filetable_unpin(&rootdir, fi->fh, 1);
+    return stats_done(STATS_RELEASE, t0, 0);
 }
 
 /*
@@ -329,18 +602,20 @@ static int mefs_open(const char *path, struct fuse_file_info *fi)
 static int mefs_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi)
 {
-    int i ;
-    logger("mefs_read: %s off %d sz %d", path, (int)offset, (int)size);
-
-    if ((i=rootdir_find(path))<0) {
-        return -ENOENT;
-    }
-    if ((offset+size)>rootdir[i].sta.st_size) {
-        size = rootdir[i].sta.st_size - offset ;
-        /* logger("read reduced to %d", (int)size); */
-    }
-    memcpy(buf, rootdir[i].data+offset, size);
-    return size ;
+    uint64_t t0 ;
+    int ret ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_read: fh %d off %d sz %d",
+        (int)fi->fh, (int)offset, (int)size);
+    if (fi->fh & MEFS_VFH) {
+        return mefs_vread(fi, buf, size, offset);
+    }
+    PROBE3(read__entry, fi->fh, offset, size);
+    t0  = stats_start();
+    ret = stats_done(STATS_READ, t0,
+                     filetable_iread(&rootdir, fi->fh, buf, size, offset));
+    PROBE2(read__return, fi->fh, ret);
+    return ret ;
 }
 
 /*
@@ -349,87 +624,237 @@ static int mefs_read(const char *path, char *buf, size_t size, off_t offset,
 static int mefs_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-    int i ;
-    time_t now ;
-    uint8_t * newbuf ;
-    size_t newsz ;
-
-    logger("mefs_write: %s off %d sz %d", path, (int)offset, (int)size);
-    i = rootdir_find(path);
-    if (i<0) {
-        /* Create new file */
-        i = rootdir_first();
-        if (i<0) {
-            /* No more file slots available */
-            return -ENOSPC ;
-        }
-        rootdir[i].name = strdup(path);
-        rootdir[0].sta.st_mode = S_IFREG | 0600 ;
-        rootdir[0].sta.st_ino = inode_next() ;
-        rootdir[0].sta.st_uid  = getuid() ;
-        rootdir[0].sta.st_gid  = getgid() ;
-        rootdir[0].sta.st_nlink = 1 ;
-        time(&now);
-        rootdir[0].sta.st_mtime = now ;
-        rootdir[0].sta.st_ctime = now ;
-
-        newsz = offset + size ;
-        rootdir[0].sta.st_size = newsz ;
-        rootdir[0].sta.st_blocks = 1 + newsz / BLOCKSZ ;
-        rootdir[0].data = calloc(newsz, sizeof(uint8_t));
-        memcpy(rootdir[0].data + offset, buf, size);
+    uint64_t t0 ;
+    int ret ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_write: fh %d off %d sz %d",
+        (int)fi->fh, (int)offset, (int)size);
+    if (fi->fh & MEFS_VFH) {
+        ret = mefs_vreset(VSNAP(fi)->kind);
+        return ret<0 ? ret : (int)size ;
+    }
+    PROBE3(write__entry, fi->fh, offset, size);
+    t0  = stats_start();
+    ret = stats_done(STATS_WRITE, t0,
+                     filetable_iwrite(&rootdir, fi->fh, buf, size, offset));
+    PROBE2(write__return, fi->fh, ret);
+    return ret ;
+}
+#if FUSE_VERSION >= 29
+/*
+ * Write straight into file contents. When libfuse splices requests into
+ * a pipe, data goes from the pipe to the file pages in a single copy
+ * instead of going through a libfuse buffer first.
+ * There is no read_buf counterpart: libfuse frees whatever memory
+ * read_buf hands over, so it cannot point into file contents.
+ */
+static int mefs_write_buf(const char *path, struct fuse_bufvec *src,
+                          off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *    dst ;
+    struct iovec *          iov ;
+    size_t  size = fuse_buf_size(src) ;
+    ssize_t ret ;
+    int     n ;
+    uint64_t t0 ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_write_buf: fh %d off %d sz %d",
+        (int)fi->fh, (int)offset, (int)size);
+    if (fi->fh & MEFS_VFH) {
+        /* libfuse drains whatever is left unread in the pipe */
+        n = mefs_vreset(VSNAP(fi)->kind);
+        return n<0 ? n : (int)size ;
+    }
+    PROBE3(write__entry, fi->fh, offset, size);
+    t0 = stats_start();
+    iov = malloc(EXTMAP_MAXIOV(size) * sizeof(struct iovec));
+    if (iov==NULL) {
+        ret = -ENOMEM ;
+    } else if ((n = filetable_iwrite_map(&rootdir, fi->fh, iov, size,
+                                         offset))<0) {
+        ret = n ;
     } else {
-        newsz = offset + size ;
-        /* Modify existing file */
-        if (newsz > rootdir[i].sta.st_size) {
-            /* Grow existing file */
-            newbuf = calloc(newsz, sizeof(uint8_t));
-            /* Copy previous contents */
-            if (rootdir[i].sta.st_size > 0 ) {
-                memcpy(newbuf, rootdir[i].data, offset);
-                free(rootdir[i].data);
-            }
-            memcpy(newbuf+offset, buf, size);
-            rootdir[i].data = newbuf ;
+        if ((dst = mefs_bufvec(iov, n))==NULL) {
+            ret = -ENOMEM ;
         } else {
-            /* Write into existing file */
-            memcpy(rootdir[i].data+offset, buf, size);
+            ret = fuse_buf_copy(dst, src, 0);
+            free(dst);
         }
-        rootdir[i].sta.st_size = newsz ;
-        rootdir[i].sta.st_blocks = 1 + newsz / BLOCKSZ ;
-        time(&now);
-        rootdir[0].sta.st_mtime = now ;
+        filetable_iwrite_unmap(&rootdir, fi->fh, offset, ret>0 ? ret : 0);
     }
-	return size;
+    free(iov);
+    stats_done(STATS_WRITE, t0, ret);
+    PROBE2(write__return, fi->fh, ret);
+    return ret ;
+}
+
+/*
+ * Preallocate, punch holes or zero a range of an open file, see
+ * fallocate(2). Writing to preallocated ranges allocates nothing more.
+ */
+static int mefs_fallocate(const char *path, int mode, off_t offset,
+                          off_t len, struct fuse_file_info *fi)
+{
+    uint64_t t0 ;
+
+    LOG(LOG_FUSE, LVL_DEBUG,
+        "mefs_fallocate: fh %d mode %d off %d len %d",
+        (int)fi->fh, mode, (int)offset, (int)len);
+    if (fi->fh & MEFS_VFH) {
+        return -EOPNOTSUPP ;
+    }
+    t0 = stats_start();
+    return stats_done(STATS_FALLOCATE, t0,
+                      filetable_ifallocate(&rootdir, fi->fh, mode,
+                                           offset, len));
 }
+#endif
+
 /*
  * Returns statistics about the filesystem. See statvfs(2)
  * You can ignore path
  */
 static int mefs_statfs(const char *path, struct statvfs *sfs)
 {
-    int i ;
-    int n=0 ;
-    size_t  total_sz=0 ;
+    uint64_t t0 = stats_start() ;
 
-    for (i=0 ; i<MAXFILES ; i++) {
-        if (rootdir[i].name!=NULL) {
-            n++ ;
-            total_sz += rootdir[i].sta.st_size ;
-        }
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_statfs");
+    mefs_statfs_fill(&rootdir, sfs);
+    return stats_done(STATS_STATFS, t0, 0);
+}
+
+#ifdef MEFS_FUSE3
+/*
+ * FUSE 3 merges getattr, truncate and utimens with their handle-based
+ * variants: fi is set when the call comes from an open file, and path
+ * may then be NULL.
+ */
+static int mefs_getattr3(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi)
+{
+    if (fi) {
+        return mefs_fgetattr(path, stbuf, fi);
+    }
+    return mefs_getattr(path, stbuf);
+}
+
+static int mefs_truncate3(const char *path, off_t size,
+                          struct fuse_file_info *fi)
+{
+    if (fi) {
+        return mefs_ftruncate(path, size, fi);
+    }
+    return mefs_truncate(path, size);
+}
+
+static int mefs_utimens3(const char * path, const struct timespec ts[2],
+                         struct fuse_file_info *fi)
+{
+    uint64_t t0 ;
+
+    if (fi && (fi->fh & MEFS_VFH)) {
+        return 0 ;
+    }
+    if (fi) {
+        t0 = stats_start();
+        filetable_itouch(&rootdir, fi->fh, time(NULL));
+        return stats_done(STATS_UTIMENS, t0, 0);
     }
-    
-    logger("mefs_statfs");
-    sfs->f_bsize  = 4096 ;
-    sfs->f_blocks = total_sz / sfs->f_bsize ;
-    sfs->f_bfree  = 0 ;
-    sfs->f_bavail = 0 ;
-    sfs->f_files  = n ;
-    sfs->f_ffree  = MAXFILES-n ;
+    return mefs_utimens(path, ts);
+}
 
-	return 0;
+/* RENAME_EXCHANGE and RENAME_NOREPLACE are not supported */
+static int mefs_rename3(const char *from, const char *to,
+                        unsigned int flags)
+{
+    if (flags) {
+        return -EINVAL ;
+    }
+    return mefs_rename(from, to);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+/*
+ * Copy between open files without going through the caller. Pages are
+ * shared copy-on-write when both offsets agree within a page, so large
+ * aligned copies cost no memory until one side is written to.
+ * See copy_file_range(2)
+ */
+static ssize_t mefs_copy_file_range(const char *path_in,
+                                    struct fuse_file_info *fi_in,
+                                    off_t off_in,
+                                    const char *path_out,
+                                    struct fuse_file_info *fi_out,
+                                    off_t off_out, size_t size, int flags)
+{
+    uint64_t t0 ;
+
+    LOG(LOG_FUSE, LVL_DEBUG,
+        "mefs_copy_file_range: fh %d off %d to fh %d off %d sz %d",
+        (int)fi_in->fh, (int)off_in, (int)fi_out->fh, (int)off_out,
+        (int)size);
+    if (flags) {
+        return -EINVAL ;
+    }
+    if ((fi_in->fh | fi_out->fh) & MEFS_VFH) {
+        return -EOPNOTSUPP ;
+    }
+    t0 = stats_start();
+    return stats_done(STATS_COPY, t0,
+                      filetable_icopy(&rootdir, fi_in->fh, off_in,
+                                      fi_out->fh, off_out, size));
 }
+#endif
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+/*
+ * Seek in an open file, with SEEK_DATA and SEEK_HOLE skipping over the
+ * holes of sparse files. See lseek(2)
+ */
+static off_t mefs_lseek(const char *path, off_t offset, int whence,
+                        struct fuse_file_info *fi)
+{
+    uint64_t t0 ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_lseek: fh %d off %d whence %d",
+        (int)fi->fh, (int)offset, whence);
+    if (fi->fh & MEFS_VFH) {
+        return -ENXIO ;
+    }
+    t0 = stats_start();
+    return stats_done(STATS_LSEEK, t0,
+                      filetable_ilseek(&rootdir, fi->fh, offset, whence));
+}
+#endif
+
+/*
+ * Link to the FUSE 3 API
+ */
+static struct fuse_operations mefs_oper = {
+    .init       = mefs_init,
+    .destroy    = mefs_destroy,
+    .getattr    = mefs_getattr3,
+    .readdir    = mefs_readdir,
+    .unlink     = mefs_unlink,
+    .utimens    = mefs_utimens3,
+    .rename     = mefs_rename3,
+    .truncate   = mefs_truncate3,
+    .create     = mefs_create,
+    .open       = mefs_open,
+    .release    = mefs_release,
+    .read       = mefs_read,
+    .write      = mefs_write,
+    .write_buf  = mefs_write_buf,
+    .fallocate  = mefs_fallocate,
+    .statfs     = mefs_statfs,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+    .copy_file_range = mefs_copy_file_range,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+    .lseek      = mefs_lseek,
+#endif
+};
+#else
 /*
  * Link to the FUSE API
  */
@@ -444,24 +869,37 @@ static struct fuse_operations mefs_oper = {
 	.truncate	= mefs_truncate,
     .create     = mefs_create,
 	.open		= mefs_open,
+	.release	= mefs_release,
 	.read		= mefs_read,
 	.write		= mefs_write,
+#if FUSE_VERSION >= 29
+    .write_buf  = mefs_write_buf,
+    .fallocate  = mefs_fallocate,
+#endif
+    .fgetattr   = mefs_fgetattr,
+    .ftruncate  = mefs_ftruncate,
 	.statfs		= mefs_statfs,
+#if FUSE_VERSION >= 28
+    /* Open files are addressed by handle, they may have no name left */
+    .flag_nullpath_ok = 1,
+#endif
 };
+#endif
 
 /*
  * Free all remaining memory pointers
  */
 void cleanup(void)
 {
-    int i ;
+    filetable_free(&rootdir);
+    slab_destroy();
+}
 
-    for (i=0 ; i<MAXFILES ; i++) {
-        if (rootdir[i].name!=NULL)
-            free(rootdir[i].name);
-        if (rootdir[i].data!=NULL)
-            free(rootdir[i].data);
-    }
+/* Print use, with the options only mefs takes */
+static void usage(const char * prog)
+{
+    mefs_usage(prog);
+    printf("    -o trace=file      write a Chrome trace at unmount\n");
 }
 
 /*
@@ -471,11 +909,12 @@ int main(int argc, char *argv[])
 {
     char * wd ;
     char * password ;
+    char   trace_name[PATH_MAX] ;
     int    i ;
     struct fuse_args args = FUSE_ARGS_INIT(0, 0);
 
     if (argc<3) {
-        printf("use: %s [fuseoptions] mountpoint container\n", argv[0]);
+        usage(argv[0]);
         return 1 ;
     }
     config.err=0 ;
@@ -485,15 +924,46 @@ int main(int argc, char *argv[])
     free(wd);
     argc-- ;
 
-    /* Force -s (single-threaded) and -f (foreground) for FUSE */
-    fuse_opt_add_arg(&args, "-s");
+    /* Force -f (foreground) for FUSE, requests are served by threads */
+    fuse_opt_add_arg(&args, argv[0]);
     fuse_opt_add_arg(&args, "-f");
+#ifndef MEFS_FUSE3
+    /*
+     * Delete open files for real instead of renaming them to
+     * .fuse_hidden*: the file table keeps their contents until release.
+     * FUSE 3 sets this in mefs_init().
+     */
+    fuse_opt_add_arg(&args, "-ohard_remove");
+#endif
     /* Register arguments for fuse_main */
     for (i=1 ; i<argc ; i++) {
         fuse_opt_add_arg(&args, argv[i]);
     }
-    fuse_opt_parse(&args, NULL, NULL, NULL);
-
+    if (mefs_parse_opts(&args)!=0) {
+        usage(argv[0]);
+        return 1 ;
+    }
+    fuse_opt_parse(&args, &config, mefs_opts, NULL);
+    /* SIGUSR1 raises log levels by one, SIGUSR2 restores them */
+    logger_signals();
+    if (config.trace_opt) {
+        /* Relative to where mefs was started, like the container */
+        wd = getcwd(NULL, 0);
+        snprintf(trace_name, sizeof(trace_name), "%s/%s",
+                 config.trace_opt[0]=='/' ? "" : wd, config.trace_opt);
+        free(wd);
+        if (trace_start(trace_name)!=0) {
+            fprintf(stderr, "cannot write trace to: %s\n", trace_name);
+            return 1 ;
+        }
+    }
+    if (!config.nocache) {
+        fuse_opt_insert_arg(&args, 1, MEFS_CACHE_OPTS);
+    }
+#ifdef MEFS_FUSE3
+    /* max_write, max_readahead and the like are applied in mefs_init() */
+    config.conn_opts = fuse_parse_conn_info_opts(&args);
+#endif
     /* Register cleanup function upon exit */
     atexit(cleanup);
 
@@ -0,0 +1,615 @@
+/*
+ * mefs on the FUSE low-level API
+ * Same filesystem as mefs.c, but the kernel addresses files by inode
+ * instead of by path: a name is resolved once by lookup, every later
+ * request goes straight to the file table slot.
+ * Node ids handed to the kernel are table slots offset by NODE_BASE, so
+ * that the root directory keeps FUSE_ROOT_ID. Reported inode numbers
+ * (st_ino) are the stable ones saved in the container.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "logger.h"
+#include "memfile.h"
+#include "filetable.h"
+#include "slab.h"
+#include "fslimits.h"
+#include "stats.h"
+#include "mefsopt.h"
+
+/*
+ * Mount options of mefs_ll only, see mefsopt.c for the others.
+ * The low-level API leaves caching to the filesystem, so the cache
+ * options of the high-level API are handled here:
+ * entry_timeout=s, attr_timeout=s, negative_timeout=s
+ *                  How long the kernel may keep names, attributes and
+ *                  missing names. Default to 60 seconds.
+ * kernel_cache, auto_cache
+ *                  Keep file pages across opens. On by default.
+ * Files can only be reached through the mount, so the kernel sees every
+ * change and keeps its caches up to date by itself: long timeouts are
+ * safe, and auto_cache has nothing to detect beyond what kernel_cache
+ * does.
+ * big_writes, max_write, max_read and max_readahead go to libfuse.
+ */
+static struct fuse_opt mefs_opts[] = {
+    MEFS_OPT("kernel_cache", kernel_cache),
+    MEFS_OPT("auto_cache", kernel_cache),
+    MEFS_OPT("entry_timeout=%lf", entry_timeout),
+    MEFS_OPT("attr_timeout=%lf", attr_timeout),
+    MEFS_OPT("negative_timeout=%lf", negative_timeout),
+    FUSE_OPT_END
+};
+
+/* Cache timeouts in seconds, by default and with nocache */
+#define CACHE_TIMEOUT   60.0
+#define NOCACHE_TIMEOUT 1.0
+
+static filetable rootdir ;
+static struct stat rootfs ;
+static struct fuse_session * session ;
+
+/* Node ids <-> file table slots */
+#define NODE_BASE       (FUSE_ROOT_ID+1)
+#define NODE_OF(i)      ((fuse_ino_t)(i) + NODE_BASE)
+#define SLOT_OF(ino)    ((int)((ino) - NODE_BASE))
+
+/*
+ * Names are stored with a leading slash, as paths of the high-level API
+ * Returns 0 or -ENAMETOOLONG.
+ */
+static int mefs_ll_path(char * path, const char * name)
+{
+    size_t len = strlen(name) ;
+
+    if (len+2 > MAXNAMESZ) {
+        return -ENAMETOOLONG ;
+    }
+    path[0] = '/' ;
+    memcpy(path+1, name, len+1);
+    return 0 ;
+}
+
+/* Fill in an entry for a file the kernel now holds a lookup on */
+static void mefs_ll_entry(struct fuse_entry_param * e, int i)
+{
+    e->ino           = NODE_OF(i) ;
+    /* Slots are reused, inode numbers are not */
+    e->generation    = e->attr.st_ino ;
+    e->attr_timeout  = config.attr_timeout ;
+    e->entry_timeout = config.entry_timeout ;
+}
+
+static void mefs_ll_init(void * userdata, struct fuse_conn_info * conn)
+{
+    time_t  now ;
+    int ret ;
+
+    LOG(LOG_FUSE, LVL_INFO, "mefs_ll_init");
+    /* Have large writes sent in one request rather than 4 KiB pages */
+#ifdef FUSE_CAP_BIG_WRITES
+    if (!config.nocache && (conn->capable & FUSE_CAP_BIG_WRITES)) {
+        conn->want |= FUSE_CAP_BIG_WRITES ;
+    }
+#endif
+    /* Move request data through pipes, see mefs_ll_read() */
+#ifdef FUSE_CAP_SPLICE_READ
+    conn->want |= conn->capable &
+                  (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE) ;
+#endif
+    LOG(LOG_CACHE, LVL_INFO,
+        "mefs_ll_init: protocol %u.%u max_write %u max_readahead %u",
+        conn->proto_major, conn->proto_minor,
+        conn->max_write, conn->max_readahead);
+    rootfs.st_mode      = S_IFDIR | 0755 ;
+    rootfs.st_ino       = FUSE_ROOT_ID ;
+    rootfs.st_nlink     = 2;
+    rootfs.st_uid       = getuid();
+    rootfs.st_gid       = getgid();
+    rootfs.st_blksize   = BLOCKSZ;
+    time(&now);
+    rootfs.st_mtime     = now ;
+    rootfs.st_ctime     = now ;
+
+    filetable_init(&rootdir);
+    filetable_limit(&rootdir, config.budget, config.maxfile);
+    ret =
+    memfile_readfiles(config.backup_filename,
+                      config.password,
+                      &rootdir);
+    if (ret<0) {
+        config.err++ ;
+        fuse_session_exit(session);
+    }
+    memfile_report(&rootdir);
+    stats_phase_log(0);
+    return ;
+}
+
+static void mefs_ll_destroy(void * userdata)
+{
+    LOG(LOG_FUSE, LVL_INFO, "mefs_ll_destroy");
+    memfile_report(&rootdir);
+    if (config.err<1) {
+        memfile_savefiles(config.backup_filename,
+                          config.password,
+                          &rootdir);
+        stats_phase_log(1);
+    }
+    return ;
+}
+
+static void mefs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                           const char * name)
+{
+    struct fuse_entry_param e ;
+    char    path[MAXNAMESZ] ;
+    int     i ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_lookup: %s", name);
+    if (parent!=FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return ;
+    }
+    if ((i = mefs_ll_path(path, name))<0) {
+        fuse_reply_err(req, -i);
+        return ;
+    }
+    memset(&e, 0, sizeof(e));
+    if ((i = filetable_lookup(&rootdir, path, &e.attr))<0) {
+        if (i==-ENOENT && config.negative_timeout>0) {
+            /* Let the kernel remember the name is missing */
+            e.entry_timeout = config.negative_timeout ;
+            fuse_reply_entry(req, &e);
+        } else {
+            fuse_reply_err(req, -i);
+        }
+        return ;
+    }
+    mefs_ll_entry(&e, i);
+    fuse_reply_entry(req, &e);
+}
+
+static void mefs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                           unsigned long nlookup)
+{
+    if (ino!=FUSE_ROOT_ID) {
+        filetable_unpin(&rootdir, SLOT_OF(ino), nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void mefs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info * fi)
+{
+    struct stat st ;
+
+    if (ino==FUSE_ROOT_ID) {
+        fuse_reply_attr(req, &rootfs, config.attr_timeout);
+        return ;
+    }
+    filetable_igetattr(&rootdir, SLOT_OF(ino), &st);
+    fuse_reply_attr(req, &st, config.attr_timeout);
+}
+
+/*
+ * Only size and modification time can be changed. See truncate(2) and
+ * utimensat(2). Mode and owner cannot, as with mefs which has no chmod
+ * or chown: fail with ENOSYS rather than pretend.
+ */
+static void mefs_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+                            struct stat * attr, int to_set,
+                            struct fuse_file_info * fi)
+{
+    struct stat st ;
+    int     err ;
+    int     i = SLOT_OF(ino) ;
+
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID |
+                  FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return ;
+    }
+    if (ino==FUSE_ROOT_ID) {
+        fuse_reply_attr(req, &rootfs, config.attr_timeout);
+        return ;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        LOG(LOG_FUSE, LVL_DEBUG, "mefs_ll_setattr: truncate sz %d",
+            (int)attr->st_size);
+        if ((err = filetable_itruncate(&rootdir, i, attr->st_size))<0) {
+            fuse_reply_err(req, -err);
+            return ;
+        }
+    }
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        filetable_itouch(&rootdir, i, time(NULL));
+    } else
+#endif
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+        filetable_itouch(&rootdir, i, attr->st_mtime);
+    }
+    filetable_igetattr(&rootdir, i, &st);
+    fuse_reply_attr(req, &st, config.attr_timeout);
+}
+
+static void mefs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info * fi)
+{
+    struct stat st ;
+    char *  buf ;
+    size_t  pos=0, ent ;
+    int     i ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_readdir: off %d", (int)off);
+    if (ino!=FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return ;
+    }
+    if ((buf = malloc(size))==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return ;
+    }
+    /* Only mode and inode are used by FUSE here */
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = S_IFDIR ;
+    st.st_ino  = FUSE_ROOT_ID ;
+    if (off < COOKIE_DOT) {
+        ent = fuse_add_direntry(req, buf, size, ".", &st, COOKIE_DOT);
+        pos += ent<=size ? ent : 0 ;
+    }
+    if (off < COOKIE_DOTDOT) {
+        ent = fuse_add_direntry(req, buf+pos, size-pos, "..", &st,
+                                COOKIE_DOTDOT);
+        pos += ent<=size-pos ? ent : 0 ;
+    }
+    i = off < COOKIE_SLOT(0) ? 0 : off - COOKIE_SLOT(0) + 1 ;
+    filetable_rdlock(&rootdir);
+    while (pos<size && (i = filetable_next(&rootdir, i))>=0) {
+        st.st_ino  = rootdir.ino[i] ;
+        st.st_mode = rootdir.mode[i] ;
+        ent = fuse_add_direntry(req, buf+pos, size-pos, rootdir.name[i]+1,
+                                &st, COOKIE_SLOT(i));
+        if (ent > size-pos) {
+            break ;
+        }
+        pos += ent ;
+        i++ ;
+    }
+    filetable_unlock(&rootdir);
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+static void mefs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                           const char * name)
+{
+    char    path[MAXNAMESZ] ;
+    int     err ;
+
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_ll_unlink %s", name);
+    if (parent!=FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return ;
+    }
+    if ((err = mefs_ll_path(path, name))==0) {
+        err = filetable_unlink(&rootdir, path);
+    }
+    fuse_reply_err(req, -err);
+}
+
+static void mefs_ll_rename(fuse_req_t req, fuse_ino_t parent,
+                           const char * name, fuse_ino_t newparent,
+                           const char * newname)
+{
+    char    from[MAXNAMESZ] ;
+    char    to[MAXNAMESZ] ;
+    int     err ;
+
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_ll_rename %s %s", name, newname);
+    if (parent!=FUSE_ROOT_ID || newparent!=FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return ;
+    }
+    if ((err = mefs_ll_path(from, name))==0 &&
+        (err = mefs_ll_path(to, newname))==0) {
+        err = filetable_rename(&rootdir, from, to);
+    }
+    fuse_reply_err(req, -err);
+}
+
+static void mefs_ll_create(fuse_req_t req, fuse_ino_t parent,
+                           const char * name, mode_t mode,
+                           struct fuse_file_info * fi)
+{
+    struct fuse_entry_param e ;
+    char    path[MAXNAMESZ] ;
+    int     i ;
+
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_ll_create %s", name);
+    if (parent!=FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return ;
+    }
+    if ((i = mefs_ll_path(path, name))<0) {
+        fuse_reply_err(req, -i);
+        return ;
+    }
+    memset(&e, 0, sizeof(e));
+    if ((i = filetable_icreate(&rootdir, path, mode, &e.attr))<0) {
+        fuse_reply_err(req, -i);
+        return ;
+    }
+    mefs_ll_entry(&e, i);
+    fi->keep_cache = config.kernel_cache ;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void mefs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info * fi)
+{
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_open");
+    if (ino==FUSE_ROOT_ID) {
+        fuse_reply_err(req, EISDIR);
+        return ;
+    }
+    fi->keep_cache = config.kernel_cache ;
+    fuse_reply_open(req, fi);
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * Reply straight from file contents: the reply is sent while the file
+ * is still locked, so no copy is needed on this side. With splice, the
+ * kernel copies the pages directly into the request.
+ */
+static void mefs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info * fi)
+{
+    struct fuse_bufvec *    bv ;
+    struct iovec *          iov ;
+    int     n ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_read: off %d sz %d",
+        (int)off, (int)size);
+    iov = malloc(EXTMAP_MAXIOV(size) * sizeof(struct iovec));
+    if (iov==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return ;
+    }
+    n = filetable_iread_map(&rootdir, SLOT_OF(ino), iov, size, off);
+    if (n<0) {
+        fuse_reply_err(req, -n);
+    } else {
+        if ((bv = mefs_bufvec(iov, n))==NULL) {
+            fuse_reply_err(req, ENOMEM);
+        } else {
+            fuse_reply_data(req, bv, 0);
+            free(bv);
+        }
+        filetable_iread_unmap(&rootdir, SLOT_OF(ino));
+    }
+    free(iov);
+}
+
+/*
+ * Write straight into file contents. When libfuse splices requests into
+ * a pipe, data goes from the pipe to the file pages in a single copy.
+ */
+static void mefs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec * src, off_t off,
+                              struct fuse_file_info * fi)
+{
+    struct fuse_bufvec *    dst ;
+    struct iovec *          iov ;
+    size_t  size = fuse_buf_size(src) ;
+    ssize_t ret ;
+    int     n ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_write_buf: off %d sz %d",
+        (int)off, (int)size);
+    iov = malloc(EXTMAP_MAXIOV(size) * sizeof(struct iovec));
+    if (iov==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return ;
+    }
+    n = filetable_iwrite_map(&rootdir, SLOT_OF(ino), iov, size, off);
+    if (n<0) {
+        fuse_reply_err(req, -n);
+        free(iov);
+        return ;
+    }
+    if ((dst = mefs_bufvec(iov, n))==NULL) {
+        ret = -ENOMEM ;
+    } else {
+        ret = fuse_buf_copy(dst, src, 0);
+        free(dst);
+    }
+    filetable_iwrite_unmap(&rootdir, SLOT_OF(ino), off, ret>0 ? ret : 0);
+    if (ret<0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, ret);
+    }
+    free(iov);
+}
+#else
+static void mefs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info * fi)
+{
+    char *  buf ;
+    int     n ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_read: off %d sz %d",
+        (int)off, (int)size);
+    if ((buf = malloc(size))==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return ;
+    }
+    n = filetable_iread(&rootdir, SLOT_OF(ino), buf, size, off);
+    if (n<0) {
+        fuse_reply_err(req, -n);
+    } else {
+        fuse_reply_buf(req, buf, n);
+    }
+    free(buf);
+}
+#endif
+
+static void mefs_ll_write(fuse_req_t req, fuse_ino_t ino, const char * buf,
+                          size_t size, off_t off,
+                          struct fuse_file_info * fi)
+{
+    int n ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_write: off %d sz %d",
+        (int)off, (int)size);
+    n = filetable_iwrite(&rootdir, SLOT_OF(ino), buf, size, off);
+    if (n<0) {
+        fuse_reply_err(req, -n);
+    } else {
+        fuse_reply_write(req, n);
+    }
+}
+
+#if FUSE_VERSION >= 29
+static void mefs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                              off_t offset, off_t length,
+                              struct fuse_file_info * fi)
+{
+    LOG(LOG_FUSE, LVL_DEBUG, "mefs_ll_fallocate: mode %d off %d len %d",
+        mode, (int)offset, (int)length);
+    fuse_reply_err(req, -filetable_ifallocate(&rootdir, SLOT_OF(ino), mode,
+                                              offset, length));
+}
+#endif
+
+static void mefs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs sfs ;
+
+    LOG(LOG_FUSE, LVL_TRACE, "mefs_ll_statfs");
+    mefs_statfs_fill(&rootdir, &sfs);
+    fuse_reply_statfs(req, &sfs);
+}
+
+/*
+ * Link to the FUSE low-level API
+ */
+static struct fuse_lowlevel_ops mefs_ll_oper = {
+    .init       = mefs_ll_init,
+    .destroy    = mefs_ll_destroy,
+    .lookup     = mefs_ll_lookup,
+    .forget     = mefs_ll_forget,
+    .getattr    = mefs_ll_getattr,
+    .setattr    = mefs_ll_setattr,
+    .readdir    = mefs_ll_readdir,
+    .unlink     = mefs_ll_unlink,
+    .rename     = mefs_ll_rename,
+    .create     = mefs_ll_create,
+    .open       = mefs_ll_open,
+    .read       = mefs_ll_read,
+    .write      = mefs_ll_write,
+#if FUSE_VERSION >= 29
+    .write_buf  = mefs_ll_write_buf,
+    .fallocate  = mefs_ll_fallocate,
+#endif
+    .statfs     = mefs_ll_statfs,
+};
+
+/*
+ * Free all remaining memory pointers
+ */
+static void cleanup(void)
+{
+    filetable_free(&rootdir);
+    slab_destroy();
+}
+
+/*
+ * ----- main()
+ */
+int main(int argc, char *argv[])
+{
+    struct fuse_args    args = FUSE_ARGS_INIT(0, 0);
+    struct fuse_chan *  ch ;
+    char *  mountpoint ;
+    char *  wd ;
+    int     i ;
+    int     err = -1 ;
+
+    if (argc<3) {
+        mefs_usage(argv[0]);
+        return 1 ;
+    }
+    config.err=0 ;
+    /* Grab container name */
+    wd = getcwd(NULL, 0);
+    sprintf(config.backup_filename, "%s/%s", wd, argv[argc-1]);
+    free(wd);
+    argc-- ;
+
+    for (i=0 ; i<argc ; i++) {
+        fuse_opt_add_arg(&args, argv[i]);
+    }
+    config.entry_timeout    = -1 ;
+    config.attr_timeout     = -1 ;
+    config.negative_timeout = -1 ;
+    if (mefs_parse_opts(&args)!=0) {
+        mefs_usage(argv[0]);
+        return 1 ;
+    }
+    fuse_opt_parse(&args, &config, mefs_opts, NULL);
+    logger_signals();
+    if (!config.nocache) {
+        config.kernel_cache = 1 ;
+    }
+    if (config.entry_timeout<0) {
+        config.entry_timeout = config.nocache ? NOCACHE_TIMEOUT :
+                                                CACHE_TIMEOUT ;
+    }
+    if (config.attr_timeout<0) {
+        config.attr_timeout = config.nocache ? NOCACHE_TIMEOUT :
+                                               CACHE_TIMEOUT ;
+    }
+    if (config.negative_timeout<0) {
+        config.negative_timeout = config.nocache ? 0 : CACHE_TIMEOUT ;
+    }
+    atexit(cleanup);
+    config.password = getpass("Password: ");
+
+    /* Always run in the foreground, requests are served by threads */
+    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL)!=-1 &&
+        (ch = fuse_mount(mountpoint, &args))!=NULL) {
+        session = fuse_lowlevel_new(&args,
+                                    &mefs_ll_oper,
+                                    sizeof(mefs_ll_oper),
+                                    NULL);
+        if (session) {
+            if (fuse_set_signal_handlers(session)!=-1) {
+                fuse_session_add_chan(session, ch);
+                err = fuse_session_loop_mt(session);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    return err ? 1 : 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */
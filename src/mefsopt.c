@@ -0,0 +1,157 @@
+/*
+ * Mount options, statfs and FUSE helpers, shared by mefs.c and
+ * mefs_ll.c
+ */
+#ifdef MEFS_FUSE3
+#define FUSE_USE_VERSION 31
+#else
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+#include "filetable.h"
+#include "fslimits.h"
+#include "mefsopt.h"
+
+mefs_config config ;
+
+/*
+ * mefs-specific mount options, passed with -o
+ * budget=size      Memory budget, e.g. 512M or 2G. Writes that would
+ *                  take memory used past it fail with ENOSPC, statfs
+ *                  reports free space against it. Defaults to the
+ *                  amount of physical memory.
+ * maxfile=size     Largest file size, past it writes fail with EFBIG.
+ *                  Defaults to MAXFILESZ.
+ * nocache          Mount with libfuse defaults: no kernel caching and
+ *                  4 KiB writes. Mostly useful for benchmarks.
+ * log=spec         Log levels, see logger_configure(): a level for all
+ *                  subsystems and/or subsys:level items joined with '+',
+ *                  e.g. log=debug or log=info+fuse:trace.
+ * Options only one front end takes are listed in its source.
+ */
+static struct fuse_opt mefs_common_opts[] = {
+    MEFS_OPT("budget=%s", budget_opt),
+    MEFS_OPT("maxfile=%s", maxfile_opt),
+    MEFS_OPT("nocache", nocache),
+    MEFS_OPT("log=%s", log_opt),
+    FUSE_OPT_END
+};
+
+/*
+ * Parse a size in bytes with an optional K, M or G suffix into sz.
+ * Returns 0, or -1 if s is not a number, has anything after the suffix,
+ * is zero or does not fit a file offset.
+ */
+static int parse_size(const char * s, uint64_t * sz)
+{
+    char *      end ;
+    uint64_t    n ;
+    int         shift = 0 ;
+
+    if (!isdigit((unsigned char)s[0])) {
+        return -1 ;
+    }
+    errno = 0 ;
+    n = strtoull(s, &end, 10);
+    if (errno) {
+        return -1 ;
+    }
+    switch (*end) {
+        case 'k': case 'K': shift = 10 ; end++ ; break ;
+        case 'm': case 'M': shift = 20 ; end++ ; break ;
+        case 'g': case 'G': shift = 30 ; end++ ; break ;
+        default: break ;
+    }
+    if (*end || n==0 || n > ((uint64_t)INT64_MAX >> shift)) {
+        return -1 ;
+    }
+    *sz = n << shift ;
+    return 0 ;
+}
+
+void mefs_usage(const char * prog)
+{
+    printf("use: %s [fuseoptions] mountpoint container\n", prog);
+    printf("mefs options:\n");
+    printf("    -o budget=size     memory budget (default: RAM size)\n");
+    printf("    -o maxfile=size    largest file (default: 100M)\n");
+    printf("    -o nocache         no kernel caching, small writes\n");
+    printf("    -o log=spec        log levels, e.g. info+fuse:trace\n");
+}
+
+int mefs_parse_opts(struct fuse_args * args)
+{
+    fuse_opt_parse(args, &config, mefs_common_opts, NULL);
+    if (config.log_opt && logger_configure(config.log_opt)!=0) {
+        fprintf(stderr, "invalid log levels: %s\n", config.log_opt);
+        return -1 ;
+    }
+    if (!config.budget_opt) {
+        config.budget = (uint64_t)sysconf(_SC_PHYS_PAGES) *
+                        (uint64_t)sysconf(_SC_PAGESIZE);
+    } else if (parse_size(config.budget_opt, &config.budget)!=0) {
+        fprintf(stderr, "invalid budget: %s\n", config.budget_opt);
+        return -1 ;
+    }
+    if (!config.maxfile_opt) {
+        config.maxfile = MAXFILESZ ;
+    } else if (parse_size(config.maxfile_opt, &config.maxfile)!=0) {
+        fprintf(stderr, "invalid maxfile: %s\n", config.maxfile_opt);
+        return -1 ;
+    }
+    return 0 ;
+}
+
+void mefs_statfs_fill(filetable * ft, struct statvfs * sfs)
+{
+    uint64_t nfiles, used ;
+
+    nfiles    = __atomic_load_n(&ft->nfiles, __ATOMIC_RELAXED);
+    used      = filetable_used(ft);
+
+    memset(sfs, 0, sizeof(struct statvfs));
+    sfs->f_bsize   = BLOCKSZ ;
+    sfs->f_frsize  = BLOCKSZ ;
+    sfs->f_blocks  = config.budget / BLOCKSZ ;
+    sfs->f_bfree   = used < config.budget ?
+                     (config.budget - used) / BLOCKSZ : 0 ;
+    sfs->f_bavail  = sfs->f_bfree ;
+    sfs->f_files   = MAXFILES ;
+    sfs->f_ffree   = MAXFILES - nfiles ;
+    sfs->f_favail  = sfs->f_ffree ;
+    sfs->f_namemax = MAXNAMESZ - 2 ;
+}
+
+#if FUSE_VERSION >= 29
+struct fuse_bufvec * mefs_bufvec(struct iovec * iov, int n)
+{
+    struct fuse_bufvec *    bv ;
+    int i ;
+
+    bv = calloc(1, sizeof(struct fuse_bufvec) + n*sizeof(struct fuse_buf));
+    if (!bv) {
+        return NULL ;
+    }
+    bv->count = n ;
+    for (i=0 ; i<n ; i++) {
+        bv->buf[i].mem  = iov[i].iov_base ;
+        bv->buf[i].size = iov[i].iov_len ;
+        bv->buf[i].fd   = -1 ;
+    }
+    return bv ;
+}
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
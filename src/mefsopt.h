@@ -0,0 +1,73 @@
+#ifndef _MEFSOPT_H_
+#define _MEFSOPT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/statvfs.h>
+
+#include "fslimits.h"
+#include "filetable.h"
+
+struct fuse_args ;
+struct fuse_conn_info_opts ;
+struct fuse_bufvec ;
+struct iovec ;
+
+/*
+ * Configuration of a mount, shared by the two front ends: mefs on the
+ * high-level FUSE API (mefs.c) and mefs_ll on the low-level one
+ * (mefs_ll.c). Each front end parses the options only it knows about
+ * into the fields marked for it.
+ */
+typedef struct mefs_config {
+    char backup_filename[MAXNAMESZ] ;
+    char * password ;
+    int    err ;
+    char * budget_opt ;
+    uint64_t budget ;
+    char * maxfile_opt ;
+    uint64_t maxfile ;
+    int    nocache ;
+    char * log_opt ;
+    /* mefs only */
+    char * trace_opt ;
+    struct fuse_conn_info_opts * conn_opts ;
+    /* mefs_ll only, see mefs_ll.c */
+    int    kernel_cache ;
+    double entry_timeout ;
+    double attr_timeout ;
+    double negative_timeout ;
+} mefs_config ;
+
+extern mefs_config config ;
+
+/* Entry of a fuse_opt table setting a mefs_config field */
+#define MEFS_OPT(t, p) { t, offsetof(struct mefs_config, p), 1 }
+
+/*
+ * Readdir offset cookies: 1 and 2 resume after '.' and '..', and slot i
+ * of the file table resumes with cookie i+3. Slots never move, so
+ * cookies stay valid when other files are created or deleted.
+ */
+#define COOKIE_DOT      1
+#define COOKIE_DOTDOT   2
+#define COOKIE_SLOT(i)  ((i)+3)
+
+/* Print use and the options both front ends take */
+void mefs_usage(const char * prog);
+
+/*
+ * Parse the options both front ends take out of args, set up log levels
+ * and work out the memory budget and largest file size.
+ * Returns 0, or -1 after printing what was wrong.
+ */
+int  mefs_parse_opts(struct fuse_args * args);
+
+/* Fill in statfs(2) results for the file table against the budget */
+void mefs_statfs_fill(filetable * ft, struct statvfs * sfs);
+
+/* Wrap memory segments in a bufvec, NULL if out of memory */
+struct fuse_bufvec * mefs_bufvec(struct iovec * iov, int n);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
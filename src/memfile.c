@@ -1,5 +1,8 @@
+/* For SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
@@ -7,14 +10,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
 
 #include "logger.h"
 #include "memfile.h"
+#include "filetable.h"
 #include "inode.h"
 #include "fslimits.h"
 #include "hmac.h"
 #include "cipher.h"
+#include "slab.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
 
 #define MAGIC_SZ    4
 #define CANARI_SZ   8
@@ -22,24 +31,777 @@
 /* Magic number for mefs serialization files */
 static char mefs_magic[] = {0xca, 0xfe, 0xfa, 0xce};
 
-/* This is version 1.0 */
-static char mefs_version[] = { 0x01, 0x00 };
+/*
+ * This is version 1.3
+ * 1.0 stores file contents as one contiguous block
+ * 1.1 stores file contents as a list of runs, holes are not stored
+ * 1.2 stores inode numbers so that they survive a remount
+ * 1.3 stores pages shared between files once, see RUN_SHARED
+ */
+static char mefs_version[] = { 0x01, 0x03 };
+
+/*
+ * A run whose length has this bit set holds no contents: it is followed
+ * by the number of an earlier file in the container, counting from 0,
+ * and the offset in that file of the same pages.
+ */
+#define RUN_SHARED  (1ULL<<63)
 
 /*
  * Initialize a memfile struct with blank fields
  */
-void memfile_init(memfile * mf, const char * name, mode_t mode)
+void memfile_init(memfile * mf)
 {
     if (!mf) {
         return ;
     }
 
     memset(mf, 0, sizeof(memfile));
-    mf->name = name ? strdup(name) : NULL ;
-    mf->sta.st_mode = S_IFREG | mode | 0600 ;
-    mf->sta.st_uid  = getuid() ;
-    mf->sta.st_gid  = getgid() ;
-    mf->sta.st_nlink = 1 ;
+    mf->store = MF_INLINE ;
+    return ;
+}
+
+/*
+ * Release contents, leave a blank slot behind
+ */
+void memfile_free(memfile * mf)
+{
+    if (!mf) {
+        return ;
+    }
+    if (mf->store==MF_BODY) {
+        slab_free(mf->body.ptr, mf->body.sz);
+    } else if (mf->store==MF_PAGES) {
+        extmap_free(&mf->ext);
+    }
+    memset(mf, 0, sizeof(memfile));
+    return ;
+}
+
+/* Bytes of memory held for file contents outside of the record */
+size_t memfile_allocated(memfile * mf)
+{
+    switch (mf->store) {
+        case MF_BODY:  return mf->body.sz ;
+        case MF_PAGES: return extmap_allocated(&mf->ext) ;
+        default:       return 0 ;
+    }
+}
+
+/*
+ * Upper bound of the memory that making room for size bytes at offset
+ * would add, as memfile_pwrite() or memfile_truncate() to offset do.
+ * A move to another tier counts in full, what it releases is not
+ * taken off.
+ */
+size_t memfile_need(memfile * mf, off_t offset, size_t size)
+{
+    off_t   end = offset + size ;
+    size_t  sz, held ;
+
+    if (mf->store==MF_INLINE && end <= INLINESZ) {
+        return 0 ;
+    }
+    if (mf->store!=MF_PAGES && end <= SMALLFILESZ) {
+        sz   = slab_size(end) ;
+        held = mf->store==MF_BODY ? mf->body.sz : 0 ;
+        return sz > held ? sz - held : 0 ;
+    }
+    if (mf->store==MF_PAGES) {
+        return extmap_missing(&mf->ext, offset, size);
+    }
+    /* Current contents move to pages, then the range is written */
+    sz = (mf->size + EXTENTSZ - 1) / EXTENTSZ * EXTENTSZ ;
+    if (size>0) {
+        sz += ((end - 1) / EXTENTSZ - offset / EXTENTSZ + 1) * EXTENTSZ ;
+    }
+    return sz ;
+}
+
+/*
+ * Contents move between storage tiers as files grow and shrink. In all
+ * tiers, bytes past the end of file are kept at zero so that growing a
+ * file never needs to clear anything.
+ *
+ * Move contents to a slab body able to hold sz bytes. Only valid for
+ * inline files or files already in a body.
+ */
+static int memfile_to_body(memfile * mf, size_t sz)
+{
+    uint8_t *   newbody ;
+    size_t      newsz ;
+
+    if (mf->store==MF_BODY && sz <= mf->body.sz) {
+        return 0 ;
+    }
+    newsz = slab_size(sz);
+    if ((newbody = slab_alloc(newsz))==NULL) {
+        return -1 ;
+    }
+    memset(newbody, 0, newsz);
+    if (mf->store==MF_BODY) {
+        memcpy(newbody, mf->body.ptr, mf->size);
+        slab_free(mf->body.ptr, mf->body.sz);
+    } else {
+        memcpy(newbody, mf->inl, mf->size);
+    }
+    mf->body.ptr = newbody ;
+    mf->body.sz  = newsz ;
+    mf->store    = MF_BODY ;
+    return 0 ;
+}
+
+/* Move contents over to pages once the file outgrows SMALLFILESZ */
+static int memfile_to_pages(memfile * mf)
+{
+    extmap      em ;
+    uint8_t *   src ;
+
+    if (mf->store==MF_PAGES) {
+        return 0 ;
+    }
+    src = mf->store==MF_BODY ? mf->body.ptr : mf->inl ;
+    extmap_init(&em);
+    if (extmap_write(&em, src, mf->size, 0)!=0) {
+        extmap_free(&em);
+        return -1 ;
+    }
+    if (mf->store==MF_BODY) {
+        slab_free(mf->body.ptr, mf->body.sz);
+    }
+    mf->ext   = em ;
+    mf->store = MF_PAGES ;
+    return 0 ;
+}
+
+/* Move contents back into the record, size must fit in INLINESZ */
+static void memfile_to_inline(memfile * mf, off_t size)
+{
+    uint8_t inl[INLINESZ] ;
+
+    memset(inl, 0, INLINESZ);
+    if (mf->store==MF_BODY) {
+        memcpy(inl, mf->body.ptr, size);
+        slab_free(mf->body.ptr, mf->body.sz);
+    } else if (mf->store==MF_PAGES) {
+        extmap_read(&mf->ext, inl, size, 0);
+        extmap_free(&mf->ext);
+    }
+    memcpy(mf->inl, inl, INLINESZ);
+    mf->store = MF_INLINE ;
+    return ;
+}
+
+/*
+ * Read up to size bytes from offset. Returns the number of bytes read,
+ * 0 at or past end of file.
+ */
+int memfile_pread(memfile * mf, char * buf, size_t size, off_t offset)
+{
+    if (!mf || !buf || offset<0) {
+        return -EINVAL ;
+    }
+    if (offset >= mf->size) {
+        return 0 ;
+    }
+    if ((offset+size) > mf->size) {
+        size = mf->size - offset ;
+    }
+    switch (mf->store) {
+        case MF_INLINE:
+        memcpy(buf, mf->inl + offset, size);
+        break ;
+        case MF_BODY:
+        memcpy(buf, mf->body.ptr + offset, size);
+        break ;
+        default:
+        extmap_read(&mf->ext, (uint8_t*)buf, size, offset);
+        break ;
+    }
+    return size ;
+}
+
+/*
+ * Write size bytes at offset, growing the file if needed. Writing past
+ * the end of file leaves a hole in between.
+ * Returns the number of bytes written or -ENOMEM.
+ */
+ssize_t memfile_pwrite(memfile * mf, const char * buf, size_t size,
+                       off_t offset)
+{
+    off_t   end ;
+
+    if (!mf || !buf || offset<0) {
+        return -EINVAL ;
+    }
+    if (size<1) {
+        return 0 ;
+    }
+    end = offset + size ;
+    if (mf->store==MF_INLINE && end <= INLINESZ) {
+        memcpy(mf->inl + offset, buf, size);
+    } else if (mf->store!=MF_PAGES && end <= SMALLFILESZ) {
+        if (memfile_to_body(mf, end)!=0) {
+            return -ENOMEM ;
+        }
+        memcpy(mf->body.ptr + offset, buf, size);
+    } else {
+        if (memfile_to_pages(mf)!=0 ||
+            extmap_write(&mf->ext, (const uint8_t*)buf, size, offset)!=0) {
+            return -ENOMEM ;
+        }
+    }
+    if (end > mf->size) {
+        mf->size = end ;
+    }
+    return size ;
+}
+
+/*
+ * Map up to size bytes from offset to memory segments for reading in
+ * place, see extmap_map(). iov must have room for EXTMAP_MAXIOV(size)
+ * segments. Returns the number of segments, 0 at or past end of file.
+ */
+int memfile_map_read(memfile * mf, struct iovec * iov, size_t size,
+                     off_t offset)
+{
+    if (!mf || !iov || offset<0) {
+        return -EINVAL ;
+    }
+    if (offset >= mf->size) {
+        return 0 ;
+    }
+    if ((offset+size) > mf->size) {
+        size = mf->size - offset ;
+    }
+    switch (mf->store) {
+        case MF_INLINE:
+        iov->iov_base = mf->inl + offset ;
+        iov->iov_len  = size ;
+        return 1 ;
+        case MF_BODY:
+        iov->iov_base = mf->body.ptr + offset ;
+        iov->iov_len  = size ;
+        return 1 ;
+        default:
+        return extmap_map(&mf->ext, iov, size, offset, 0);
+    }
+}
+
+/*
+ * Make room for size bytes at offset, as memfile_pwrite() would, and
+ * map them to memory segments to be written in place. The file size is
+ * only updated by memfile_map_done(), with the end of what was actually
+ * written. Returns the number of segments or -ENOMEM.
+ */
+int memfile_map_write(memfile * mf, struct iovec * iov, size_t size,
+                      off_t offset)
+{
+    off_t   end ;
+    int     n ;
+
+    if (!mf || !iov || offset<0) {
+        return -EINVAL ;
+    }
+    if (size<1) {
+        return 0 ;
+    }
+    end = offset + size ;
+    if (mf->store==MF_INLINE && end <= INLINESZ) {
+        iov->iov_base = mf->inl + offset ;
+    } else if (mf->store!=MF_PAGES && end <= SMALLFILESZ) {
+        if (memfile_to_body(mf, end)!=0) {
+            return -ENOMEM ;
+        }
+        iov->iov_base = mf->body.ptr + offset ;
+    } else {
+        if (memfile_to_pages(mf)!=0 ||
+            (n = extmap_map(&mf->ext, iov, size, offset, 1))<0) {
+            return -ENOMEM ;
+        }
+        return n ;
+    }
+    iov->iov_len = size ;
+    return 1 ;
+}
+
+/* Grow the file to end after writing in place, see memfile_map_write() */
+void memfile_map_done(memfile * mf, off_t end)
+{
+    if (end > mf->size) {
+        mf->size = end ;
+    }
+    return ;
+}
+
+/*
+ * Copy size bytes from offset soff of src to offset doff of dst. Within
+ * a single file the two ranges must not overlap. When both sides are
+ * aligned the same way within a page, whole pages are shared
+ * copy-on-write instead of copied: see extmap_share(). Copying stops at
+ * the end of src.
+ * Returns the number of bytes copied, or -ENOMEM if nothing could be.
+ */
+ssize_t memfile_copy(memfile * dst, off_t doff, memfile * src, off_t soff,
+                     size_t size)
+{
+    uint8_t     page[EXTENTSZ] ;
+    size_t      done, chunk, head ;
+    ssize_t     ret ;
+
+    if (!dst || !src || doff<0 || soff<0) {
+        return -EINVAL ;
+    }
+    if (soff >= src->size) {
+        return 0 ;
+    }
+    if ((soff+size) > src->size) {
+        size = src->size - soff ;
+    }
+    done = 0 ;
+    while (done < size) {
+        head = EXTENTSZ - (soff + done) % EXTENTSZ ;
+        if (src->store==MF_PAGES && head==EXTENTSZ &&
+            (doff + done) % EXTENTSZ==0 && size - done >= EXTENTSZ) {
+            chunk = (size - done) & ~(size_t)(EXTENTSZ-1) ;
+            if (memfile_to_pages(dst)!=0 ||
+                extmap_share(&dst->ext, doff + done,
+                             &src->ext, soff + done, chunk)!=0) {
+                return done>0 ? (ssize_t)done : -ENOMEM ;
+            }
+            memfile_map_done(dst, doff + done + chunk);
+        } else {
+            chunk = size - done < head ? size - done : head ;
+            memfile_pread(src, (char*)page, chunk, soff + done);
+            if ((ret = memfile_pwrite(dst, (char*)page, chunk,
+                                      doff + done))<0) {
+                return done>0 ? (ssize_t)done : ret ;
+            }
+        }
+        done += chunk ;
+    }
+    return size ;
+}
+
+/*
+ * Truncate or extend a file. Extending only creates a hole, shrinking
+ * releases memory. Contents move to a lower tier when they fit.
+ */
+int memfile_truncate(memfile * mf, off_t size)
+{
+    off_t   keep ;
+
+    if (!mf || size<0) {
+        return -EINVAL ;
+    }
+    keep = size < mf->size ? size : mf->size ;
+    if (size <= INLINESZ) {
+        if (mf->store!=MF_INLINE) {
+            memfile_to_inline(mf, keep);
+        }
+        memset(mf->inl + keep, 0, INLINESZ - keep);
+    } else if (size <= SMALLFILESZ && mf->store!=MF_PAGES) {
+        if (memfile_to_body(mf, size)!=0) {
+            return -ENOMEM ;
+        }
+        memset(mf->body.ptr + keep, 0, mf->body.sz - keep);
+    } else {
+        if (memfile_to_pages(mf)!=0 ||
+            extmap_truncate(&mf->ext, size)!=0) {
+            return -ENOMEM ;
+        }
+    }
+    mf->size = size ;
+    return 0 ;
+}
+
+/*
+ * fallocate(2) on a memfile. Allocating makes room in the tier the range
+ * fits in, pages included, so that writes there allocate nothing more.
+ * FALLOC_FL_KEEP_SIZE leaves the file size alone,
+ * FALLOC_FL_PUNCH_HOLE zeroes the range and releases the pages it
+ * covers entirely, FALLOC_FL_ZERO_RANGE zeroes it and keeps it
+ * allocated. Returns 0 or a negated errno.
+ */
+int memfile_fallocate(memfile * mf, int mode, off_t offset, off_t len)
+{
+    off_t   end ;
+    off_t   lim ;
+
+    if (!mf || offset<0 || len<1) {
+        return -EINVAL ;
+    }
+    end = offset + len ;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (mode!=(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+            return -EOPNOTSUPP ;
+        }
+        switch (mf->store) {
+            case MF_INLINE:
+            lim = end < INLINESZ ? end : INLINESZ ;
+            if (offset < lim) {
+                memset(mf->inl + offset, 0, lim - offset);
+            }
+            return 0 ;
+            case MF_BODY:
+            lim = end < (off_t)mf->body.sz ? end : (off_t)mf->body.sz ;
+            if (offset < lim) {
+                memset(mf->body.ptr + offset, 0, lim - offset);
+            }
+            return 0 ;
+            default:
+            return extmap_clear(&mf->ext, offset, len, 0)!=0 ? -ENOMEM : 0 ;
+        }
+    }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP ;
+    }
+    if (mf->store==MF_INLINE && end <= INLINESZ) {
+        if (mode & FALLOC_FL_ZERO_RANGE) {
+            memset(mf->inl + offset, 0, len);
+        }
+    } else if (mf->store!=MF_PAGES && end <= SMALLFILESZ) {
+        if (memfile_to_body(mf, end)!=0) {
+            return -ENOMEM ;
+        }
+        if (mode & FALLOC_FL_ZERO_RANGE) {
+            memset(mf->body.ptr + offset, 0, len);
+        }
+    } else {
+        if (memfile_to_pages(mf)!=0) {
+            return -ENOMEM ;
+        }
+        if (mode & FALLOC_FL_ZERO_RANGE) {
+            if (extmap_clear(&mf->ext, offset, len, 1)!=0) {
+                return -ENOMEM ;
+            }
+        } else if (extmap_alloc(&mf->ext, offset, len)!=0) {
+            return -ENOMEM ;
+        }
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > mf->size) {
+        mf->size = end ;
+    }
+    return 0 ;
+}
+
+/*
+ * lseek(2) on a memfile, with support for SEEK_DATA and SEEK_HOLE.
+ * Returns the new offset or a negated errno.
+ */
+off_t memfile_lseek(memfile * mf, off_t offset, int whence)
+{
+    off_t   pos ;
+
+    if (!mf) {
+        return -EINVAL ;
+    }
+    switch (whence) {
+        case SEEK_SET: pos = offset ; break ;
+        case SEEK_END: pos = mf->size + offset ; break ;
+#ifdef SEEK_DATA
+        case SEEK_DATA:
+        if (mf->store!=MF_PAGES) {
+            pos = offset < mf->size ? offset : -1 ;
+        } else {
+            pos = extmap_seek_data(&mf->ext, offset, mf->size);
+        }
+        return pos<0 ? -ENXIO : pos ;
+        case SEEK_HOLE:
+        if (mf->store!=MF_PAGES) {
+            pos = offset < mf->size ? mf->size : -1 ;
+        } else {
+            pos = extmap_seek_hole(&mf->ext, offset, mf->size);
+        }
+        return pos<0 ? -ENXIO : pos ;
+#endif
+        default: return -EINVAL ;
+    }
+    return pos<0 ? -EINVAL : pos ;
+}
+
+/*
+ * Find the next run of stored data at or after offset. Returns the run
+ * offset and sets *len, or -1 when only holes are left.
+ */
+static off_t memfile_next_run(memfile * mf, off_t offset, size_t * len)
+{
+    if (mf->store!=MF_PAGES) {
+        if (offset >= mf->size) {
+            return -1 ;
+        }
+        *len = mf->size - offset ;
+        return offset ;
+    }
+    return extmap_next_run(&mf->ext, offset, mf->size, len);
+}
+
+/*
+ * Shared pages already written to a container, with the file and
+ * offset they were first written at
+ */
+typedef struct {
+    const uint8_t * page ;
+    uint64_t        file ;
+    uint64_t        off ;
+} saved_page ;
+
+typedef struct {
+    saved_page *    tab ;
+    size_t          cap ;   /* Power of two, 0 if nothing is shared */
+} saved_map ;
+
+/* Size the map for all shared pages, there are at most extmap_shared() */
+static int saved_init(saved_map * sm)
+{
+    size_t  want = 2 * (extmap_shared() / EXTENTSZ) ;
+
+    sm->tab = NULL ;
+    sm->cap = 0 ;
+    if (want<1) {
+        return 0 ;
+    }
+    for (sm->cap=64 ; sm->cap < want ; sm->cap *= 2) ;
+    if ((sm->tab = calloc(sm->cap, sizeof(saved_page)))==NULL) {
+        sm->cap = 0 ;
+        return -1 ;
+    }
+    return 0 ;
+}
+
+static saved_page * saved_slot(saved_map * sm, const uint8_t * page)
+{
+    size_t  i ;
+
+    i = (size_t)(((uint64_t)(uintptr_t)page * 0x9e3779b97f4a7c15ULL)
+                 >> 32) & (sm->cap - 1) ;
+    while (sm->tab[i].page && sm->tab[i].page!=page) {
+        i = (i+1) & (sm->cap - 1) ;
+    }
+    return sm->tab+i ;
+}
+
+static saved_page * saved_find(saved_map * sm, const uint8_t * page)
+{
+    saved_page * e ;
+
+    if (sm->cap==0 || page==NULL) {
+        return NULL ;
+    }
+    e = saved_slot(sm, page);
+    return e->page ? e : NULL ;
+}
+
+/* Remember the shared pages of file number n, once it is written */
+static void saved_add(saved_map * sm, memfile * mf, uint64_t n)
+{
+    saved_page *    e ;
+    size_t          i ;
+
+    if (sm->cap==0 || mf->store!=MF_PAGES) {
+        return ;
+    }
+    for (i=0 ; i<mf->ext.nslots ; i++) {
+        if (mf->ext.page[i]==NULL || extmap_refs(mf->ext.page[i])<2) {
+            continue ;
+        }
+        e = saved_slot(sm, mf->ext.page[i]);
+        if (e->page==NULL) {
+            e->page = mf->ext.page[i] ;
+            e->file = n ;
+            e->off  = (uint64_t)i * EXTENTSZ ;
+        }
+    }
+    return ;
+}
+
+/*
+ * Find the next segment to write out at or after offset: a run of data,
+ * or part of a run made of pages already written for an earlier file,
+ * consecutive in that file. Sets *len and *ref, the earlier location of
+ * the first page or NULL for data. Returns the segment offset, or -1
+ * when only holes are left.
+ */
+static off_t memfile_next_seg(memfile * mf, off_t offset, size_t * len,
+                              saved_map * sm, saved_page ** ref)
+{
+    saved_page *    e ;
+    off_t           start ;
+    size_t          i, j, n ;
+
+    *ref = NULL ;
+    start = memfile_next_run(mf, offset, len);
+    if (start<0 || mf->store!=MF_PAGES || sm->cap==0) {
+        return start ;
+    }
+    i = start / EXTENTSZ ;
+    n = (*len + EXTENTSZ - 1) / EXTENTSZ ;
+    *ref = saved_find(sm, mf->ext.page[i]);
+    for (j=1 ; j<n ; j++) {
+        e = saved_find(sm, mf->ext.page[i+j]);
+        if (*ref ? (!e || e->file!=(*ref)->file ||
+                    e->off!=(*ref)->off + j * EXTENTSZ) : e!=NULL) {
+            break ;
+        }
+    }
+    if (j<n || *ref) {
+        *len = j * EXTENTSZ ;
+    }
+    return start ;
+}
+
+/* Approximate cost of malloc(sz) with glibc: 8-byte header, 16-byte align */
+static size_t malloc_cost(size_t sz)
+{
+    if (sz<1) {
+        return 0 ;
+    }
+    sz = (sz + 8 + 15) & ~(size_t)15 ;
+    return sz < 32 ? 32 : sz ;
+}
+
+/*
+ * Log where memory goes, and memory used per file compared with the
+ * former layout, where each file held a full struct stat, a strdup'ed
+ * name and a malloc'ed body.
+ */
+void memfile_report(filetable * ft)
+{
+    int     i, n=0 ;
+    size_t  now_sz=0 ;
+    size_t  old_sz=0 ;
+    memfile * mf ;
+    stats_memory    m ;
+
+    for (i=0 ; i<MAXFILES ; i++) {
+        if (ft->hash[i]==0) {
+            continue ;
+        }
+        mf = ft->rec+i ;
+        n++ ;
+        now_sz += sizeof(memfile)
+                + sizeof(ft->hash[0]) + sizeof(ft->size[0])
+                + sizeof(ft->mtime[0]) + sizeof(ft->ino[0])
+                + sizeof(ft->mode[0]) + sizeof(ft->ctime[0])
+                + sizeof(ft->alloc[0]) + sizeof(ft->seq[0])
+                + sizeof(ft->name[0])
+                + slab_size(strlen(ft->name[i])+1)
+                + memfile_allocated(mf)
+                + (mf->store==MF_PAGES ?
+                   malloc_cost(mf->ext.nslots * sizeof(uint8_t*)) : 0) ;
+        old_sz += sizeof(struct stat) + 2 * sizeof(void*)
+                + malloc_cost(strlen(ft->name[i])+1)
+                + malloc_cost(mf->size) ;
+    }
+    if (n<1) {
+        return ;
+    }
+    LOG(LOG_CACHE, LVL_INFO,
+        "memory: %d files, %lld bytes/file, was %lld bytes/file, "
+        "saving %lld bytes/file",
+        n,
+        (long long)(now_sz/n),
+        (long long)(old_sz/n),
+        ((long long)old_sz-(long long)now_sz)/n);
+    LOG(LOG_CACHE, LVL_INFO,
+        "memory: slab arena holds %d bytes, %d in use",
+        (int)slab_held(),
+        (int)slab_used());
+    filetable_memory(ft, &m);
+    LOG(LOG_CACHE, LVL_INFO,
+        "memory: %llu bytes in %llu files, %llu inline, %llu in bodies "
+        "and %llu in pages, slack %lld",
+        (unsigned long long)m.size, (unsigned long long)m.files,
+        (unsigned long long)m.inlined,
+        (unsigned long long)m.bodies, (unsigned long long)m.pages,
+        (long long)(m.bodies + m.pages) -
+        (long long)(m.size - m.inlined));
+    LOG(LOG_CACHE, LVL_INFO,
+        "memory: names %llu, records %llu, page tables %llu bytes, "
+        "%llu pages, %llu page tables, %llu slab objects in %llu chunks",
+        (unsigned long long)m.names, (unsigned long long)m.records,
+        (unsigned long long)m.tables, (unsigned long long)m.npages,
+        (unsigned long long)m.ntables, (unsigned long long)m.nobjects,
+        (unsigned long long)m.nchunks);
+    return ;
+}
+
+/*
+ * Copy sz bytes from *cur to dst if not NULL and move past them.
+ * Returns 0, or -1 if fewer than sz bytes are left before end.
+ */
+static int take(char ** cur, char * end, void * dst, uint64_t sz)
+{
+    ptrdiff_t   left = end - *cur ;
+
+    if (left<0 || (uint64_t)left < sz) {
+        return -1 ;
+    }
+    if (dst) {
+        memcpy(dst, *cur, sz);
+    }
+    *cur += sz ;
+    return 0 ;
+}
+
+/*
+ * Walk decrypted file records once to find out how many names and small
+ * bodies of each size class the container holds, and reserve slab room
+ * for all of them in one go. Stops at the first record cut short,
+ * readfiles() reports it.
+ */
+static void reserve_slabs(char * cur, char * end, int minor)
+{
+    size_t      want[SLAB_NCLASSES] ;
+    uint64_t    u1, nruns, roff, rlen, j ;
+    size_t      sz ;
+    int         c ;
+
+    memset(want, 0, sizeof(want));
+    while (cur < end) {
+        sz = strnlen(cur, end - cur < MAXNAMESZ ? end - cur : MAXNAMESZ) ;
+        if (take(&cur, end, NULL, MAXNAMESZ)!=0 ||
+            take(&cur, end, &u1, sizeof(uint64_t))!=0 ||
+            take(&cur, end, NULL,
+                 (minor<2 ? 2 : 3) * sizeof(uint64_t))!=0) {
+            break ;
+        }
+        for (c=0 ; (SLAB_MINSZ<<c) < sz + 1 ; c++) ;
+        want[c]++ ;
+        if (u1>INLINESZ && u1<=SMALLFILESZ) {
+            for (c=0 ; (SLAB_MINSZ<<c) < u1 ; c++) ;
+            want[c]++ ;
+        }
+        if (minor==0) {
+            if (take(&cur, end, NULL, u1)!=0) {
+                break ;
+            }
+            continue ;
+        }
+        if (take(&cur, end, &nruns, sizeof(uint64_t))!=0) {
+            break ;
+        }
+        for (j=0 ; j<nruns ; j++) {
+            if (take(&cur, end, &roff, sizeof(uint64_t))!=0 ||
+                take(&cur, end, &rlen, sizeof(uint64_t))!=0) {
+                break ;
+            }
+            if (minor>=3 && (rlen & RUN_SHARED)) {
+                rlen = 2 * sizeof(uint64_t) ;
+            }
+            if (take(&cur, end, NULL, rlen)!=0) {
+                break ;
+            }
+        }
+        if (j<nruns) {
+            break ;
+        }
+    }
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        if (want[c]>0) {
+            slab_reserve(SLAB_MINSZ<<c, want[c]);
+        }
+    }
     return ;
 }
 
@@ -51,35 +813,46 @@ void memfile_init(memfile * mf, const char * name, mode_t mode)
  * -1   File error during reading
  * -2   Wrong password in input
  */
-int memfile_readfiles(char * filename, char * password, memfile * root)
+static int readfiles(char * filename, char * password, filetable * ft)
 {
     char *  buf ;
     char *  cur ;
+    char *  end ;
+    char *  data ;
     int     fd ;
     int     i ;
+    int     bad = 0 ;
+    int     failed = 0 ;
     struct stat fileinfo ;
 
     uint8_t nonce[NONCE_SZ];
     uint8_t key[KEY_SZ];
 
-    uint64_t    u1, u2, u3 ;
+    uint64_t    u1, u2, u3, ino ;
+    uint64_t    nruns, roff, rlen, sfile, soff, j ;
+    int         minor ;
+    int         loaded[MAXFILES] ;
+    int         nloaded = 0 ;
+    stats_mark  m0, m ;
     size_t      header_sz ;
     size_t      payload_sz ;
     char        fname[MAXNAMESZ];
 
+    stats_mark_now(&m0);
+    m = m0 ;
     header_sz = MAGIC_SZ + 2 + NONCE_SZ + CANARI_SZ ;
     /* Find out file size in bytes */
     if (stat(filename, &fileinfo)!=0) {
-        logger("no such file: %s", filename);
+        LOG(LOG_CONTAINER, LVL_INFO, "no such file: %s", filename);
         return 1 ;
     }
     if (fileinfo.st_size < header_sz) {
-        logger("not a container: ", filename);
+        LOG(LOG_CONTAINER, LVL_ERROR, "not a container: %s", filename);
         return -1 ;
     }
     /* Map input file */
     if ((fd=open(filename, O_RDONLY))==-1) {
-        logger("cannot open: %s", filename);
+        LOG(LOG_CONTAINER, LVL_ERROR, "cannot open: %s", filename);
         return -1 ;
     }
     buf = (char*)mmap(0,
@@ -90,9 +863,10 @@ int memfile_readfiles(char * filename, char * password, memfile * root)
                       0);
     close(fd);
     if (buf==(char*)-1) {
-        logger("cannot map: %s", filename);
+        LOG(LOG_CONTAINER, LVL_ERROR, "cannot map: %s", filename);
         return -1;
     }
+    stats_phase(STATS_LOAD_MAP, &m, fileinfo.st_size);
     cur = buf ;
     payload_sz = fileinfo.st_size - header_sz ;
     /*
@@ -105,25 +879,28 @@ int memfile_readfiles(char * filename, char * password, memfile * root)
     /* Check magic number */
     for (i=0 ; i<MAGIC_SZ ; i++) {
         if (cur[i]!=mefs_magic[i]) {
-            logger("not a container: ", filename);
+            LOG(LOG_CONTAINER, LVL_ERROR, "not a container: %s", filename);
             munmap(buf, fileinfo.st_size);
             return -1 ;
         }
     }
     cur += MAGIC_SZ ;
-    /* Read version number */
+    /* Read version number, all minor versions up to ours are supported */
     if (cur[0]!=mefs_version[0] ||
-        cur[1]!=mefs_version[1]) {
-        logger("unsupported version for: ", filename);
+        cur[1]>mefs_version[1]) {
+        LOG(LOG_CONTAINER, LVL_ERROR, "unsupported version for: %s",
+            filename);
         munmap(buf, fileinfo.st_size);
         return -1 ;
     }
+    minor = cur[1] ;
     cur+=2 ;
 
     /* Copy nonce for later use */
     memcpy(nonce, cur, NONCE_SZ);
     cur += NONCE_SZ ;
     /* Derive key from password */
+    stats_mark_now(&m);
     derive_key(password,
                strlen(password),
                nonce,
@@ -131,21 +908,29 @@ int memfile_readfiles(char * filename, char * password, memfile * root)
                key,
                KEY_SZ,
                20000);
+    stats_phase(STATS_LOAD_KEY, &m, 0);
     /* Decrypt everything starting from CANARI, using nonce and key */
+    stats_mark_now(&m);
     stream_cipher(cur,
                   fileinfo.st_size-(MAGIC_SZ+2+NONCE_SZ),
                   0,
                   key,
                   nonce);
+    stats_phase(STATS_LOAD_DECRYPT, &m,
+                fileinfo.st_size-(MAGIC_SZ+2+NONCE_SZ));
     /* Test canari has expected pattern: 0xaaaa...aa */
     for (i=0 ; i<CANARI_SZ ; i++) {
         if ((unsigned char)cur[i]!=0xaa) {
-            logger("wrong password for container: %s", filename);
+            LOG(LOG_CRYPTO, LVL_ERROR, "wrong password for container: %s",
+                filename);
             munmap(buf, fileinfo.st_size);
             return -2 ;
         }
     }
     cur+=CANARI_SZ ;
+    stats_mark_now(&m);
+    reserve_slabs(cur, buf + fileinfo.st_size, minor);
+    stats_phase(STATS_LOAD_RESERVE, &m, 0);
 
     /* Read files one by one */
     /*
@@ -153,39 +938,155 @@ int memfile_readfiles(char * filename, char * password, memfile * root)
      * filesize on a 64 big-endian unsigned int
      * ctime    on a 64-big-endian unsigned int
      * mtime    on a 64-big-endian unsigned int
+     * Version 1.2: inode number on a 64-bit int
+     * Version 1.0: followed by filesize bytes of contents
+     * Version 1.1: followed by a number of runs on a 64-bit int, then
+     * for each run its offset and length on 64-bit ints and its contents
+     * Version 1.3: or for a shared run, see RUN_SHARED, the number and
+     * offset of the file holding its contents on 64-bit ints
      */
-    i=0 ;
-    while (1) {
-        memcpy(fname, cur, MAXNAMESZ);
-        cur+=MAXNAMESZ;
-        memcpy(&u1, cur, sizeof(uint64_t));
-        cur+=sizeof(uint64_t);
-        memcpy(&u2, cur, sizeof(uint64_t));
-        cur+=sizeof(uint64_t);
-        memcpy(&u3, cur, sizeof(uint64_t));
-        cur+=sizeof(uint64_t);
-
-        root[i].name = strdup(fname);
-        root[i].sta.st_ino = inode_next();
-        root[i].sta.st_size     = u1 ;
-        root[i].sta.st_ctime    = u2 ;
-        root[i].sta.st_mtime    = u3 ;
-
-        root[i].data = malloc(u1);
-        memcpy(root[i].data, cur, u1);
-        cur+=u1 ;
-        if ((cur-buf) >= fileinfo.st_size)
+    stats_mark_now(&m);
+    end = buf + fileinfo.st_size ;
+    while (cur < end) {
+        ino = 0 ;
+        if (take(&cur, end, fname, MAXNAMESZ)!=0 ||
+            take(&cur, end, &u1, sizeof(uint64_t))!=0 ||
+            take(&cur, end, &u2, sizeof(uint64_t))!=0 ||
+            take(&cur, end, &u3, sizeof(uint64_t))!=0 ||
+            (minor>=2 && take(&cur, end, &ino, sizeof(uint64_t))!=0)) {
+            bad = 1 ;
+            break ;
+        }
+        fname[MAXNAMESZ-1] = 0 ;
+
+        if ((i = filetable_slot_create(ft, fname, 0, ino))<0) {
+            LOG(LOG_CONTAINER, LVL_ERROR, "cannot load %s: table full",
+                fname);
+            failed = 1 ;
+            break ;
+        }
+        ft->ctime[i] = u2 ;
+        loaded[nloaded++] = i ;
+
+        nruns = 1 ;
+        if (minor==0) {
+            data = cur ;
+            if (take(&cur, end, NULL, u1)!=0) {
+                bad = 1 ;
+                break ;
+            }
+            if (filetable_slot_write(ft, i, data, u1, 0)<0) {
+                failed = 1 ;
+                break ;
+            }
+        } else {
+            if (take(&cur, end, &nruns, sizeof(uint64_t))!=0) {
+                bad = 1 ;
+                break ;
+            }
+            for (j=0 ; j<nruns ; j++) {
+                if (take(&cur, end, &roff, sizeof(uint64_t))!=0 ||
+                    take(&cur, end, &rlen, sizeof(uint64_t))!=0) {
+                    bad = 1 ;
+                    break ;
+                }
+                if (minor>=3 && (rlen & RUN_SHARED)) {
+                    if (take(&cur, end, &sfile, sizeof(uint64_t))!=0 ||
+                        take(&cur, end, &soff, sizeof(uint64_t))!=0) {
+                        bad = 1 ;
+                        break ;
+                    }
+                    /* Pages can only be shared with an earlier file */
+                    if (sfile >= (uint64_t)(nloaded-1)) {
+                        bad = 1 ;
+                        break ;
+                    }
+                    if (filetable_slot_copy(ft, i, roff, loaded[sfile],
+                                            soff, rlen & ~RUN_SHARED)<0) {
+                        failed = 1 ;
+                        break ;
+                    }
+                    continue ;
+                }
+                data = cur ;
+                if (take(&cur, end, NULL, rlen)!=0) {
+                    bad = 1 ;
+                    break ;
+                }
+                if (filetable_slot_write(ft, i, data, rlen, roff)<0) {
+                    failed = 1 ;
+                    break ;
+                }
+            }
+            if (bad || failed) {
+                break ;
+            }
+        }
+        /* Set size last: there may be a hole at the end */
+        if (filetable_slot_truncate(ft, i, u1)<0) {
+            failed = 1 ;
             break ;
-        i++ ;
+        }
+        ft->mtime[i] = u3 ;
+        PROBE3(load__file, fname, u1, nruns);
     }
+    if (bad || failed) {
+        /* A partial load must not be saved over the container */
+        LOG(LOG_CONTAINER, LVL_ERROR, bad ? "corrupt container: %s" :
+            "cannot load files from: %s", filename);
+        munmap(buf, fileinfo.st_size);
+        return -1 ;
+    }
+    stats_phase(STATS_LOAD_FILES, &m, payload_sz);
+    stats_mark_now(&m);
     munmap(buf, fileinfo.st_size);
+    stats_phase(STATS_LOAD_UNMAP, &m, fileinfo.st_size);
+    stats_phase(STATS_LOAD, &m0, fileinfo.st_size);
     return 0 ;
 }
 
+int memfile_readfiles(char * filename, char * password, filetable * ft)
+{
+    int ret ;
+
+    PROBE1(load__entry, filename);
+    ret = readfiles(filename, password, ft);
+    PROBE1(load__return, ret);
+    return ret ;
+}
+
+/* Time spent encrypting and writing blocks during the current save */
+static uint64_t save_crypt_ns ;
+static uint64_t save_write_ns ;
+
+/*
+ * Encrypt a block in place at the current stream offset and write it out
+ */
+static void write_block(FILE * f,
+                        uint8_t * b,
+                        size_t sz,
+                        size_t * offset,
+                        uint8_t * key,
+                        uint8_t * nonce)
+{
+    uint64_t t0, t1 ;
+
+    t0 = stats_start();
+    stream_cipher(b, sz, *offset, key, nonce);
+    t1 = stats_start();
+    *offset += sz ;
+    fwrite(b, 1, sz, f);
+    save_crypt_ns += t1 - t0 ;
+    save_write_ns += stats_start() - t1 ;
+    if (__builtin_expect(trace_enabled, 0)) {
+        trace_span("s20_crypt", t0, t1 - t0, sz);
+    }
+}
+
 /*
  * Save all files in rootdir to a container
  */
-int memfile_savefiles(char * filename, char * password, memfile * root)
+static int savefiles(char * filename, char * password, filetable * ft)
 {
     FILE *  f ;
     int     i ;
@@ -193,13 +1094,28 @@ int memfile_savefiles(char * filename, char * password, memfile * root)
     uint8_t nonce[NONCE_SZ];
     uint8_t key[KEY_SZ];
     uint8_t canari[CANARI_SZ];
+    uint8_t page[EXTENTSZ];
     char    enc_name[MAXNAMESZ];
     uint64_t    u1, u2, u3 ;
+    uint64_t    nruns, roff, rlen, nsaved ;
+    off_t   pos ;
+    size_t  len, chunk ;
+    memfile * mf ;
+    saved_map   saved ;
+    saved_page * ref ;
+    stats_mark  m0, m ;
+    uint64_t    t0 ;
 
     size_t  offset=0 ;
 
+    stats_mark_now(&m0);
+    m = m0 ;
+
     /* Generate nonce */
-    memcpy(nonce, get_nonce(), NONCE_SZ);
+    if (get_nonce_r(nonce)!=0) {
+        LOG(LOG_CRYPTO, LVL_ERROR, "cannot generate nonce");
+        return -1 ;
+    }
     /* Derive key from password */
     derive_key(password,
                strlen(password),
@@ -208,6 +1124,7 @@ int memfile_savefiles(char * filename, char * password, memfile * root)
                key,
                KEY_SZ,
                20000);
+    stats_phase(STATS_SAVE_KEY, &m, 0);
     /*
      * A container header is composed of:
      * A magic number of MAGIC_SZ bytes
@@ -218,6 +1135,11 @@ int memfile_savefiles(char * filename, char * password, memfile * root)
     if ((f=fopen(filename, "w"))==NULL) {
         return 0 ;
     }
+    /* Without memory to find them, shared pages are written every time */
+    if (saved_init(&saved)!=0) {
+        LOG(LOG_CONTAINER, LVL_WARN,
+            "no memory to share pages in container");
+    }
     /* Write magic number */
     fwrite(mefs_magic, 1, MAGIC_SZ, f);
     /* Write version */
@@ -228,7 +1150,9 @@ int memfile_savefiles(char * filename, char * password, memfile * root)
     for (i=0 ; i<CANARI_SZ ; i++) {
         canari[i] = 0xaa ;
     }
+    t0 = TRACE_BEGIN();
     stream_cipher(canari, CANARI_SZ, 0, key, nonce);
+    TRACE_END("s20_crypt", t0, CANARI_SZ);
     fwrite(canari, 1, CANARI_SZ, f);
     offset += CANARI_SZ ;
 
@@ -238,43 +1162,88 @@ int memfile_savefiles(char * filename, char * password, memfile * root)
      * filesize on a 64 big-endian unsigned int
      * ctime    on a 64-big-endian unsigned int
      * mtime    on a 64-big-endian unsigned int
+     * inode    on a 64-bit int
+     * number of runs on a 64-bit int, then for each run its offset and
+     * length on 64-bit ints followed by its contents. Holes are skipped.
+     * Runs of pages shared with a file written earlier are flagged with
+     * RUN_SHARED and followed by the file number and offset instead.
      */
+    nsaved = 0 ;
+    save_crypt_ns = 0 ;
+    save_write_ns = 0 ;
+    stats_mark_now(&m);
     for (i=0 ; i<MAXFILES ; i++) {
-        if (root[i].name==NULL) {
+        if (ft->hash[i]==0) {
             continue ;
         }
+        mf = ft->rec+i ;
         memset(enc_name, 0, MAXNAMESZ);
-        strncpy(enc_name, root[i].name, MAXNAMESZ);
-        stream_cipher(enc_name, MAXNAMESZ, offset, key, nonce);
-        offset += MAXNAMESZ ;
-        fwrite(enc_name, 1, MAXNAMESZ,  f);
-
-        u1 = root[i].sta.st_size ;
-        u2 = root[i].sta.st_ctime ;
-        u3 = root[i].sta.st_mtime ;
-
-        stream_cipher((uint8_t*)&u1, sizeof(uint64_t), offset, key, nonce);
-        offset += sizeof(uint64_t);
-        fwrite(&u1, sizeof(uint64_t), 1, f);
-
-        stream_cipher((uint8_t*)&u2, sizeof(uint64_t), offset, key, nonce);
-        offset += sizeof(uint64_t);
-        fwrite(&u2, sizeof(uint64_t), 1, f);
-
-        stream_cipher((uint8_t*)&u3, sizeof(uint64_t), offset, key, nonce);
-        offset += sizeof(uint64_t);
-        fwrite(&u3, sizeof(uint64_t), 1, f);
-
-        stream_cipher(root[i].data,
-                      root[i].sta.st_size, 
-                      offset,
-                      key,
-                      nonce);
-        offset += root[i].sta.st_size ;
-        fwrite(root[i].data, 1, root[i].sta.st_size, f);
+        strncpy(enc_name, ft->name[i], MAXNAMESZ);
+        write_block(f, (uint8_t*)enc_name, MAXNAMESZ, &offset, key, nonce);
+
+        u1 = mf->size ;
+        u2 = ft->ctime[i] ;
+        u3 = ft->mtime[i] ;
+        write_block(f, (uint8_t*)&u1, sizeof(uint64_t), &offset, key, nonce);
+        write_block(f, (uint8_t*)&u2, sizeof(uint64_t), &offset, key, nonce);
+        write_block(f, (uint8_t*)&u3, sizeof(uint64_t), &offset, key, nonce);
+        u1 = ft->ino[i] ;
+        write_block(f, (uint8_t*)&u1, sizeof(uint64_t), &offset, key, nonce);
+
+        /* Count runs of data */
+        nruns = 0 ;
+        pos   = 0 ;
+        while ((pos = memfile_next_seg(mf, pos, &len, &saved, &ref))>=0) {
+            nruns++ ;
+            pos += len ;
+        }
+        write_block(f, (uint8_t*)&nruns, sizeof(uint64_t), &offset, key, nonce);
+
+        /* Write runs, encrypting a copy so that contents stay usable */
+        pos = 0 ;
+        while ((pos = memfile_next_seg(mf, pos, &len, &saved, &ref))>=0) {
+            roff = pos ;
+            rlen = ref ? len | RUN_SHARED : len ;
+            write_block(f, (uint8_t*)&roff, sizeof(uint64_t), &offset, key, nonce);
+            write_block(f, (uint8_t*)&rlen, sizeof(uint64_t), &offset, key, nonce);
+            if (ref) {
+                u1 = ref->file ;
+                u2 = ref->off ;
+                write_block(f, (uint8_t*)&u1, sizeof(uint64_t), &offset, key, nonce);
+                write_block(f, (uint8_t*)&u2, sizeof(uint64_t), &offset, key, nonce);
+                pos += len ;
+                continue ;
+            }
+            while (len>0) {
+                chunk = len < EXTENTSZ ? len : EXTENTSZ ;
+                memfile_pread(mf, (char*)page, chunk, pos);
+                write_block(f, page, chunk, &offset, key, nonce);
+                pos += chunk ;
+                len -= chunk ;
+            }
+        }
+        saved_add(&saved, mf, nsaved++);
+        PROBE3(save__file, ft->name[i], mf->size, nruns);
     }
+    stats_phase(STATS_SAVE_FILES, &m, offset - CANARI_SZ);
+    stats_phase_set(STATS_SAVE_ENCRYPT, save_crypt_ns, offset - CANARI_SZ);
+    stats_phase_set(STATS_SAVE_WRITE, save_write_ns, offset - CANARI_SZ);
+    free(saved.tab);
+    stats_mark_now(&m);
     fclose(f);
+    stats_phase(STATS_SAVE_CLOSE, &m, 0);
+    stats_phase(STATS_SAVE, &m0, MAGIC_SZ + 2 + NONCE_SZ + offset);
     return 0 ;
 }
 
+int memfile_savefiles(char * filename, char * password, filetable * ft)
+{
+    int ret ;
+
+    PROBE1(save__entry, filename);
+    ret = savefiles(filename, password, ft);
+    PROBE1(save__return, ret);
+    return ret ;
+}
+
 /* vim: set ts=4 et sw=4 tw=75 */
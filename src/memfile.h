@@ -2,23 +2,67 @@
 #define __MEMFILE_H__
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include "cipher.h"
+#include "extent.h"
+#include "fslimits.h"
 
+/* Storage tiers for file contents */
+#define MF_INLINE   0   /* Inside the record, up to INLINESZ bytes */
+#define MF_BODY     1   /* One slab object, up to SMALLFILESZ bytes */
+#define MF_PAGES    2   /* Extent map */
+
+/*
+ * File record: contents only. Name and metadata live in dense arrays,
+ * see filetable.h.
+ * Tiny files are stored inside the record itself, right after the
+ * size, so that reading them needs no pointer dereference. The record
+ * is 128 bytes: two cache lines.
+ */
 typedef struct __memfile__ {
-    struct stat     sta ;
-    char    *       name ;
-    uint8_t *       data ;
-} memfile ;
+    off_t           size ;
+    uint32_t        store ;
+    union {
+        uint8_t     inl[INLINESZ] ;
+        struct {
+            uint8_t *   ptr ;
+            size_t      sz ;
+        } body ;
+        extmap      ext ;
+    } ;
+} __attribute__((aligned(64))) memfile ;
+
+struct __filetable__ ;
+
+void memfile_init(memfile * mf);
+void memfile_free(memfile * mf);
+size_t memfile_allocated(memfile * mf);
+size_t memfile_need(memfile * mf, off_t offset, size_t size);
 
-void memfile_init(memfile * mf, const char * name, mode_t mode);
+int memfile_pread(memfile * mf, char * buf, size_t size, off_t offset);
+ssize_t memfile_pwrite(memfile * mf, const char * buf, size_t size,
+                       off_t offset);
+int memfile_truncate(memfile * mf, off_t size);
+int memfile_fallocate(memfile * mf, int mode, off_t offset, off_t len);
+off_t memfile_lseek(memfile * mf, off_t offset, int whence);
+int memfile_map_read(memfile * mf, struct iovec * iov, size_t size,
+                     off_t offset);
+int memfile_map_write(memfile * mf, struct iovec * iov, size_t size,
+                      off_t offset);
+void memfile_map_done(memfile * mf, off_t end);
+ssize_t memfile_copy(memfile * dst, off_t doff, memfile * src, off_t soff,
+                     size_t size);
 int memfile_dump(memfile * mf, FILE * f);
 int memfile_read(memfile * mf, FILE * f);
 int memfile_dump_s20(memfile * mf, FILE * f, uint8_t * key);
 int memfile_read_s20(memfile * mf, FILE * f, uint8_t * key);
 
-int memfile_readfiles(char * filename, char * password, memfile * root);
-int memfile_savefiles(char * filename, char * password, memfile * root);
+int memfile_readfiles(char * filename, char * password,
+                      struct __filetable__ * ft);
+int memfile_savefiles(char * filename, char * password,
+                      struct __filetable__ * ft);
+void memfile_report(struct __filetable__ * ft);
 
 
 
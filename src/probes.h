@@ -0,0 +1,49 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static tracepoints for perf, bpftrace and SystemTap, provider mefs.
+ * Each probe is a single nop in the code and a note in the binary that
+ * tools use to attach to it at runtime, e.g.
+ *     bpftrace -e 'usdt:./mefs:mefs:read__entry { @[arg2] = count(); }'
+ *     perf probe -x ./mefs sdt_mefs:read__entry
+ * Probes are built in when <sys/sdt.h> is there (systemtap-sdt-dev or
+ * systemtap-sdt-devel), make USDT=0 leaves them out.
+ *
+ * Probe                arguments
+ * read__entry          fh, offset, size
+ * read__return         fh, bytes read or -errno
+ * write__entry         fh, offset, size
+ * write__return        fh, bytes written or -errno
+ * find__entry          name
+ * find__return         name, slot or -1
+ * cipher__entry        size, stream offset
+ * cipher__return       size, 0 or -1
+ * derive__entry        iterations
+ * derive__return       0 or -1
+ * load__entry          container path
+ * load__file           name, size, number of runs
+ * load__return         what memfile_readfiles() returns
+ * save__entry          container path
+ * save__file           name, size, number of runs
+ * save__return         0 or -1
+ */
+#if !defined(MEFS_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MEFS_USDT 1
+#endif
+#endif
+
+#ifdef MEFS_USDT
+#include <sys/sdt.h>
+#define PROBE1(name, a)         DTRACE_PROBE1(mefs, name, a)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(mefs, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(mefs, name, a, b, c)
+#else
+#define PROBE1(name, a)         do { } while (0)
+#define PROBE2(name, a, b)      do { } while (0)
+#define PROBE3(name, a, b, c)   do { } while (0)
+#endif
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
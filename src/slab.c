@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "slab.h"
+
+/*
+ * A chunk is a bulk allocation, chained for final release. Its header
+ * sits in front of SLAB_CHUNKSZ bytes of objects, so that every class
+ * fills the whole chunk.
+ */
+typedef struct __slab_chunk__ {
+    struct __slab_chunk__ * next ;
+} slab_chunk ;
+
+#define SLAB_ALLOCSZ    (sizeof(slab_chunk) + SLAB_CHUNKSZ)
+
+/* Free objects are chained through their first bytes */
+typedef struct __slab_obj__ {
+    struct __slab_obj__ * next ;
+} slab_obj ;
+
+static struct {
+    slab_chunk *    chunks ;
+    slab_obj *      freelist ;
+    size_t          nfree ;
+    size_t          nused ;
+    size_t          nchunks ;
+} slab_class[SLAB_NCLASSES] ;
+
+/* One lock for the whole arena: critical sections are a few pointers */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+/* Find size class for sz, or -1 if too large */
+static int slab_class_of(size_t sz)
+{
+    int     c ;
+    size_t  objsz = SLAB_MINSZ ;
+
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        if (sz <= objsz) {
+            return c ;
+        }
+        objsz <<= 1 ;
+    }
+    return -1 ;
+}
+
+/* Allocate one more chunk for class c and put its objects on free list */
+static int slab_grow(int c)
+{
+    slab_chunk *    ch ;
+    slab_obj *      obj ;
+    size_t          objsz ;
+    size_t          i, n ;
+
+    objsz = SLAB_MINSZ << c ;
+    if ((ch = malloc(SLAB_ALLOCSZ))==NULL) {
+        return -1 ;
+    }
+    ch->next = slab_class[c].chunks ;
+    slab_class[c].chunks = ch ;
+    slab_class[c].nchunks++ ;
+
+    n = SLAB_CHUNKSZ / objsz ;
+    for (i=0 ; i<n ; i++) {
+        obj = (slab_obj*)((uint8_t*)(ch + 1) + i * objsz) ;
+        obj->next = slab_class[c].freelist ;
+        slab_class[c].freelist = obj ;
+    }
+    slab_class[c].nfree += n ;
+    return 0 ;
+}
+
+size_t slab_size(size_t sz)
+{
+    int c ;
+
+    if (sz<1) {
+        return 0 ;
+    }
+    if ((c = slab_class_of(sz))<0) {
+        return sz ;
+    }
+    return SLAB_MINSZ << c ;
+}
+
+void * slab_alloc(size_t sz)
+{
+    int         c ;
+    slab_obj *  obj ;
+
+    if (sz<1) {
+        return NULL ;
+    }
+    if ((c = slab_class_of(sz))<0) {
+        return malloc(sz);
+    }
+    pthread_mutex_lock(&slab_lock);
+    if (slab_class[c].freelist==NULL && slab_grow(c)!=0) {
+        pthread_mutex_unlock(&slab_lock);
+        return NULL ;
+    }
+    obj = slab_class[c].freelist ;
+    slab_class[c].freelist = obj->next ;
+    slab_class[c].nfree-- ;
+    slab_class[c].nused++ ;
+    pthread_mutex_unlock(&slab_lock);
+    return obj ;
+}
+
+void slab_free(void * p, size_t sz)
+{
+    int         c ;
+    slab_obj *  obj ;
+
+    if (!p) {
+        return ;
+    }
+    if ((c = slab_class_of(sz))<0) {
+        free(p);
+        return ;
+    }
+    obj = p ;
+    pthread_mutex_lock(&slab_lock);
+    obj->next = slab_class[c].freelist ;
+    slab_class[c].freelist = obj ;
+    slab_class[c].nfree++ ;
+    slab_class[c].nused-- ;
+    pthread_mutex_unlock(&slab_lock);
+    return ;
+}
+
+char * slab_strdup(const char * s)
+{
+    char *  d ;
+    size_t  sz ;
+
+    if (!s) {
+        return NULL ;
+    }
+    sz = strlen(s) + 1 ;
+    if ((d = slab_alloc(sz))!=NULL) {
+        memcpy(d, s, sz);
+    }
+    return d ;
+}
+
+void slab_strfree(char * s)
+{
+    if (s) {
+        slab_free(s, strlen(s) + 1);
+    }
+}
+
+int slab_reserve(size_t sz, size_t n)
+{
+    int c ;
+
+    if ((c = slab_class_of(sz))<0) {
+        return 0 ;
+    }
+    pthread_mutex_lock(&slab_lock);
+    while (slab_class[c].nfree < n) {
+        if (slab_grow(c)!=0) {
+            pthread_mutex_unlock(&slab_lock);
+            return -1 ;
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+    return 0 ;
+}
+
+size_t slab_held(void)
+{
+    int     c ;
+    size_t  held=0 ;
+
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        held += slab_class[c].nchunks * SLAB_ALLOCSZ ;
+    }
+    return held ;
+}
+
+size_t slab_used(void)
+{
+    int     c ;
+    size_t  used=0 ;
+
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        used += slab_class[c].nused * (SLAB_MINSZ << c) ;
+    }
+    return used ;
+}
+
+size_t slab_objects(void)
+{
+    int     c ;
+    size_t  n=0 ;
+
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        n += slab_class[c].nused ;
+    }
+    return n ;
+}
+
+size_t slab_chunks(void)
+{
+    int     c ;
+    size_t  n=0 ;
+
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        n += slab_class[c].nchunks ;
+    }
+    return n ;
+}
+
+void slab_destroy(void)
+{
+    int             c ;
+    slab_chunk *    ch ;
+
+    for (c=0 ; c<SLAB_NCLASSES ; c++) {
+        while ((ch = slab_class[c].chunks)!=NULL) {
+            slab_class[c].chunks = ch->next ;
+            free(ch);
+        }
+    }
+    memset(slab_class, 0, sizeof(slab_class));
+    return ;
+}
+
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,43 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * Size-classed slab arena for small objects: file names and small file
+ * bodies. Objects are carved out of large chunks allocated in bulk, have
+ * no per-object header, and are recycled through a free list per class
+ * when released. Requests larger than SLAB_MAXSZ go to malloc.
+ *
+ * The caller must remember the size it asked for, it is needed to
+ * release the object.
+ */
+#define SLAB_MINSZ      16
+#define SLAB_NCLASSES   8
+#define SLAB_MAXSZ      (SLAB_MINSZ << (SLAB_NCLASSES-1))
+#define SLAB_CHUNKSZ    (16*1024)
+
+void *  slab_alloc(size_t sz);
+void    slab_free(void * p, size_t sz);
+char *  slab_strdup(const char * s);
+void    slab_strfree(char * s);
+
+/* Actual number of bytes used for an object of size sz */
+size_t  slab_size(size_t sz);
+
+/* Pre-allocate room for n objects of size sz */
+int     slab_reserve(size_t sz, size_t n);
+
+/* Bytes held by the arena and bytes handed out to callers */
+size_t  slab_held(void);
+size_t  slab_used(void);
+
+/* Number of objects handed out and of chunks held */
+size_t  slab_objects(void);
+size_t  slab_chunks(void);
+
+/* Release all chunks. All objects become invalid. */
+void    slab_destroy(void);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "logger.h"
+
+/*
+ * A slot is written by one thread at a time, with plain relaxed stores:
+ * readers may see a count a request behind, never a torn one. A thread
+ * gives its slot back when it exits and the next thread to claim it
+ * keeps counting on top, so totals survive threads coming and going.
+ * Slot STATS_MAXTHREADS is shared by threads that found no free slot
+ * and is only updated with atomic additions.
+ */
+typedef struct {
+    uint64_t    errors[STATS_NOPS] ;
+    uint64_t    bytes[STATS_NOPS] ;
+    uint64_t    sum[STATS_NOPS] ;       /* Nanoseconds */
+    uint64_t    hist[STATS_NOPS][STATS_NBUCKETS] ;
+    int         used ;
+} __attribute__((aligned(64))) stats_slot ;
+
+static stats_slot   stats_slots[STATS_MAXTHREADS+1] ;
+static int          stats_nslots ;      /* Slots ever claimed */
+
+static __thread stats_slot *    stats_self ;
+static pthread_key_t            stats_key ;
+static pthread_once_t           stats_once = PTHREAD_ONCE_INIT ;
+
+/* Totals at the last reset, guarded by stats_lock */
+static stats_slot       stats_base ;
+static uint64_t         stats_since ;
+static pthread_mutex_t  stats_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+static const char * stats_names[STATS_NOPS] = {
+    "getattr", "readdir", "unlink", "rename", "truncate", "utimens",
+    "create", "open", "release", "read", "write", "fallocate", "statfs",
+    "copy_file_range", "lseek"
+} ;
+
+/* Last load and save, phases only ever run in one thread at a time */
+typedef struct {
+    uint64_t    ns ;
+    uint64_t    bytes ;
+    int64_t     faults ;    /* -1 when not measured */
+    int         done ;
+} stats_phase_t ;
+
+static stats_phase_t    stats_phases[STATS_NPHASES] ;
+
+/* Fills in memory accounting for reports, NULL if there is none */
+static void (*stats_mem_fn)(stats_memory * m) ;
+
+static const char * stats_phase_names[STATS_NPHASES] = {
+    "load", "load: map", "load: derive_key", "load: decrypt",
+    "load: reserve", "load: files", "load: unmap",
+    "save", "save: derive_key", "save: files", "save: encrypt",
+    "save: write", "save: close"
+} ;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+}
+
+/* Bucket of a value: its top STATS_SUBBITS+1 bits */
+static int stats_bucket(uint64_t v)
+{
+    int e ;
+
+    if (v > STATS_MAXNS) {
+        v = STATS_MAXNS ;
+    }
+    if (v < (1<<STATS_SUBBITS)) {
+        return (int)v ;
+    }
+    e = 63 - __builtin_clzll(v) ;
+    return ((e-STATS_SUBBITS+1) << STATS_SUBBITS) +
+           (int)((v >> (e-STATS_SUBBITS)) & ((1<<STATS_SUBBITS)-1)) ;
+}
+
+/* Highest value that falls into bucket b */
+static uint64_t stats_bucket_max(int b)
+{
+    int         e ;
+    uint64_t    low ;
+
+    if (b < (1<<STATS_SUBBITS)) {
+        return b ;
+    }
+    e   = (b >> STATS_SUBBITS) + STATS_SUBBITS - 1 ;
+    low = (uint64_t)((1<<STATS_SUBBITS) + (b & ((1<<STATS_SUBBITS)-1)))
+          << (e-STATS_SUBBITS) ;
+    return low + (1ULL << (e-STATS_SUBBITS)) - 1 ;
+}
+
+/* Give the slot back when its thread exits */
+static void stats_unregister(void * arg)
+{
+    __atomic_store_n(&((stats_slot*)arg)->used, 0, __ATOMIC_RELEASE);
+    return ;
+}
+
+static void stats_key_init(void)
+{
+    pthread_key_create(&stats_key, stats_unregister);
+    stats_since = now_ns();
+}
+
+static stats_slot * stats_register(void)
+{
+    int i, n, unused ;
+
+    pthread_once(&stats_once, stats_key_init);
+    for (i=0 ; i<STATS_MAXTHREADS ; i++) {
+        unused = 0 ;
+        if (__atomic_compare_exchange_n(&stats_slots[i].used, &unused, 1,
+                                        0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            pthread_setspecific(stats_key, stats_slots+i);
+            n = __atomic_load_n(&stats_nslots, __ATOMIC_RELAXED);
+            while (n<=i &&
+                   !__atomic_compare_exchange_n(&stats_nslots, &n, i+1, 0,
+                                                __ATOMIC_RELEASE,
+                                                __ATOMIC_RELAXED)) ;
+            return stats_slots+i ;
+        }
+    }
+    return stats_slots+STATS_MAXTHREADS ;
+}
+
+uint64_t stats_start(void)
+{
+    return now_ns();
+}
+
+/* Add v to a counter of slot s */
+static inline void stats_add(stats_slot * s, uint64_t * c, uint64_t v)
+{
+    if (s==stats_slots+STATS_MAXTHREADS) {
+        __atomic_fetch_add(c, v, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+    }
+}
+
+int64_t stats_done(int op, uint64_t start, int64_t ret)
+{
+    stats_slot *    s ;
+    uint64_t        ns = now_ns() - start ;
+
+    if ((s = stats_self)==NULL) {
+        s = stats_self = stats_register();
+    }
+    stats_add(s, &s->hist[op][stats_bucket(ns)], 1);
+    stats_add(s, &s->sum[op], ns);
+    if (ret<0) {
+        stats_add(s, &s->errors[op], 1);
+    } else if (ret>0 && (op==STATS_READ || op==STATS_WRITE ||
+                         op==STATS_COPY)) {
+        stats_add(s, &s->bytes[op], ret);
+    }
+    /* Every request is a span of the trace too */
+    if (__builtin_expect(trace_enabled, 0)) {
+        trace_span(stats_names[op], start, ns, ret);
+    }
+    return ret ;
+}
+
+/* Add up all slots into t. Called with stats_lock held. */
+static void stats_total(stats_slot * t)
+{
+    const uint64_t *    src ;
+    uint64_t *          dst ;
+    size_t  i, n = offsetof(stats_slot, used) / sizeof(uint64_t) ;
+    int     k, nslots ;
+
+    memset(t, 0, sizeof(stats_slot));
+    dst    = (uint64_t*)t ;
+    nslots = __atomic_load_n(&stats_nslots, __ATOMIC_ACQUIRE);
+    for (k=0 ; k<=STATS_MAXTHREADS ; k++) {
+        if (k==nslots) {
+            k = STATS_MAXTHREADS ;
+        }
+        src = (const uint64_t*)(stats_slots+k) ;
+        for (i=0 ; i<n ; i++) {
+            dst[i] += __atomic_load_n(src+i, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Counts since reset into t. Called with stats_lock held. */
+static void stats_current(stats_slot * t)
+{
+    const uint64_t *    base = (const uint64_t*)&stats_base ;
+    uint64_t *          dst  = (uint64_t*)t ;
+    size_t  i, n = offsetof(stats_slot, used) / sizeof(uint64_t) ;
+
+    stats_total(t);
+    for (i=0 ; i<n ; i++) {
+        dst[i] -= base[i] ;
+    }
+}
+
+void stats_reset(void)
+{
+    pthread_once(&stats_once, stats_key_init);
+    pthread_mutex_lock(&stats_lock);
+    stats_total(&stats_base);
+    stats_since = now_ns();
+    pthread_mutex_unlock(&stats_lock);
+    return ;
+}
+
+static uint64_t hist_count(const uint64_t * hist)
+{
+    uint64_t    n = 0 ;
+    int         b ;
+
+    for (b=0 ; b<STATS_NBUCKETS ; b++) {
+        n += hist[b] ;
+    }
+    return n ;
+}
+
+/* Highest value of the bucket that holds the value of rank ceil(q*n) */
+static uint64_t hist_quantile(const uint64_t * hist, uint64_t n, double q)
+{
+    uint64_t    rank, seen = 0 ;
+    int         b ;
+
+    if (n==0) {
+        return 0 ;
+    }
+    rank = (uint64_t)(q * n + 0.999999) ;
+    if (rank<1) {
+        rank = 1 ;
+    }
+    for (b=0 ; b<STATS_NBUCKETS ; b++) {
+        seen += hist[b] ;
+        if (seen>=rank) {
+            return stats_bucket_max(b);
+        }
+    }
+    return stats_bucket_max(STATS_NBUCKETS-1);
+}
+
+/* Slots are too large for the stack, reports take turns in this one */
+static stats_slot stats_snap ;
+
+uint64_t stats_count(int op)
+{
+    uint64_t n ;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_current(&stats_snap);
+    n = hist_count(stats_snap.hist[op]);
+    pthread_mutex_unlock(&stats_lock);
+    return n ;
+}
+
+uint64_t stats_quantile(int op, double q)
+{
+    uint64_t v ;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_current(&stats_snap);
+    v = hist_quantile(stats_snap.hist[op], hist_count(stats_snap.hist[op]),
+                      q);
+    pthread_mutex_unlock(&stats_lock);
+    return v ;
+}
+
+static uint64_t page_faults(void)
+{
+    struct rusage ru ;
+
+    if (getrusage(RUSAGE_THREAD, &ru)!=0) {
+        return 0 ;
+    }
+    return (uint64_t)ru.ru_minflt + (uint64_t)ru.ru_majflt ;
+}
+
+void stats_mark_now(stats_mark * m)
+{
+    m->faults = page_faults();
+    m->ns     = now_ns();
+}
+
+static void phase_set(int phase, uint64_t ns, uint64_t bytes,
+                      int64_t faults)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_phases[phase].ns     = ns ;
+    stats_phases[phase].bytes  = bytes ;
+    stats_phases[phase].faults = faults ;
+    stats_phases[phase].done   = 1 ;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_phase(int phase, const stats_mark * m, uint64_t bytes)
+{
+    uint64_t ns = now_ns() - m->ns ;
+
+    phase_set(phase, ns, bytes, (int64_t)(page_faults() - m->faults));
+    if (__builtin_expect(trace_enabled, 0)) {
+        trace_span(stats_phase_names[phase], m->ns, ns, bytes);
+    }
+}
+
+void stats_phase_set(int phase, uint64_t ns, uint64_t bytes)
+{
+    phase_set(phase, ns, bytes, -1);
+}
+
+/* Throughput in MB/s, 0 when it makes no sense */
+static double phase_mbs(const stats_phase_t * p)
+{
+    return p->ns && p->bytes ? p->bytes * 1e3 / p->ns : 0.0 ;
+}
+
+void stats_phase_log(int save)
+{
+    stats_phase_t   p ;
+    int             i, from, to ;
+
+    from = save ? STATS_SAVE : STATS_LOAD ;
+    to   = save ? STATS_NPHASES : STATS_SAVE ;
+    for (i=from ; i<to ; i++) {
+        pthread_mutex_lock(&stats_lock);
+        p = stats_phases[i] ;
+        pthread_mutex_unlock(&stats_lock);
+        if (!p.done) {
+            continue ;
+        }
+        LOG(LOG_CONTAINER, LVL_INFO,
+            "%-18s %10.3f ms %12llu bytes %9.1f MB/s %8lld faults",
+            stats_phase_names[i], p.ns / 1e6,
+            (unsigned long long)p.bytes, phase_mbs(&p),
+            (long long)p.faults);
+    }
+}
+
+void stats_memory_source(void (*fn)(stats_memory * m))
+{
+    __atomic_store_n(&stats_mem_fn, fn, __ATOMIC_RELEASE);
+}
+
+/* Memory accounting as rows of a report, returns the number of rows */
+#define STATS_MEMROWS   18
+static int memory_rows(const stats_memory * m, const char ** name,
+                       int64_t * v)
+{
+    int n = 0 ;
+
+    name[n] = "files" ;         v[n++] = m->files ;
+    name[n] = "size" ;          v[n++] = m->size ;
+    name[n] = "inline" ;        v[n++] = m->inlined ;
+    name[n] = "contents" ;      v[n++] = m->bodies + m->pages ;
+    name[n] = "slack" ;         v[n++] = (int64_t)(m->bodies + m->pages) -
+                                         (int64_t)(m->size - m->inlined) ;
+    name[n] = "bodies" ;        v[n++] = m->bodies ;
+    name[n] = "pages" ;         v[n++] = m->pages ;
+    name[n] = "shared" ;        v[n++] = m->shared ;
+    name[n] = "page_tables" ;   v[n++] = m->tables ;
+    name[n] = "names" ;         v[n++] = m->names ;
+    name[n] = "records" ;       v[n++] = m->records ;
+    name[n] = "file_table" ;    v[n++] = m->table ;
+    name[n] = "slab_held" ;     v[n++] = m->slab_held ;
+    name[n] = "slab_used" ;     v[n++] = m->slab_used ;
+    name[n] = "page_count" ;    v[n++] = m->npages ;
+    name[n] = "table_count" ;   v[n++] = m->ntables ;
+    name[n] = "object_count" ;  v[n++] = m->nobjects ;
+    name[n] = "chunk_count" ;   v[n++] = m->nchunks ;
+    return n ;
+}
+
+/* Quantiles shown in reports */
+static const double  stats_q[] = { 0.5, 0.9, 0.99, 0.999, 1.0 } ;
+static const char *  stats_qname[] = {
+    "p50", "p90", "p99", "p999", "max"
+} ;
+#define STATS_NQ    (int)(sizeof(stats_q) / sizeof(stats_q[0]))
+
+static void report_text(FILE * f, const stats_slot * t, double secs,
+                        const stats_memory * m)
+{
+    const char *    name[STATS_MEMROWS] ;
+    int64_t         v[STATS_MEMROWS] ;
+    uint64_t        n ;
+    int             op, k, nrows ;
+
+    fprintf(f, "# %.1f s since reset, latencies in microseconds\n", secs);
+    fprintf(f, "%-16s %10s %8s %14s %9s", "op", "count", "errors",
+            "bytes", "mean");
+    for (k=0 ; k<STATS_NQ ; k++) {
+        fprintf(f, " %9s", stats_qname[k]);
+    }
+    fprintf(f, "\n");
+    for (op=0 ; op<STATS_NOPS ; op++) {
+        n = hist_count(t->hist[op]);
+        fprintf(f, "%-16s %10llu %8llu %14llu %9.1f", stats_names[op],
+                (unsigned long long)n,
+                (unsigned long long)t->errors[op],
+                (unsigned long long)t->bytes[op],
+                n ? t->sum[op] / 1e3 / n : 0.0);
+        for (k=0 ; k<STATS_NQ ; k++) {
+            fprintf(f, " %9.1f", hist_quantile(t->hist[op], n,
+                                               stats_q[k]) / 1e3);
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "\n# last load and save, faults are -1 when not measured"
+            "\n%-18s %12s %14s %10s %8s\n", "phase", "ms", "bytes", "MB/s",
+            "faults");
+    for (k=0 ; k<STATS_NPHASES ; k++) {
+        if (stats_phases[k].done) {
+            fprintf(f, "%-18s %12.3f %14llu %10.1f %8lld\n",
+                    stats_phase_names[k], stats_phases[k].ns / 1e6,
+                    (unsigned long long)stats_phases[k].bytes,
+                    phase_mbs(stats_phases+k),
+                    (long long)stats_phases[k].faults);
+        }
+    }
+    if (m==NULL) {
+        return ;
+    }
+    fprintf(f, "\n# memory in bytes, counts of allocations last\n");
+    nrows = memory_rows(m, name, v);
+    for (k=0 ; k<nrows ; k++) {
+        fprintf(f, "%-18s %14lld\n", name[k], (long long)v[k]);
+    }
+}
+
+/*
+ * JSON report. Histograms list their non-empty buckets as pairs of
+ * highest value in nanoseconds and count.
+ */
+static void report_json(FILE * f, const stats_slot * t, double secs,
+                        const stats_memory * m)
+{
+    const char *    name[STATS_MEMROWS] ;
+    int64_t         v[STATS_MEMROWS] ;
+    uint64_t        n ;
+    int             op, k, b, first, nrows ;
+
+    fprintf(f, "{\"seconds\":%.3f,\"ops\":{", secs);
+    for (op=0 ; op<STATS_NOPS ; op++) {
+        n = hist_count(t->hist[op]);
+        fprintf(f, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,"
+                "\"bytes\":%llu,\"mean_us\":%.3f",
+                op ? "," : "", stats_names[op],
+                (unsigned long long)n,
+                (unsigned long long)t->errors[op],
+                (unsigned long long)t->bytes[op],
+                n ? t->sum[op] / 1e3 / n : 0.0);
+        for (k=0 ; k<STATS_NQ ; k++) {
+            fprintf(f, ",\"%s_us\":%.3f", stats_qname[k],
+                    hist_quantile(t->hist[op], n, stats_q[k]) / 1e3);
+        }
+        fprintf(f, ",\"hist\":[");
+        for (b=0, first=1 ; b<STATS_NBUCKETS ; b++) {
+            if (t->hist[op][b]) {
+                fprintf(f, "%s[%llu,%llu]", first ? "" : ",",
+                        (unsigned long long)stats_bucket_max(b),
+                        (unsigned long long)t->hist[op][b]);
+                first = 0 ;
+            }
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "},\"phases\":{");
+    for (k=0, first=1 ; k<STATS_NPHASES ; k++) {
+        if (stats_phases[k].done) {
+            fprintf(f, "%s\"%s\":{\"ms\":%.3f,\"bytes\":%llu,"
+                    "\"mb_per_s\":%.1f,\"faults\":%lld}",
+                    first ? "" : ",", stats_phase_names[k],
+                    stats_phases[k].ns / 1e6,
+                    (unsigned long long)stats_phases[k].bytes,
+                    phase_mbs(stats_phases+k),
+                    (long long)stats_phases[k].faults);
+            first = 0 ;
+        }
+    }
+    fprintf(f, "}");
+    if (m) {
+        fprintf(f, ",\"memory\":{");
+        nrows = memory_rows(m, name, v);
+        for (k=0 ; k<nrows ; k++) {
+            fprintf(f, "%s\"%s\":%lld", k ? "," : "", name[k],
+                    (long long)v[k]);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "}\n");
+}
+
+char * stats_report(int json, size_t * len)
+{
+    void    (*fn)(stats_memory * m) ;
+    stats_memory    mem ;
+    FILE *  f ;
+    char *  buf = NULL ;
+    double  secs ;
+
+    pthread_once(&stats_once, stats_key_init);
+    if ((fn = __atomic_load_n(&stats_mem_fn, __ATOMIC_ACQUIRE))!=NULL) {
+        fn(&mem);
+    }
+    if ((f = open_memstream(&buf, len))==NULL) {
+        return NULL ;
+    }
+    pthread_mutex_lock(&stats_lock);
+    stats_current(&stats_snap);
+    secs = (now_ns() - stats_since) / 1e9 ;
+    if (json) {
+        report_json(f, &stats_snap, secs, fn ? &mem : NULL);
+    } else {
+        report_text(f, &stats_snap, secs, fn ? &mem : NULL);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    if (fclose(f)!=0) {
+        free(buf);
+        return NULL ;
+    }
+    return buf ;
+}
+
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,131 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Request counters and latency histograms, one set per FUSE operation.
+ * Latencies go into log-linear buckets in the manner of HdrHistogram:
+ * 16 buckets per power of two, so that any value is known to within
+ * 1/16th. Values are kept in nanoseconds up to STATS_MAXNS.
+ *
+ * Each thread counts into its own slot, so that recording a request
+ * never writes to memory another thread writes to. Reports add up all
+ * slots. Resetting takes a snapshot that later reports subtract.
+ */
+#define STATS_GETATTR   0
+#define STATS_READDIR   1
+#define STATS_UNLINK    2
+#define STATS_RENAME    3
+#define STATS_TRUNCATE  4
+#define STATS_UTIMENS   5
+#define STATS_CREATE    6
+#define STATS_OPEN      7
+#define STATS_RELEASE   8
+#define STATS_READ      9
+#define STATS_WRITE     10
+#define STATS_FALLOCATE 11
+#define STATS_STATFS    12
+#define STATS_COPY      13
+#define STATS_LSEEK     14
+#define STATS_NOPS      15
+
+#define STATS_SUBBITS   4
+#define STATS_MAXNS     ((1ULL<<36)-1)      /* About 68 seconds */
+#define STATS_NBUCKETS  ((36-STATS_SUBBITS+1) << STATS_SUBBITS)
+
+/* Threads with a slot of their own, others share an extra slot */
+#define STATS_MAXTHREADS    64
+
+/* Start timing a request */
+uint64_t stats_start(void);
+
+/*
+ * Record a request of type op started at start, which returned ret.
+ * A negative ret counts as an error. For reads, writes and copies a
+ * positive ret is the number of bytes moved. Returns ret.
+ */
+int64_t stats_done(int op, uint64_t start, int64_t ret);
+
+/* Start counting from zero again */
+void stats_reset(void);
+
+/* Requests of type op and their latency at quantile q, since reset */
+uint64_t stats_count(int op);
+uint64_t stats_quantile(int op, double q);
+
+/*
+ * Phases of loading and saving the container. Each phase keeps its
+ * duration, the bytes it went through and the page faults taken, from
+ * the last time it ran. Resetting leaves them alone.
+ */
+#define STATS_LOAD          0   /* Whole of memfile_readfiles() */
+#define STATS_LOAD_MAP      1   /* Open and map the container */
+#define STATS_LOAD_KEY      2   /* Derive the key from the password */
+#define STATS_LOAD_DECRYPT  3   /* Decrypt the mapped container */
+#define STATS_LOAD_RESERVE  4   /* Reserve slab memory for all files */
+#define STATS_LOAD_FILES    5   /* Create files and copy contents */
+#define STATS_LOAD_UNMAP    6
+#define STATS_SAVE          7   /* Whole of memfile_savefiles() */
+#define STATS_SAVE_KEY      8
+#define STATS_SAVE_FILES    9   /* Gather, encrypt and write all files */
+#define STATS_SAVE_ENCRYPT  10  /* Part of STATS_SAVE_FILES */
+#define STATS_SAVE_WRITE    11  /* Part of STATS_SAVE_FILES */
+#define STATS_SAVE_CLOSE    12  /* Flush and close the container */
+#define STATS_NPHASES       13
+
+/* Start of a phase */
+typedef struct {
+    uint64_t    ns ;
+    uint64_t    faults ;    /* Minor and major, this thread only */
+} stats_mark ;
+
+void stats_mark_now(stats_mark * m);
+
+/* Record a phase that started at m and went through bytes bytes */
+void stats_phase(int phase, const stats_mark * m, uint64_t bytes);
+
+/* Record a phase measured by the caller, without page faults */
+void stats_phase_set(int phase, uint64_t ns, uint64_t bytes);
+
+/* Log the load phases, or the save phases */
+void stats_phase_log(int save);
+
+/*
+ * Memory held by the filesystem, in bytes unless noted. Contents are
+ * bodies and pages, slack is what they hold beyond the size of files
+ * not stored inline: rounding up to slab classes and pages, negative
+ * for sparse files and shared pages.
+ */
+typedef struct {
+    uint64_t    files ;         /* Number of files */
+    uint64_t    size ;          /* Sum of file sizes */
+    uint64_t    inlined ;       /* Sum of sizes of files in records */
+    uint64_t    bodies ;        /* Slab objects holding small files */
+    uint64_t    pages ;         /* Pages, shared pages counted once */
+    uint64_t    shared ;        /* Page bytes saved by sharing */
+    uint64_t    tables ;        /* Page tables */
+    uint64_t    names ;         /* Slab objects holding names */
+    uint64_t    records ;       /* Metadata of existing files */
+    uint64_t    table ;         /* File table, all slots */
+    uint64_t    slab_held ;     /* Slab chunks */
+    uint64_t    slab_used ;     /* Slab objects handed out */
+    uint64_t    nobjects ;      /* Number of slab objects */
+    uint64_t    nchunks ;       /* Number of slab chunks */
+    uint64_t    npages ;        /* Number of pages */
+    uint64_t    ntables ;       /* Number of page tables */
+} stats_memory ;
+
+/* Have reports include the memory accounting that fn fills in */
+void stats_memory_source(void (*fn)(stats_memory * m));
+
+/*
+ * Write a report of all operations since reset, of the last load and
+ * save and of memory use, to a new buffer as text or as JSON. Sets
+ * *len, returns NULL if out of memory. Release the buffer with free().
+ */
+char * stats_report(int json, size_t * len);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+volatile int trace_enabled ;
+
+/*
+ * A buffer is written by one thread at a time. head counts the spans
+ * ever written to it, span n goes to rec[n % TRACE_NREC]. A reader
+ * copies the buffer without stopping its writer, then drops the spans
+ * the writer may have overwritten in the meantime.
+ * Buffers are handed over to another thread when theirs exits, spans
+ * carry the id of the thread that recorded them.
+ */
+typedef struct {
+    const char *    name ;
+    uint64_t        start ;
+    uint64_t        dur ;
+    int64_t         value ;
+    uint32_t        tid ;
+} trace_rec ;
+
+typedef struct {
+    uint64_t    head ;
+    trace_rec   rec[TRACE_NREC] ;
+} trace_buf ;
+
+static trace_buf *  trace_bufs[TRACE_MAXTHREADS] ;
+static int          trace_used[TRACE_MAXTHREADS] ;
+static uint64_t     trace_drops ;
+static uint64_t     trace_t0 ;
+static char *       trace_path ;
+
+static __thread trace_buf * trace_self ;
+static __thread uint32_t    trace_tid ;
+static pthread_key_t        trace_key ;
+static pthread_once_t       trace_once = PTHREAD_ONCE_INIT ;
+
+uint64_t trace_clock(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+}
+
+/* Give the buffer back when its thread exits */
+static void trace_unregister(void * arg)
+{
+    int i = (int)(intptr_t)arg - 1 ;
+
+    __atomic_store_n(&trace_used[i], 0, __ATOMIC_RELEASE);
+    return ;
+}
+
+static void trace_key_init(void)
+{
+    pthread_key_create(&trace_key, trace_unregister);
+}
+
+static trace_buf * trace_register(void)
+{
+    trace_buf * b ;
+    int i, unused ;
+
+    pthread_once(&trace_once, trace_key_init);
+    for (i=0 ; i<TRACE_MAXTHREADS ; i++) {
+        unused = 0 ;
+        if (!__atomic_compare_exchange_n(&trace_used[i], &unused, 1, 0,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED)) {
+            continue ;
+        }
+        if ((b = trace_bufs[i])==NULL) {
+            if ((b = calloc(1, sizeof(trace_buf)))==NULL) {
+                __atomic_store_n(&trace_used[i], 0, __ATOMIC_RELEASE);
+                return NULL ;
+            }
+            __atomic_store_n(&trace_bufs[i], b, __ATOMIC_RELEASE);
+        }
+        pthread_setspecific(trace_key, (void*)(intptr_t)(i+1));
+        trace_tid = (uint32_t)syscall(SYS_gettid);
+        return b ;
+    }
+    return NULL ;
+}
+
+void trace_span(const char * name, uint64_t start, uint64_t dur,
+                int64_t value)
+{
+    trace_buf * b ;
+    trace_rec * r ;
+
+    if ((b = trace_self)==NULL) {
+        if ((b = trace_self = trace_register())==NULL) {
+            __atomic_fetch_add(&trace_drops, 1, __ATOMIC_RELAXED);
+            return ;
+        }
+    }
+    r = b->rec + b->head % TRACE_NREC ;
+    r->name  = name ;
+    r->start = start ;
+    r->dur   = dur ;
+    r->value = value ;
+    r->tid   = trace_tid ;
+    __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_start(const char * path)
+{
+    FILE * f ;
+
+    if (path) {
+        if ((f = fopen(path, "a"))==NULL) {
+            return -1 ;
+        }
+        fclose(f);
+        free(trace_path);
+        trace_path = strdup(path);
+    }
+    trace_t0 = trace_clock();
+    trace_enabled = 1 ;
+    return 0 ;
+}
+
+void trace_stop(void)
+{
+    FILE *  f ;
+    char *  buf ;
+    size_t  len ;
+
+    trace_enabled = 0 ;
+    if (trace_path==NULL) {
+        return ;
+    }
+    if ((buf = trace_report(&len))!=NULL &&
+        (f = fopen(trace_path, "w"))!=NULL) {
+        fwrite(buf, 1, len, f);
+        fclose(f);
+    }
+    free(buf);
+    free(trace_path);
+    trace_path = NULL ;
+}
+
+/* Write out the spans of buffer b still there after copying them */
+static void trace_write(FILE * f, trace_buf * b, trace_rec * copy,
+                        int * first)
+{
+    uint64_t    head, from, n ;
+    trace_rec * r ;
+
+    head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+    from = head > TRACE_NREC ? head - TRACE_NREC : 0 ;
+    for (n=from ; n<head ; n++) {
+        copy[n % TRACE_NREC] = b->rec[n % TRACE_NREC] ;
+    }
+    /* The writer is at most one span past the head read last */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    n = __atomic_load_n(&b->head, __ATOMIC_RELAXED);
+    if (n + 1 > from + TRACE_NREC) {
+        from = n + 1 - TRACE_NREC ;
+    }
+    for (n=from ; n<head ; n++) {
+        r = copy + n % TRACE_NREC ;
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"value\":%lld}}",
+                *first ? "" : ",", r->name, r->tid,
+                r->start < trace_t0 ? 0.0 : (r->start - trace_t0) / 1e3,
+                r->dur / 1e3, (long long)r->value);
+        *first = 0 ;
+    }
+}
+
+char * trace_report(size_t * len)
+{
+    FILE *      f ;
+    char *      buf = NULL ;
+    trace_rec * copy ;
+    trace_buf * b ;
+    int         i, first = 1 ;
+
+    if ((copy = malloc(TRACE_NREC * sizeof(trace_rec)))==NULL) {
+        return NULL ;
+    }
+    if ((f = open_memstream(&buf, len))==NULL) {
+        free(copy);
+        return NULL ;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i=0 ; i<TRACE_MAXTHREADS ; i++) {
+        b = __atomic_load_n(&trace_bufs[i], __ATOMIC_ACQUIRE);
+        if (b) {
+            trace_write(f, b, copy, &first);
+        }
+    }
+    fprintf(f, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"mefs\"}}\n]}\n", first ? "" : ",");
+    free(copy);
+    if (fclose(f)!=0) {
+        free(buf);
+        return NULL ;
+    }
+    return buf ;
+}
+
+uint64_t trace_dropped(void)
+{
+    return __atomic_load_n(&trace_drops, __ATOMIC_RELAXED);
+}
+
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,62 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Opt-in tracer for the life of requests and container phases.
+ * A span is a name, a start time, a duration and one value (a return
+ * code, a size). Each thread records spans into a binary ring buffer of
+ * its own, keeping the last TRACE_NREC spans. Buffers can be dumped at
+ * any time in the Chrome trace-event format, for chrome://tracing or
+ * Perfetto.
+ *
+ * When tracing is off, TRACE_BEGIN() is a single predictable branch and
+ * TRACE_END() does nothing.
+ */
+#define TRACE_NREC          32768
+#define TRACE_MAXTHREADS    64
+
+extern volatile int trace_enabled ;
+
+/* Start a span: a timestamp, or 0 when tracing is off */
+#define TRACE_BEGIN() \
+    (__builtin_expect(trace_enabled, 0) ? trace_clock() : 0)
+
+/* End the span started at t0, name must be a static string */
+#define TRACE_END(name, t0, value) \
+    do { \
+        if (t0) { \
+            trace_span((name), (t0), trace_clock() - (t0), (value)); \
+        } \
+    } while (0)
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t trace_clock(void);
+
+/* Record a span that started at start and lasted dur nanoseconds */
+void trace_span(const char * name, uint64_t start, uint64_t dur,
+                int64_t value);
+
+/*
+ * Start tracing. If path is not NULL, trace_stop() writes the trace to
+ * it. Returns 0, or -1 if path cannot be written to.
+ */
+int trace_start(const char * path);
+
+/* Stop tracing and write the trace out if trace_start() was given a path */
+void trace_stop(void);
+
+/*
+ * Write spans recorded so far as Chrome trace-event JSON to a new
+ * buffer. Sets *len, returns NULL if out of memory. Release the buffer
+ * with free().
+ */
+char * trace_report(size_t * len);
+
+/* Spans lost because a thread found no free buffer */
+uint64_t trace_dropped(void);
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,151 @@
+#!/bin/sh
+#
+# End-to-end throughput of a mounted mefs, with tmpfs as the baseline.
+# The same workloads run on a tmpfs directory (/dev/shm) and on mefs
+# mounted on a temporary directory with a throwaway container:
+#   - sequential 1 MiB writes and reads, random 4 KiB reads and writes,
+#     with fio when it is installed, sequential I/O only with dd if not
+#   - metadata storms: touch, stat, ls -l and rm over NFILES files
+#   - unmount then mount again with containers of several sizes, which
+#     covers encryption and saving, loading and decryption
+# mefs results are given as a percentage of tmpfs, higher is better.
+# tmpfs has no container to save or load, mount cycles are for mefs
+# only.
+#
+# use: make bench-fs or testing/bench_fs.sh [path/to/mefs]
+#
+MEFS=$(realpath "${1:-./mefs}")
+SIZE_MB=64                  # Files for I/O, below MAXFILESZ
+NFILES=1000                 # Files for metadata, below MAXFILES
+NLIST=20                    # Directory listings
+CONTAINERS_MB="16 64 256"   # Container sizes for mount cycles
+WORK=$(mktemp -d /tmp/mefs-bench.XXXXXX)
+TMPFS=$(mktemp -d /dev/shm/mefs-bench.XXXXXX)
+mkdir "$WORK/mnt"
+
+if [ "$(stat -f -c %T /dev/shm)" != "tmpfs" ] ; then
+    echo "warning: /dev/shm is not tmpfs" >&2
+fi
+
+# Wall clock in milliseconds
+now() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Operations per second, from a count and milliseconds
+rate() {
+    awk -v n="$1" -v ms="$2" \
+        'BEGIN { printf "%.0f", n * 1000 / (ms ? ms : 1) }'
+}
+
+# Throughput reported by dd in MB/s
+ddrate() {
+    tail -1 | awk -F, '{ split($NF, a, " ") ;
+        printf "%.0f", a[2]=="GB/s" ? a[1] * 1000 : a[1] }'
+}
+
+mount_mefs() {
+    # No controlling terminal: the password is read from stdin
+    echo bench | setsid "$MEFS" "$WORK/mnt" "$WORK/container" \
+        >/dev/null 2>&1 &
+    while ! mountpoint -q "$WORK/mnt" ; do sleep 0.01 ; done
+    # Requests wait for the container to be loaded
+    ls "$WORK/mnt" > /dev/null
+}
+
+umount_mefs() {
+    fusermount -u "$WORK/mnt" 2>/dev/null || fusermount3 -u "$WORK/mnt"
+    # Contents are saved before mefs exits
+    wait
+}
+
+# Run one fio job in directory $1, print the bandwidth in MB/s or IOPS
+fiojob() {
+    dir=$1 rw=$2 bs=$3 field=$4
+    fio --name="$rw" --directory="$dir" --filename=bench --rw="$rw" \
+        --bs="$bs" --size=${SIZE_MB}M --ioengine=psync --end_fsync=1 \
+        --minimal 2>/dev/null |
+    awk -F';' -v f="$field" \
+        '{ printf "%.0f", f==7 || f==48 ? $f / 1024 : $f }'
+}
+
+# I/O workloads in directory $1: write, read, random read and write
+io() {
+    if command -v fio > /dev/null ; then
+        # Terse output: read bandwidth and IOPS are fields 7 and 8,
+        # written ones 48 and 49, bandwidth in KiB/s
+        echo "$(fiojob "$1" write 1M 48) $(fiojob "$1" read 1M 7)" \
+             "$(fiojob "$1" randread 4k 8) $(fiojob "$1" randwrite 4k 49)"
+    else
+        w=$(dd if=/dev/zero of="$1/bench" bs=1M count=$SIZE_MB \
+            conv=fsync 2>&1 | ddrate)
+        r=$(dd if="$1/bench" of=/dev/null bs=1M 2>&1 | ddrate)
+        echo "$w $r - -"
+    fi
+    rm -f "$1/bench"
+}
+
+# Metadata workloads in directory $1, in operations per second
+meta() {
+    seq -f "$1/f%05g" 1 $NFILES > "$WORK/names"
+    t=$(now) ; xargs touch < "$WORK/names" ; touch_ms=$(( $(now) - t ))
+    t=$(now) ; xargs stat < "$WORK/names" > /dev/null
+    stat_ms=$(( $(now) - t ))
+    t=$(now)
+    i=0
+    while [ $i -lt $NLIST ] ; do
+        ls -l "$1" > /dev/null
+        i=$((i+1))
+    done
+    ls_ms=$(( $(now) - t ))
+    t=$(now) ; xargs rm < "$WORK/names" ; rm_ms=$(( $(now) - t ))
+    echo "$(rate $NFILES $touch_ms) $(rate $NFILES $stat_ms)" \
+         "$(rate $NLIST $ls_ms) $(rate $NFILES $rm_ms)"
+}
+
+# Print a row: workload, tmpfs and mefs results, mefs as % of tmpfs
+row() {
+    awk -v w="$1" -v t="$2" -v m="$3" 'BEGIN {
+        p = "-" ;
+        if (t!="-" && m!="-" && t>0) p = sprintf("%.0f%%", 100 * m / t) ;
+        printf "%-24s %12s %12s %10s\n", w, t, m, p }'
+}
+
+tmpfs_io=$(io "$TMPFS")
+tmpfs_meta=$(meta "$TMPFS")
+mount_mefs
+mefs_io=$(io "$WORK/mnt")
+mefs_meta=$(meta "$WORK/mnt")
+umount_mefs
+
+printf "%-24s %12s %12s %10s\n" "workload" "tmpfs" "mefs" "mefs/tmpfs"
+set -- $mefs_io $mefs_meta
+m1=$1 m2=$2 m3=$3 m4=$4 m5=$5 m6=$6 m7=$7 m8=$8
+set -- $tmpfs_io $tmpfs_meta
+row "seq write MB/s"        $1 $m1
+row "seq read MB/s"         $2 $m2
+row "rand read 4k IOPS"     $3 $m3
+row "rand write 4k IOPS"    $4 $m4
+row "touch files/s"         $5 $m5
+row "stat files/s"          $6 $m6
+row "ls -l dirs/s"          $7 $m7
+row "rm files/s"            $8 $m8
+
+# Fill a container, time saving it at unmount and loading it at mount
+echo
+printf "%-24s %12s %12s\n" "container MB" "unmount ms" "mount ms"
+for size in $CONTAINERS_MB ; do
+    rm -f "$WORK/container"
+    mount_mefs
+    i=0
+    while [ $i -lt $((size / 16)) ] ; do
+        dd if=/dev/zero of="$WORK/mnt/c$i" bs=1M count=16 2>/dev/null
+        i=$((i+1))
+    done
+    t=$(now) ; umount_mefs ; save_ms=$(( $(now) - t ))
+    t=$(now) ; mount_mefs ; load_ms=$(( $(now) - t ))
+    umount_mefs
+    printf "%-24s %12d %12d\n" "$size" $save_ms $load_ms
+done
+
+rm -rf "$WORK" "$TMPFS"
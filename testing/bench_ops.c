@@ -0,0 +1,288 @@
+/*
+ * Drive the mefs callbacks in-process with synthetic workloads, with no
+ * kernel and no mount: many small files created, looked up, read,
+ * renamed and deleted, directory listings of a full table, a large
+ * sequential write and random 4 KiB reads. Each callback is timed on
+ * its own, ops/s and latency percentiles are reported per workload.
+ * Regressions in the filesystem logic, e.g. lookups going O(n) again,
+ * show up here without FUSE round trips hiding them.
+ *
+ * mefs.c is built in with its main() renamed, so the benchmark calls
+ * the very functions in mefs_oper that libfuse would. Nothing is saved.
+ *
+ * use: make bench_ops && ./bench_ops [rounds]
+ */
+#define main mefs_main
+#include "mefs.c"
+#undef main
+
+#define NSMALL      (MAXFILES - 1)  /* Fill the table, bar one slot */
+#define SMALLSZ     1024
+#define LARGESZ     (64 * 1024 * 1024)
+#define LARGEBLK    (128 * 1024)
+#define RANDBLK     4096
+#define NRAND       100000
+#define NLIST       200
+#define MAXCALLS    NRAND           /* Calls in the longest workload */
+
+/* Calls that differ between libfuse 2 and 3 */
+#ifdef MEFS_FUSE3
+#define OP_GETATTR(p, st)   mefs_oper.getattr(p, st, NULL)
+#define OP_RENAME(a, b)     mefs_oper.rename(a, b, 0)
+#define OP_READDIR(p, b, f) mefs_oper.readdir(p, b, f, 0, NULL, 0)
+#else
+#define OP_GETATTR(p, st)   mefs_oper.getattr(p, st)
+#define OP_RENAME(a, b)     mefs_oper.rename(a, b)
+#define OP_READDIR(p, b, f) mefs_oper.readdir(p, b, f, 0, NULL)
+#endif
+
+/* Latencies of the workload being run, in nanoseconds */
+static uint64_t *   lat ;
+static size_t       nlat ;
+static int          bench_err ;
+
+static void bench_start(void)
+{
+    nlat = 0 ;
+    bench_err = 0 ;
+}
+
+/* Record the latency of one call started at t0, count it if it failed */
+static void bench_done(uint64_t t0, int ret)
+{
+    lat[nlat++] = trace_clock() - t0 ;
+    if (ret<0) {
+        bench_err++ ;
+    }
+}
+
+static int cmp_u64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t*)a ;
+    uint64_t y = *(const uint64_t*)b ;
+
+    return x<y ? -1 : x>y ;
+}
+
+/* Latency at quantile q of the sorted samples, in microseconds */
+static double bench_quantile(double q)
+{
+    return lat[(size_t)((nlat - 1) * q)] / 1e3 ;
+}
+
+/*
+ * Print a line for the workload that just ran, bytes may be 0.
+ * Rates are over the time spent in the timed calls only, not in the
+ * opens and releases around them.
+ */
+static void bench_report(const char * name, uint64_t bytes)
+{
+    double  secs = 0 ;
+    size_t  i ;
+
+    for (i=0 ; i<nlat ; i++) {
+        secs += lat[i] / 1e9 ;
+    }
+    qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+    printf("%-10s %8zu %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f",
+           name, nlat, nlat / secs,
+           bench_quantile(0.5), bench_quantile(0.9),
+           bench_quantile(0.99), bench_quantile(0.999),
+           lat[nlat-1] / 1e3);
+    if (bytes) {
+        printf(" %8.1f", bytes / secs / (1024 * 1024));
+    }
+    printf("\n");
+    if (bench_err) {
+        fprintf(stderr, "%s: %d calls failed\n", name, bench_err);
+    }
+}
+
+/* Count listed names, like libfuse would fill its buffer */
+#ifdef MEFS_FUSE3
+static int bench_filler(void * buf, const char * name,
+                        const struct stat * st, off_t off,
+                        enum fuse_fill_dir_flags flags)
+#else
+static int bench_filler(void * buf, const char * name,
+                        const struct stat * st, off_t off)
+#endif
+{
+    (*(int*)buf)++ ;
+    return 0 ;
+}
+
+/* Create, look up, read, list, rename and delete small files */
+static void bench_small(char * data)
+{
+    struct fuse_file_info   fi ;
+    struct stat             st ;
+    char    path[MAXNAMESZ] ;
+    char    path2[MAXNAMESZ] ;
+    int     i, n ;
+    uint64_t t0 ;
+
+    memset(&fi, 0, sizeof(fi));
+    bench_start();
+    for (i=0 ; i<NSMALL ; i++) {
+        sprintf(path, "/small%04d", i);
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.create(path, S_IFREG | 0644, &fi));
+        mefs_oper.release(path, &fi);
+    }
+    bench_report("create", 0);
+
+    bench_start();
+    for (i=0 ; i<NSMALL ; i++) {
+        sprintf(path, "/small%04d", i);
+        mefs_oper.open(path, &fi);
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.write(path, data, SMALLSZ, 0, &fi));
+        mefs_oper.release(path, &fi);
+    }
+    bench_report("write", (uint64_t)NSMALL * SMALLSZ);
+
+    bench_start();
+    for (i=0 ; i<NSMALL * 10 ; i++) {
+        sprintf(path, "/small%04d", rand() % NSMALL);
+        t0 = trace_clock();
+        bench_done(t0, OP_GETATTR(path, &st));
+    }
+    bench_report("getattr", 0);
+
+    bench_start();
+    for (i=0 ; i<NSMALL * 10 ; i++) {
+        sprintf(path, "/small%04d", rand() % NSMALL);
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.open(path, &fi));
+        mefs_oper.release(path, &fi);
+    }
+    bench_report("open", 0);
+
+    bench_start();
+    for (i=0 ; i<NSMALL * 10 ; i++) {
+        sprintf(path, "/small%04d", rand() % NSMALL);
+        mefs_oper.open(path, &fi);
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.read(path, data, SMALLSZ, 0, &fi));
+        mefs_oper.release(path, &fi);
+    }
+    bench_report("read", (uint64_t)NSMALL * 10 * SMALLSZ);
+
+    bench_start();
+    for (i=0 ; i<NLIST ; i++) {
+        n = 0 ;
+        t0 = trace_clock();
+        bench_done(t0, OP_READDIR("/", &n, bench_filler));
+        if (n!=NSMALL + 2) {
+            bench_err++ ;
+        }
+    }
+    bench_report("readdir", 0);
+
+    /* Rename every file away and back, through a full table */
+    bench_start();
+    for (i=0 ; i<NSMALL * 2 ; i++) {
+        sprintf(path, "/small%04d", i % NSMALL);
+        sprintf(path2, "/moved%04d", i % NSMALL);
+        t0 = trace_clock();
+        if (i<NSMALL) {
+            bench_done(t0, OP_RENAME(path, path2));
+        } else {
+            bench_done(t0, OP_RENAME(path2, path));
+        }
+    }
+    bench_report("rename", 0);
+
+    bench_start();
+    for (i=0 ; i<NSMALL ; i++) {
+        sprintf(path, "/small%04d", i);
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.unlink(path));
+    }
+    bench_report("unlink", 0);
+}
+
+/* Write a large file sequentially, then read it back at random */
+static void bench_large(char * data)
+{
+    struct fuse_file_info   fi ;
+    off_t       off ;
+    int         i ;
+    uint64_t    t0 ;
+
+    memset(&fi, 0, sizeof(fi));
+    mefs_oper.create("/large", S_IFREG | 0644, &fi);
+    bench_start();
+    for (off=0 ; off<LARGESZ ; off+=LARGEBLK) {
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.write("/large", data, LARGEBLK, off,
+                                       &fi));
+    }
+    bench_report("seqwrite", LARGESZ);
+
+    bench_start();
+    for (i=0 ; i<NRAND ; i++) {
+        off = (off_t)(rand() % (LARGESZ / RANDBLK)) * RANDBLK ;
+        t0 = trace_clock();
+        bench_done(t0, mefs_oper.read("/large", data, RANDBLK, off, &fi));
+    }
+    bench_report("randread", (uint64_t)NRAND * RANDBLK);
+
+    bench_start();
+    t0 = trace_clock();
+    bench_done(t0, mefs_oper.unlink("/large"));
+    mefs_oper.release("/large", &fi);
+    bench_report("free", 0);
+}
+
+int main(int argc, char * argv[])
+{
+    struct fuse_conn_info   conn ;
+#ifdef MEFS_FUSE3
+    struct fuse_config      cfg ;
+    struct fuse_args        args = FUSE_ARGS_INIT(0, NULL);
+#endif
+    char *  data ;
+    int     rounds, r ;
+
+    rounds = argc>1 ? atoi(argv[1]) : 1 ;
+    lat  = malloc(MAXCALLS * sizeof(uint64_t));
+    data = malloc(LARGEBLK);
+    if (!lat || !data) {
+        fprintf(stderr, "out of memory\n");
+        return 1 ;
+    }
+    memset(data, 'x', LARGEBLK);
+    srand(1);
+
+    /* A container that does not exist: start from an empty table */
+    snprintf(config.backup_filename, sizeof(config.backup_filename),
+             "/nonexistent/bench_ops.%d", (int)getpid());
+    config.password = "bench" ;
+    config.maxfile  = MAXFILESZ ;
+    memset(&conn, 0, sizeof(conn));
+#ifdef MEFS_FUSE3
+    memset(&cfg, 0, sizeof(cfg));
+    config.conn_opts = fuse_parse_conn_info_opts(&args);
+    mefs_oper.init(&conn, &cfg);
+#else
+    mefs_oper.init(&conn);
+#endif
+    if (config.err) {
+        return 1 ;
+    }
+
+    printf("%-10s %8s %10s %8s %8s %8s %8s %8s %8s\n",
+           "workload", "calls", "ops/s", "p50 us", "p90 us", "p99 us",
+           "p99.9 us", "max us", "MB/s");
+    for (r=0 ; r<rounds ; r++) {
+        bench_small(data);
+        bench_large(data);
+    }
+    cleanup();
+    free(data);
+    free(lat);
+    return 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Count FUSE requests served by mefs for common workloads, with the
+# default cache options and with -o nocache.
+# mefs logs one line per request at trace level, counting them gives
+# round trips. Trace calls are compiled out by default, build mefs with
+# make LOG_FLOOR=LVL_TRACE first.
+#
+# use: testing/bench_roundtrips.sh [path/to/mefs]
+#
+MEFS=$(realpath "${1:-./mefs}")
+NFILES=100
+WORK=$(mktemp -d /tmp/mefs-bench.XXXXXX)
+
+# Source files: 64 KiB of text each
+mkdir "$WORK/src"
+i=0
+while [ $i -lt $NFILES ] ; do
+    seq 1 12000 | sed "s/^/line $i /" | head -c 65536 > "$WORK/src/f$i"
+    i=$((i+1))
+done
+
+# Number of requests logged since the last call, in $d
+count() {
+    # Messages are written out by a background thread, let it catch up
+    sleep 0.2
+    n=$(grep -c ' mefs_' "$WORK/log")
+    d=$((n - last))
+    last=$n
+}
+
+run() {
+    mkdir -p "$WORK/mnt"
+    rm -f "$WORK/container"
+    : > "$WORK/log"
+    last=0
+    # No controlling terminal: the password is read from stdin
+    echo bench | setsid "$MEFS" -o log=fuse:trace $1 "$WORK/mnt" "$WORK/container" \
+        >/dev/null 2>"$WORK/log" &
+    while ! mountpoint -q "$WORK/mnt" ; do sleep 0.1 ; done
+    count
+
+    cp "$WORK"/src/* "$WORK/mnt/"          ; count ; cp1=$d
+    cat "$WORK"/mnt/* > /dev/null          ; count ; cat1=$d
+    cat "$WORK"/mnt/* > /dev/null          ; count ; cat2=$d
+    grep -c 'line 7 1' "$WORK"/mnt/* > /dev/null ; count ; grep1=$d
+    cp "$WORK"/mnt/* "$WORK/src/"          ; count ; cp2=$d
+
+    fusermount -u "$WORK/mnt"
+    wait
+    echo "$cp1 $cat1 $cat2 $grep1 $cp2"
+}
+
+cached=$(run "")
+uncached=$(run "-o nocache")
+
+printf "%-24s %10s %10s\n" "workload" "nocache" "default"
+set -- $uncached
+u1=$1 u2=$2 u3=$3 u4=$4 u5=$5
+set -- $cached
+printf "%-24s %10d %10d\n" "cp into mefs"    $u1 $1
+printf "%-24s %10d %10d\n" "cat"             $u2 $2
+printf "%-24s %10d %10d\n" "cat again"       $u3 $3
+printf "%-24s %10d %10d\n" "grep"            $u4 $4
+printf "%-24s %10d %10d\n" "cp out of mefs"  $u5 $5
+
+rm -rf "$WORK"
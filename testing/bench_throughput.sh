@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Compare sequential throughput of mefs builds, e.g. libfuse 2 and 3:
+#
+#   make mefs && cp mefs mefs2
+#   make clean && make mefs FUSE=3 && cp mefs mefs3
+#   testing/bench_throughput.sh ./mefs2 ./mefs3
+#
+# Each build is mounted in turn, a file is written with small and large
+# blocks, then read back. dd reports the throughput.
+#
+SIZE_MB=64                  # Below the default maxfile of 100M
+WORK=$(mktemp -d /tmp/mefs-bench.XXXXXX)
+mkdir "$WORK/mnt"
+
+# Throughput reported by dd, last field of its summary
+rate() {
+    tail -1 | awk -F, '{ print $NF }'
+}
+
+# Run dd and print its throughput, or its errors if it failed
+ddrate() {
+    out=$(dd "$@" 2>&1) || { echo "$out" >&2 ; return 1 ; }
+    echo "$out" | rate
+}
+
+umount_mefs() {
+    fusermount -u "$WORK/mnt" 2>/dev/null || fusermount3 -u "$WORK/mnt"
+    wait
+}
+
+# A partial run gives a meaningless figure: stop there
+fail() {
+    echo "$(basename "$mefs"): dd failed" >&2
+    umount_mefs
+    rm -rf "$WORK"
+    exit 1
+}
+
+printf "%-16s %14s %14s %14s\n" "build" "write 4k" "write 1M" "read 1M"
+for mefs in "$@" ; do
+    rm -f "$WORK/container"
+    # No controlling terminal: the password is read from stdin
+    echo bench | setsid "$mefs" "$WORK/mnt" "$WORK/container" \
+        >/dev/null 2>&1 &
+    while ! mountpoint -q "$WORK/mnt" ; do sleep 0.1 ; done
+
+    w4k=$(ddrate if=/dev/zero of="$WORK/mnt/small" bs=4k \
+          count=$((SIZE_MB * 256)) conv=fsync) || fail
+    w1m=$(ddrate if=/dev/zero of="$WORK/mnt/large" bs=1M \
+          count=$SIZE_MB conv=fsync) || fail
+    r1m=$(ddrate if="$WORK/mnt/large" of=/dev/null bs=1M) || fail
+
+    umount_mefs
+    printf "%-16s %14s %14s %14s\n" "$(basename "$mefs")" \
+        "$w4k" "$w1m" "$r1m"
+done
+
+rm -rf "$WORK"
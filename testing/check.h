@@ -0,0 +1,18 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Print a test result, stop at the first failure */
+static void check(int cond, char * what)
+{
+    printf("%-40s %s\n", what, cond ? "ok" : "FAILED");
+    if (!cond) {
+        fprintf(stderr, "Test failed.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+#endif
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "extent.h"
+#include "check.h"
+
+static int all_zero(uint8_t * b, size_t sz)
+{
+    size_t i ;
+    for (i=0 ; i<sz ; i++) {
+        if (b[i]) {
+            return 0 ;
+        }
+    }
+    return 1 ;
+}
+
+int main(void)
+{
+    extmap  em, em2 ;
+    uint8_t buf[3*EXTENTSZ] ;
+    char    msg[] = "0123456789" ;
+    off_t   big = (off_t)10 * 1024 * 1024 * 1024 ;
+    size_t  len ;
+    struct iovec iov[EXTMAP_MAXIOV(2*EXTENTSZ)] ;
+    int     n ;
+
+    extmap_init(&em);
+
+    /* Sparse write far into the file only allocates one page */
+    extmap_write(&em, (uint8_t*)msg, 10, 5*EXTENTSZ + 3);
+    check(em.npages==1, "one page for a sparse write");
+    check(extmap_allocated(&em)==EXTENTSZ, "allocated bytes");
+
+    /* Holes read back as zeros */
+    memset(buf, 0xff, sizeof(buf));
+    extmap_read(&em, buf, 2*EXTENTSZ, 0);
+    check(all_zero(buf, 2*EXTENTSZ), "hole reads as zeros");
+    extmap_read(&em, buf, 10, 5*EXTENTSZ + 3);
+    check(!memcmp(buf, msg, 10), "data reads back");
+
+    /* Write across a page boundary */
+    extmap_write(&em, (uint8_t*)msg, 10, EXTENTSZ - 5);
+    check(em.npages==3, "write across pages");
+    extmap_read(&em, buf, 10, EXTENTSZ - 5);
+    check(!memcmp(buf, msg, 10), "data across pages reads back");
+
+    /* SEEK_DATA / SEEK_HOLE work at page granularity */
+    check(extmap_seek_data(&em, 0, 6*EXTENTSZ)==0, "seek data");
+    check(extmap_seek_data(&em, 2*EXTENTSZ, 6*EXTENTSZ)==5*EXTENTSZ,
+          "seek data after hole");
+    check(extmap_seek_hole(&em, EXTENTSZ, 6*EXTENTSZ)==2*EXTENTSZ,
+          "seek hole");
+    check(extmap_seek_hole(&em, 5*EXTENTSZ, 6*EXTENTSZ)==6*EXTENTSZ,
+          "implicit hole at end of file");
+    check(extmap_seek_data(&em, 6*EXTENTSZ, 6*EXTENTSZ)==-1,
+          "seek data past end of file");
+    check(extmap_next_run(&em, 0, 6*EXTENTSZ, &len)==0 &&
+          len==2*EXTENTSZ, "first run");
+
+    /* Extending to 10 GB allocates nothing */
+    extmap_truncate(&em, big);
+    check(em.npages==3, "truncate up allocates nothing");
+
+    /* Shrinking releases pages and zeroes the tail */
+    extmap_truncate(&em, 5*EXTENTSZ + 5);
+    check(em.npages==3, "truncate keeps partial page");
+    extmap_truncate(&em, big);
+    extmap_read(&em, buf, 10, 5*EXTENTSZ + 3);
+    check(!memcmp(buf, msg, 2) && all_zero(buf+2, 8),
+          "tail zeroed after shrink and grow");
+    extmap_truncate(&em, EXTENTSZ);
+    check(em.npages==1, "truncate down releases pages");
+    check(em.nslots==1 && extmap_table_bytes()==sizeof(uint8_t*),
+          "truncate down shrinks page table");
+    extmap_truncate(&em, 0);
+    check(em.npages==0 && em.page==NULL, "truncate to zero");
+
+    /* Read mappings show holes as zeros, write mappings fill them */
+    extmap_write(&em, (uint8_t*)msg, 10, EXTENTSZ);
+    n = extmap_map(&em, iov, 2*EXTENTSZ, 10, 0);
+    check(n==3 && iov[0].iov_len==EXTENTSZ-10 && iov[2].iov_len==10,
+          "map across pages");
+    check(all_zero(iov[0].iov_base, iov[0].iov_len) &&
+          !memcmp(iov[1].iov_base, msg, 10), "mapped contents");
+    check(em.npages==1, "read mapping allocates nothing");
+    n = extmap_map(&em, iov, 10, 3*EXTENTSZ - 5, 1);
+    memcpy(iov[0].iov_base, msg, 5);
+    memcpy(iov[1].iov_base, msg+5, 5);
+    extmap_read(&em, buf, 10, 3*EXTENTSZ - 5);
+    check(n==2 && em.npages==3 && !memcmp(buf, msg, 10),
+          "write mapping allocates pages");
+    extmap_truncate(&em, 0);
+
+    /* Shared pages are copied on first write, for either side */
+    extmap_init(&em2);
+    extmap_write(&em, (uint8_t*)msg, 10, 0);
+    extmap_write(&em, (uint8_t*)msg, 10, 2*EXTENTSZ);
+    extmap_share(&em2, EXTENTSZ, &em, 0, 3*EXTENTSZ);
+    check(em2.npages==2 && em2.page[1]==em.page[0] && em2.page[2]==NULL,
+          "pages shared, holes kept");
+    check(extmap_refs(em.page[0])==2 &&
+          extmap_shared()==2*EXTENTSZ, "shared pages counted");
+    extmap_write(&em2, (uint8_t*)"X", 1, EXTENTSZ);
+    extmap_read(&em, buf, 10, 0);
+    check(em2.page[1]!=em.page[0] && !memcmp(buf, msg, 10) &&
+          extmap_shared()==EXTENTSZ, "copy on write");
+    extmap_truncate(&em, 2*EXTENTSZ + 5);
+    extmap_read(&em2, buf, 10, 3*EXTENTSZ);
+    check(em.page[2]!=em2.page[3] && !memcmp(buf, msg, 10),
+          "copy on truncate");
+    check(extmap_shared()==0 && extmap_refs(em.page[0])==1,
+          "single owners left");
+    extmap_share(&em2, 0, &em, 0, EXTENTSZ);
+    extmap_free(&em);
+    extmap_read(&em2, buf, 10, 0);
+    check(!memcmp(buf, msg, 10) && extmap_shared()==0,
+          "shared page outlives its first owner");
+    extmap_free(&em2);
+
+    /* Preallocated pages are reused, punched pages released */
+    extmap_alloc(&em, EXTENTSZ + 1, 2*EXTENTSZ);
+    check(em.npages==3 && em.page[0]==NULL, "preallocate pages");
+    extmap_write(&em, (uint8_t*)msg, 10, 2*EXTENTSZ);
+    check(em.npages==3, "write to preallocated page");
+    extmap_clear(&em, EXTENTSZ + 5, 2*EXTENTSZ, 0);
+    extmap_read(&em, buf, 10, 3*EXTENTSZ);
+    check(em.npages==2 && em.page[2]==NULL && all_zero(buf, 10),
+          "punch hole");
+    extmap_clear(&em, 0, 4*EXTENTSZ, 1);
+    extmap_read(&em, buf, sizeof(buf), 0);
+    check(em.npages==4 && all_zero(buf, sizeof(buf)), "zero range");
+    check(extmap_held(NULL, &len)==4*EXTENTSZ && len==1 &&
+          extmap_table_bytes()==em.nslots * sizeof(uint8_t*),
+          "memory held");
+    extmap_truncate(&em, 0);
+    check(extmap_held(NULL, &len)==0 && len==0 &&
+          extmap_table_bytes()==0, "memory released");
+
+    extmap_free(&em);
+    printf("All tests passed.\n");
+    return 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */
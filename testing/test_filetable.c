@@ -0,0 +1,393 @@
+/* For FALLOC_FL_* */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "filetable.h"
+#include "slab.h"
+#include "check.h"
+
+/*
+ * Stress test for the file table locks: a few threads hammer a small set
+ * of names with every operation mefs supports. Data is written in
+ * CHUNK-byte blocks at CHUNK-aligned offsets, each block filled with a
+ * single byte value, so that any read must return uniform blocks unless
+ * two writers interleaved or a reader saw a half-done write.
+ */
+#define NTHREADS    8
+#define NNAMES      16
+#define NOPS        20000
+#define CHUNK       64
+#define MAXCHUNKS   256
+
+static filetable    ft ;
+static filetable    loaded ;
+static int          failed ;
+static char         pages[4*EXTENTSZ] ;
+
+static void fail(char * what, char * name)
+{
+    fprintf(stderr, "%s: %s\n", what, name);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void * worker(void * arg)
+{
+    unsigned int    seed = (unsigned int)(uintptr_t)arg ;
+    char            name[16], other[16] ;
+    char *          buf ;
+    struct stat     st ;
+    int             op, k, n, c, ret ;
+
+    buf = malloc(CHUNK * MAXCHUNKS);
+    for (op=0 ; op<NOPS && !failed ; op++) {
+        sprintf(name,  "/f%02d", rand_r(&seed) % NNAMES);
+        sprintf(other, "/f%02d", rand_r(&seed) % NNAMES);
+        switch (rand_r(&seed) % 8) {
+            case 0:
+            filetable_create(&ft, name, 0644);
+            break ;
+
+            case 1:
+            case 2:
+            /* Block sizes cover inline, slab and paged files */
+            k = rand_r(&seed) % MAXCHUNKS ;
+            n = 1 + rand_r(&seed) % (MAXCHUNKS - k) ;
+            for (c=0 ; c<n ; c++) {
+                memset(buf + c*CHUNK, 1 + rand_r(&seed) % 255, CHUNK);
+            }
+            ret = filetable_write(&ft, name, buf, n*CHUNK, k*CHUNK);
+            if (ret!=n*CHUNK) {
+                fail("short write", name);
+            }
+            break ;
+
+            case 3:
+            case 4:
+            ret = filetable_read(&ft, name, buf, CHUNK*MAXCHUNKS, 0);
+            if (ret==-ENOENT) {
+                break ;
+            }
+            if (ret<0 || ret%CHUNK) {
+                fail("bad read size", name);
+                break ;
+            }
+            for (k=0 ; k<ret ; k++) {
+                if (buf[k]!=buf[k - k%CHUNK]) {
+                    fail("torn block", name);
+                    break ;
+                }
+            }
+            break ;
+
+            case 5:
+            if (filetable_getattr(&ft, name, &st)==0 &&
+                (st.st_size%CHUNK || !S_ISREG(st.st_mode))) {
+                fail("bad attributes", name);
+            }
+            break ;
+
+            case 6:
+            if (rand_r(&seed)%2) {
+                filetable_unlink(&ft, name);
+            } else {
+                filetable_rename(&ft, name, other);
+            }
+            break ;
+
+            case 7:
+            k = rand_r(&seed) % MAXCHUNKS ;
+            filetable_truncate(&ft, name, k*CHUNK);
+            break ;
+        }
+    }
+    free(buf);
+    return NULL ;
+}
+
+/*
+ * Replace a file over and over with rename(), the way editors save.
+ * The target must never appear missing to a concurrent getattr.
+ */
+static void * replacer(void * arg)
+{
+    char    buf[CHUNK] ;
+    int     op ;
+
+    memset(buf, 'r', CHUNK);
+    for (op=0 ; op<NOPS && !failed ; op++) {
+        filetable_create(&ft, "/keep.new", 0644);
+        filetable_write(&ft, "/keep.new", buf, CHUNK * (1 + op%4), 0);
+        filetable_rename(&ft, "/keep.new", "/keep");
+    }
+    __atomic_store_n((int*)arg, 1, __ATOMIC_RELAXED);
+    return NULL ;
+}
+
+static void * looker(void * arg)
+{
+    struct stat st ;
+
+    while (!__atomic_load_n((int*)arg, __ATOMIC_RELAXED) && !failed) {
+        if (filetable_getattr(&ft, "/keep", &st)!=0) {
+            fail("missing during rename", "/keep");
+        } else if (st.st_size<CHUNK || st.st_size%CHUNK) {
+            fail("inconsistent attributes", "/keep");
+        }
+    }
+    return NULL ;
+}
+
+/* Flip bits in a byte of a file: the stream cipher lets them through */
+static void flip(char * fname, off_t pos, uint8_t bits)
+{
+    uint8_t c ;
+    int     fd ;
+
+    fd = open(fname, O_RDWR);
+    pread(fd, &c, 1, pos);
+    c ^= bits ;
+    pwrite(fd, &c, 1, pos);
+    close(fd);
+}
+
+int main(void)
+{
+    pthread_t   th[NTHREADS] ;
+    uint64_t    nfiles=0, bytes=0, allocated=0, names=0, inlined=0 ;
+    stats_memory    m ;
+    int         i, done=0 ;
+    struct stat st ;
+    char        buf[16] ;
+    char        longname[MAXNAMESZ+1] ;
+    char        container[] = "/tmp/test_filetable.XXXXXX" ;
+    uint64_t    before ;
+    int         j, k ;
+
+    filetable_init(&ft);
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_create(th+i, NULL, worker, (void*)(uintptr_t)(i+1));
+    }
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_join(th[i], NULL);
+    }
+    check(!failed, "concurrent operations");
+
+    filetable_write(&ft, "/keep", "x", 1, 0);
+    filetable_truncate(&ft, "/keep", CHUNK);
+    pthread_create(th, NULL, replacer, &done);
+    for (i=1 ; i<NTHREADS ; i++) {
+        pthread_create(th+i, NULL, looker, &done);
+    }
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_join(th[i], NULL);
+    }
+    check(!failed, "lookups during rename");
+
+    /* A file deleted while the kernel holds it lives on until forget */
+    filetable_create(&ft, "/pinned", 0644);
+    filetable_write(&ft, "/pinned", "pinned", 6, 0);
+    i = filetable_lookup(&ft, "/pinned", &st);
+    filetable_unlink(&ft, "/pinned");
+    check(filetable_exists(&ft, "/pinned")==-ENOENT,
+          "pinned file has no name");
+    check(filetable_iread(&ft, i, buf, sizeof(buf), 0)==6 &&
+          !memcmp(buf, "pinned", 6), "pinned file keeps contents");
+    filetable_igetattr(&ft, i, &st);
+    check(st.st_nlink==0, "pinned file has no link");
+    filetable_create(&ft, "/other", 0644);
+    check(filetable_find(&ft, "/other")!=i, "pinned slot is not reused");
+    filetable_unpin(&ft, i, 1);
+    check(ft.ino[i]==0, "slot released on forget");
+
+    /* Same for a file deleted while open */
+    check(filetable_open(&ft, "/pinned")==-ENOENT, "open missing file");
+    i = filetable_open(&ft, "/other");
+    filetable_unlink(&ft, "/other");
+    check(filetable_iwrite(&ft, i, "open", 4, 0)==4 &&
+          filetable_iread(&ft, i, buf, sizeof(buf), 0)==4,
+          "deleted file stays open");
+    filetable_unpin(&ft, i, 1);
+    check(ft.ino[i]==0, "slot released on close");
+
+    /* Aligned copies share pages, which containers store only once */
+    memset(pages, 'p', sizeof(pages));
+    filetable_write(&ft, "/src", pages, sizeof(pages), 0);
+    filetable_create(&ft, "/dst", 0644);
+    i = filetable_open(&ft, "/src");
+    j = filetable_open(&ft, "/dst");
+    before = filetable_allocated(&ft);
+    check(filetable_icopy(&ft, i, 0, j, EXTENTSZ, 3*EXTENTSZ + 10)==
+          3*EXTENTSZ + 10, "copy file range");
+    check(filetable_allocated(&ft)==before + EXTENTSZ,
+          "copied pages are shared");
+    check(filetable_icopy(&ft, i, 0, i, 10, 100)==-EINVAL,
+          "overlapping copy refused");
+    filetable_iwrite(&ft, j, "new", 3, EXTENTSZ);
+    check(filetable_iread(&ft, i, buf, 3, 0)==3 && buf[0]=='p',
+          "copy on write");
+    filetable_unpin(&ft, i, 1);
+    filetable_unpin(&ft, j, 1);
+    close(mkstemp(container));
+    memfile_savefiles(container, "secret", &ft);
+    filetable_init(&loaded);
+    memfile_readfiles(container, "secret", &loaded);
+    i = filetable_find(&loaded, "/src");
+    j = filetable_find(&loaded, "/dst");
+    for (k=0 ; k<3 ; k++) {
+        filetable_read(&loaded, "/dst", buf, 3, (k+1)*EXTENTSZ);
+        if (memcmp(buf, k ? "ppp" : "new", 3)) {
+            break ;
+        }
+    }
+    check(k==3 && loaded.size[j]==4*EXTENTSZ + 10,
+          "container keeps copies");
+    check(loaded.rec[j].ext.page[2]==loaded.rec[i].ext.page[1],
+          "container keeps pages shared");
+    filetable_free(&loaded);
+    stat(container, &st);
+    truncate(container, st.st_size - 5);
+    filetable_init(&loaded);
+    check(memfile_readfiles(container, "secret", &loaded)==-1,
+          "truncated container refused");
+    filetable_free(&loaded);
+    unlink(container);
+
+    /*
+     * Two files sharing two pages: the first one saved holds them, the
+     * second one a single shared run. Point that run at its own file.
+     * Header: magic, version, nonce and canari, 22 bytes. Each file:
+     * name, 5 64-bit fields, run offset and length, then contents or
+     * the file number and offset of the shared run.
+     */
+    filetable_init(&loaded);
+    filetable_write(&loaded, "/a", pages, 2*EXTENTSZ, 0);
+    filetable_create(&loaded, "/b", 0644);
+    i = filetable_open(&loaded, "/a");
+    j = filetable_open(&loaded, "/b");
+    filetable_icopy(&loaded, i, 0, j, 0, 2*EXTENTSZ);
+    filetable_unpin(&loaded, i, 1);
+    filetable_unpin(&loaded, j, 1);
+    close(mkstemp(container));
+    memfile_savefiles(container, "secret", &loaded);
+    filetable_free(&loaded);
+    flip(container, 22 + 2*(MAXNAMESZ + 7*sizeof(uint64_t)) + 2*EXTENTSZ,
+         1);
+    filetable_init(&loaded);
+    check(memfile_readfiles(container, "secret", &loaded)==-1,
+          "forged shared run refused");
+    filetable_free(&loaded);
+    unlink(container);
+    close(mkstemp(container));
+    memfile_savefiles(container, "secret", &ft);
+    filetable_init(&loaded);
+    for (k=0 ; k<MAXFILES ; k++) {
+        sprintf(buf, "/full%d", k);
+        filetable_slot_create(&loaded, buf, 0, 0);
+    }
+    check(memfile_readfiles(container, "secret", &loaded)==-1,
+          "partial load refused");
+    filetable_free(&loaded);
+    unlink(container);
+
+    /* Preallocation keeps the size unless asked, punching frees pages */
+    i = filetable_open(&ft, "/src");
+    check(filetable_ifallocate(&ft, i, FALLOC_FL_KEEP_SIZE, 0,
+                               8*EXTENTSZ)==0 &&
+          ft.size[i]==4*EXTENTSZ && ft.alloc[i]==8*EXTENTSZ,
+          "preallocate, keep size");
+    check(filetable_ifallocate(&ft, i, FALLOC_FL_PUNCH_HOLE |
+                               FALLOC_FL_KEEP_SIZE, 0, 6*EXTENTSZ)==0 &&
+          ft.size[i]==4*EXTENTSZ && ft.alloc[i]==2*EXTENTSZ,
+          "punch hole");
+    check(filetable_ifallocate(&ft, i, FALLOC_FL_PUNCH_HOLE, 0, 1)==
+          -EOPNOTSUPP, "punch hole changing size refused");
+    check(filetable_ifallocate(&ft, i, 0, 0, 10*EXTENTSZ)==0 &&
+          ft.size[i]==10*EXTENTSZ, "preallocate and extend");
+    filetable_unpin(&ft, i, 1);
+
+    /* Writes stop at the largest file size and within the budget */
+    filetable_init(&loaded);
+    filetable_limit(&loaded, 8*EXTENTSZ, 4*EXTENTSZ);
+    check(filetable_write(&loaded, "/big", pages, sizeof(pages),
+                          EXTENTSZ)==3*EXTENTSZ, "write cut short");
+    check(filetable_write(&loaded, "/big", pages, 1, 4*EXTENTSZ)==-EFBIG &&
+          filetable_truncate(&loaded, "/big", 4*EXTENTSZ+1)==-EFBIG,
+          "file too large");
+    check(filetable_write(&loaded, "/b2", pages, 2*EXTENTSZ, 0)==
+          2*EXTENTSZ && filetable_write(&loaded, "/b3", pages,
+                                        sizeof(pages), 0)==-ENOSPC &&
+          filetable_exists(&loaded, "/b3")==-ENOENT,
+          "over budget");
+    check(filetable_write(&loaded, "/b4", pages, 1, 4*EXTENTSZ)==-EFBIG &&
+          filetable_exists(&loaded, "/b4")==-ENOENT,
+          "refused write creates nothing");
+    check(filetable_used(&loaded) < 8*EXTENTSZ &&
+          filetable_write(&loaded, "/big", pages, 10, EXTENTSZ)==10,
+          "overwrite within budget");
+    filetable_free(&loaded);
+
+    /* Preallocation follows the largest file size, not MAXFILESZ */
+    filetable_init(&loaded);
+    filetable_limit(&loaded, 0, 2*(off_t)MAXFILESZ);
+    filetable_write(&loaded, "/huge", "x", 1, 0);
+    i = filetable_open(&loaded, "/huge");
+    check(filetable_ifallocate(&loaded, i, 0, MAXFILESZ, EXTENTSZ)==0 &&
+          loaded.size[i]==MAXFILESZ + EXTENTSZ,
+          "preallocate past MAXFILESZ");
+    check(filetable_ifallocate(&loaded, i, 0, 2*(off_t)MAXFILESZ,
+                               1)==-EFBIG, "preallocate past maxsize");
+    filetable_unpin(&loaded, i, 1);
+    filetable_free(&loaded);
+
+    /* Names must fit a container record with their terminating zero */
+    memset(longname, 'n', MAXNAMESZ);
+    longname[0] = '/' ;
+    longname[MAXNAMESZ] = 0 ;
+    check(filetable_create(&ft, longname, 0644)==-ENAMETOOLONG &&
+          filetable_write(&ft, longname, "x", 1, 0)==-ENAMETOOLONG &&
+          filetable_rename(&ft, "/src", longname)==-ENAMETOOLONG,
+          "name too long");
+    longname[MAXNAMESZ-1] = 0 ;
+    check(filetable_create(&ft, longname, 0644)==0 &&
+          filetable_unlink(&ft, longname)==0, "longest name");
+
+    /* Counters must match what is actually in the table */
+    for (i=filetable_next(&ft, 0) ; i>=0 ; i=filetable_next(&ft, i+1)) {
+        nfiles++ ;
+        bytes     += ft.size[i] ;
+        allocated += memfile_allocated(ft.rec+i) ;
+        names     += slab_size(strlen(ft.name[i]) + 1) ;
+        inlined   += ft.rec[i].store==MF_INLINE ? ft.size[i] : 0 ;
+        if (ft.size[i]!=ft.rec[i].size ||
+            ft.alloc[i]!=memfile_allocated(ft.rec+i)) {
+            break ;
+        }
+    }
+    check(i<0, "dense arrays mirror records");
+    check(nfiles==ft.nfiles, "file counter");
+    check(bytes==ft.bytes, "bytes counter");
+    check(allocated==ft.allocated, "allocated counter");
+    check(names==ft.names, "names counter");
+    filetable_memory(&ft, &m);
+    check(m.files==nfiles && m.size==bytes && m.inlined==inlined &&
+          m.bodies + m.pages==filetable_allocated(&ft),
+          "memory accounting");
+
+    filetable_free(&ft);
+
+    /* Chunk headers take no object slot */
+    slab_destroy();
+    check(slab_reserve(SLAB_MAXSZ, SLAB_CHUNKSZ/SLAB_MAXSZ)==0 &&
+          slab_chunks()==1, "slab chunk filled");
+    slab_destroy();
+    printf("All tests passed.\n");
+    return 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "logger.h"
+#include "check.h"
+
+/*
+ * Several threads log at once through the ring buffer. Every message
+ * must come out whole, or be counted as dropped.
+ */
+#define NTHREADS    4
+#define NMSG        2000
+
+/* Counts how many times LOG() evaluated its arguments */
+static int nhits ;
+static int hit(void)
+{
+    return ++nhits ;
+}
+
+static void * worker(void * arg)
+{
+    int i ;
+
+    for (i=0 ; i<NMSG ; i++) {
+        logger("thread %d msg %d %s %lld %.1f %u%%",
+               (int)(intptr_t)arg, i, "/some/path",
+               (long long)i * 1000000000LL, 0.5, 7u);
+    }
+    return NULL ;
+}
+
+int main(void)
+{
+    char        logname[] = "/tmp/test_logger.XXXXXX" ;
+    char        line[256] ;
+    char        want[256] ;
+    pthread_t   th[NTHREADS] ;
+    FILE *      f ;
+    int         i, t, m, nlines=0, nbad=0, nstar=0 ;
+
+    close(mkstemp(logname));
+    logger_setname(logname);
+    /* '*' is not packed, the caller formats the message */
+    logger("star %*d", 5, 42);
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_create(th+i, NULL, worker, (void*)(intptr_t)i);
+    }
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_join(th[i], NULL);
+    }
+    logger_stop();
+
+    f = fopen(logname, "r");
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, "star    42\n")) {
+            nstar++ ;
+            continue ;
+        }
+        if (strstr(line, "messages dropped")) {
+            continue ;
+        }
+        /* Skip the date and time */
+        if (sscanf(line + 20, "thread %d msg %d", &t, &m)!=2) {
+            nbad++ ;
+            continue ;
+        }
+        sprintf(want, "thread %d msg %d /some/path %lld 0.5 7%%\n",
+                t, m, (long long)m * 1000000000LL);
+        if (strcmp(line + 20, want)) {
+            nbad++ ;
+        }
+        nlines++ ;
+    }
+    fclose(f);
+    unlink(logname);
+    check(nbad==0, "messages come out whole");
+    check(nstar==1, "unsupported conversion formatted");
+    check(nlines + logger_dropped()==NTHREADS * NMSG,
+          "messages written or counted as dropped");
+
+    /* Once stopped, messages are written synchronously */
+    logger_setname(logname);
+    logger("after %s", "stop");
+    f = fopen(logname, "r");
+    check(f && fgets(line, sizeof(line), f) && strstr(line, "after stop"),
+          "logging after stop");
+    fclose(f);
+
+    /* Levels */
+    check(logger_configure("bogus")==-1, "unknown level refused");
+    check(logger_configure("info+disk:debug")==-1,
+          "unknown subsystem refused");
+    check(logger_configure("fuse:")==-1, "missing level refused");
+    check(logger_level[LOG_FUSE]==LVL_INFO, "invalid spec changes nothing");
+    check(logger_configure("warn+fuse:debug")==0, "valid spec accepted");
+    check(logger_level[LOG_FUSE]==LVL_DEBUG &&
+          logger_level[LOG_CRYPTO]==LVL_WARN, "levels set per subsystem");
+    nhits = 0 ;
+    LOG(LOG_FUSE, LVL_DEBUG, "debug %d", hit());
+    LOG(LOG_CACHE, LVL_INFO, "info %d", hit());
+    LOG(LOG_FUSE, LVL_TRACE, "trace %d", hit());
+    check(nhits==1, "disabled levels skip their arguments");
+    logger_signals();
+    raise(SIGUSR1);
+    raise(SIGUSR1);
+    check(logger_level[LOG_FUSE]==LVL_TRACE &&
+          logger_level[LOG_CACHE]==LVL_DEBUG, "SIGUSR1 raises levels");
+    nhits = 0 ;
+    LOG(LOG_FUSE, LVL_TRACE, "trace %d", hit());
+    check(nhits==(LOG_FLOOR>=LVL_TRACE), "trace calls follow LOG_FLOOR");
+    raise(SIGUSR2);
+    check(logger_level[LOG_FUSE]==LVL_DEBUG &&
+          logger_level[LOG_CACHE]==LVL_WARN, "SIGUSR2 restores levels");
+    unlink(logname);
+    printf("All tests passed.\n");
+    return 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "check.h"
+
+/* More threads at once than there are slots, some have to share */
+#define NTHREADS    (STATS_MAXTHREADS + 6)
+#define NREQ        1000
+
+static pthread_barrier_t barrier ;
+
+/* Record a request that started ns nanoseconds ago */
+static void record(int op, uint64_t ns, int64_t ret)
+{
+    stats_done(op, stats_start() - ns, ret);
+}
+
+static void * worker(void * arg)
+{
+    int i ;
+
+    pthread_barrier_wait(&barrier);
+    for (i=0 ; i<NREQ ; i++) {
+        record(STATS_READ, 1000, 4096);
+    }
+    return NULL ;
+}
+
+static void memory(stats_memory * m)
+{
+    memset(m, 0, sizeof(stats_memory));
+    m->files  = 2 ;
+    m->size   = 5000 ;
+    m->bodies = 0 ;
+    m->pages  = 4096 ;
+}
+
+/* True if v is within 1/16th above want, plus timing noise */
+static int close_to(uint64_t v, uint64_t want)
+{
+    return v>=want && v<=want + want/16 + 20000 ;
+}
+
+int main(void)
+{
+    pthread_t   th[NTHREADS] ;
+    stats_mark  m ;
+    char *      rep ;
+    char *      mem ;
+    size_t      len ;
+    size_t      sz = 64 << 20 ;
+    int         i ;
+
+    /* Latencies of 1 to 1000 microseconds */
+    for (i=1 ; i<=1000 ; i++) {
+        record(STATS_GETATTR, i*1000ULL, 0);
+    }
+    check(stats_count(STATS_GETATTR)==1000, "requests counted");
+    check(close_to(stats_quantile(STATS_GETATTR, 0.5), 500000), "p50");
+    check(close_to(stats_quantile(STATS_GETATTR, 0.99), 990000), "p99");
+    check(close_to(stats_quantile(STATS_GETATTR, 1.0), 1000000), "max");
+    check(stats_quantile(STATS_UNLINK, 0.99)==0, "no requests, no latency");
+
+    /* Values out of range land in the last bucket */
+    record(STATS_STATFS, 1ULL<<40, 0);
+    check(stats_quantile(STATS_STATFS, 1.0)>=STATS_MAXNS, "clamped");
+
+    pthread_barrier_init(&barrier, NULL, NTHREADS);
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_create(th+i, NULL, worker, NULL);
+    }
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_join(th[i], NULL);
+    }
+    check(stats_count(STATS_READ)==NTHREADS * NREQ,
+          "per-thread counts add up");
+
+    /* Slots of exited threads are reused and keep their counts */
+    for (i=0 ; i<4 ; i++) {
+        pthread_barrier_destroy(&barrier);
+        pthread_barrier_init(&barrier, NULL, 1);
+        pthread_create(th, NULL, worker, NULL);
+        pthread_join(th[0], NULL);
+    }
+    check(stats_count(STATS_READ)==(NTHREADS+4) * NREQ,
+          "counts survive threads");
+
+    record(STATS_WRITE, 1000, 100);
+    record(STATS_WRITE, 1000, -28);
+    rep = stats_report(0, &len);
+    check(rep && strlen(rep)==len, "text report");
+    check(strstr(rep, "\nread ")!=NULL, "text report lists reads");
+    free(rep);
+    rep = stats_report(1, &len);
+    check(rep && rep[0]=='{' && rep[len-2]=='}', "json report");
+    check(strstr(rep, "\"write\":{\"count\":2,\"errors\":1,"
+                      "\"bytes\":100,")!=NULL, "json counts");
+    free(rep);
+
+    /* Phases of a load, touching fresh pages to fault them in */
+    rep = stats_report(0, &len);
+    check(strstr(rep, "load: decrypt")==NULL, "no phase before load");
+    free(rep);
+    stats_mark_now(&m);
+    mem = malloc(sz);
+    memset(mem, 1, sz);
+    stats_phase(STATS_LOAD_DECRYPT, &m, sz);
+    free(mem);
+    stats_phase_set(STATS_SAVE_WRITE, 2000000, 1000000);
+    rep = stats_report(0, &len);
+    check(strstr(rep, "\nload: decrypt ")!=NULL, "text report phases");
+    check(strstr(rep, "load: map")==NULL, "phases not run left out");
+    free(rep);
+    rep = stats_report(1, &len);
+    check(strstr(rep, "\"save: write\":{\"ms\":2.000,"
+                      "\"bytes\":1000000,\"mb_per_s\":500.0,"
+                      "\"faults\":-1}")!=NULL, "json phases");
+    check(strstr(rep, "\"load: decrypt\":{")!=NULL &&
+          strstr(rep, "\"faults\":0}")==NULL, "page faults counted");
+    free(rep);
+
+    /* Memory accounting, only once a source is set */
+    check(strstr(rep = stats_report(0, &len), "\nslack")==NULL,
+          "no memory without source");
+    free(rep);
+    stats_memory_source(memory);
+    rep = stats_report(0, &len);
+    check(strstr(rep, "\ncontents                     4096\n") &&
+          strstr(rep, "\nslack                        -904\n"),
+          "text memory");
+    free(rep);
+    rep = stats_report(1, &len);
+    check(strstr(rep, ",\"memory\":{\"files\":2,\"size\":5000,")!=NULL,
+          "json memory");
+    free(rep);
+
+    stats_reset();
+    check(stats_count(STATS_READ)==0 && stats_count(STATS_GETATTR)==0,
+          "reset");
+    rep = stats_report(0, &len);
+    check(strstr(rep, "\nload: decrypt ")!=NULL, "phases survive reset");
+    free(rep);
+    record(STATS_READ, 1000, 10);
+    check(stats_count(STATS_READ)==1, "counting after reset");
+    printf("All tests passed.\n");
+    return 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "check.h"
+
+#define NTHREADS    4
+#define NSPANS      1000
+
+/* Number of times s occurs in buf */
+static int count(const char * buf, const char * s)
+{
+    int n = 0 ;
+
+    while ((buf = strstr(buf, s))!=NULL) {
+        n++ ;
+        buf += strlen(s) ;
+    }
+    return n ;
+}
+
+static void * worker(void * arg)
+{
+    uint64_t    t0 ;
+    int         i ;
+
+    for (i=0 ; i<NSPANS ; i++) {
+        t0 = TRACE_BEGIN();
+        TRACE_END("work", t0, i);
+    }
+    return NULL ;
+}
+
+int main(void)
+{
+    char        name[] = "/tmp/test_trace.XXXXXX" ;
+    char        line[256] ;
+    pthread_t   th[NTHREADS] ;
+    char *      rep ;
+    size_t      len ;
+    uint64_t    t0 ;
+    FILE *      f ;
+    int         i ;
+
+    /* Off by default: no span */
+    t0 = TRACE_BEGIN();
+    check(t0==0, "off by default");
+    TRACE_END("off", t0, 0);
+
+    close(mkstemp(name));
+    check(trace_start(name)==0, "start");
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_create(th+i, NULL, worker, NULL);
+    }
+    for (i=0 ; i<NTHREADS ; i++) {
+        pthread_join(th[i], NULL);
+    }
+    t0 = TRACE_BEGIN();
+    usleep(2000);
+    TRACE_END("sleep", t0, 42);
+
+    rep = trace_report(&len);
+    check(rep && strlen(rep)==len, "report");
+    check(count(rep, "\"ph\":\"X\"")==NTHREADS * NSPANS + 1,
+          "one event per span");
+    check(count(rep, "\"name\":\"off\"")==0, "nothing recorded while off");
+    check(strstr(rep, "\"name\":\"sleep\"") &&
+          strstr(rep, "\"value\":42"), "span name and value");
+    free(rep);
+
+    /* A full buffer keeps the most recent spans */
+    for (i=0 ; i<TRACE_NREC + 10 ; i++) {
+        trace_span("wrap", trace_clock(), 1, i);
+    }
+    rep = trace_report(&len);
+    /* The oldest span may be overwritten while reading, it is skipped */
+    check(count(rep, "\"name\":\"wrap\"")==TRACE_NREC-1, "ring wraps");
+    sprintf(line, "\"value\":%d}", TRACE_NREC + 9);
+    check(strstr(rep, line)!=NULL, "latest span kept");
+    free(rep);
+
+    trace_stop();
+    check(TRACE_BEGIN()==0, "stop");
+    f = fopen(name, "r");
+    check(f && fgets(line, sizeof(line), f) &&
+          !strncmp(line, "{\"displayTimeUnit\"", 18), "written at stop");
+    fclose(f);
+    unlink(name);
+    check(trace_start("/nonexistent/trace.json")==-1, "bad path refused");
+    check(trace_dropped()==0, "nothing dropped");
+    printf("All tests passed.\n");
+    return 0 ;
+}
+/* vim: set ts=4 et sw=4 tw=75 */